@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 
 #include <iostream>
 #include <algorithm>
@@ -34,26 +35,6 @@ namespace
 			v /= absmax;
 	}
 
-	std::vector<std::vector<float>> StrideWindows(const std::vector<float>& data, size_t blocksize, size_t overlap)
-	{
-		// https://stackoverflow.com/questions/21344296/striding-windows/21345055
-		std::vector<std::vector<float>> res;
-		size_t minlen = (data.size() - overlap) / (blocksize - overlap);
-		size_t start_idx = 0;
-		for (size_t i = 0; i < blocksize; ++i)
-		{
-			res.emplace_back(std::vector<float>());
-			std::vector<float>& block = res.back();
-			size_t idx = start_idx++;
-			for (size_t j = 0; j < minlen; ++j)
-			{
-				block.push_back(data[idx]);
-				idx += blocksize - overlap;
-			}
-		}
-		return res;
-	}
-
 	int Detrend(std::vector<std::vector<float>>& data)
 	{
 		size_t nocols = data[0].size();
@@ -107,6 +88,148 @@ namespace
 		return std::string(buf);
 	}
 
+	constexpr finder::uint16 WAVE_FORMAT_PCM = 0x0001;
+	constexpr finder::uint16 WAVE_FORMAT_IEEE_FLOAT = 0x0003;
+	constexpr finder::uint16 WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
+
+	finder::uint16 GetU16(const finder::byte* p)
+	{
+		return p[0] | (p[1] << 8);
+	}
+
+	finder::uint32 GetU32(const finder::byte* p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((finder::uint32) p[3] << 24);
+	}
+
+	struct WavLayout
+	{
+		finder::uint16 format; // PCM or IEEE float, after resolving WAVE_FORMAT_EXTENSIBLE
+		finder::uint16 channels;
+		finder::uint32 sample_rate;
+		finder::uint16 block_align;
+		finder::uint16 bits;
+		const finder::byte* data;
+		size_t n_frames;
+	};
+
+	/*
+	 * Walks the RIFF chunks for "fmt " and "data". Only plain 16/24/32-bit integer and 32-bit float PCM is accepted;
+	 * anything else (compressed formats, 8-bit, doubles, RF64, truncated headers) is left to sndfile.
+	 */
+	bool ParseWav(const finder::byte* file, size_t size, WavLayout& out)
+	{
+		if (size < 12 || memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "WAVE", 4) != 0)
+			return false;
+
+		bool have_fmt = false;
+		size_t pos = 12;
+		while (pos + 8 <= size)
+		{
+			const finder::byte* chunk = file + pos;
+			size_t chunk_size = GetU32(chunk + 4);
+			size_t body = pos + 8;
+
+			if (memcmp(chunk, "fmt ", 4) == 0)
+			{
+				if (chunk_size < 16 || body + chunk_size > size)
+					return false;
+				out.format = GetU16(file + body);
+				out.channels = GetU16(file + body + 2);
+				out.sample_rate = GetU32(file + body + 4);
+				out.block_align = GetU16(file + body + 12);
+				out.bits = GetU16(file + body + 14);
+				// The real format is in the first two bytes of the subformat GUID
+				if (out.format == WAVE_FORMAT_EXTENSIBLE)
+				{
+					if (chunk_size < 40)
+						return false;
+					out.format = GetU16(file + body + 24);
+				}
+				have_fmt = true;
+			}
+			else if (memcmp(chunk, "data", 4) == 0)
+			{
+				if (!have_fmt)
+					return false;
+
+				bool supported = (out.format == WAVE_FORMAT_PCM && (out.bits == 16 || out.bits == 24 || out.bits == 32))
+					|| (out.format == WAVE_FORMAT_IEEE_FLOAT && out.bits == 32);
+				if (!supported || out.channels == 0 || out.sample_rate == 0 || out.block_align < out.channels * (out.bits / 8))
+					return false;
+
+				// Files that were still being written (or streamed) can claim more data than there is
+				size_t available = std::min(chunk_size, size - body);
+				out.data = file + body;
+				out.n_frames = available / out.block_align;
+				return out.n_frames > 0; // Empty or cut off before the first frame, let sndfile turn it down as before
+			}
+
+			pos = body + chunk_size + (chunk_size & 1); // Chunks are word-aligned
+		}
+
+		return false;
+	}
+
+	/*
+	 * Converts one channel straight out of the mapping, to the same scale sf_readf_short would have given us so
+	 * fingerprints don't change depending on which path decoded the file
+	 */
+	template<typename T>
+	void ReadChannel(const WavLayout& wav, int channel, T* out, size_t stride)
+	{
+		const finder::byte* frame = wav.data + channel * (wav.bits / 8);
+		switch (wav.format == WAVE_FORMAT_IEEE_FLOAT ? 0 : wav.bits)
+		{
+		case 16:
+			for (size_t i = 0; i < wav.n_frames; i++, frame += wav.block_align)
+				out[i * stride] = (finder::int16) GetU16(frame);
+			break;
+		case 24:
+			for (size_t i = 0; i < wav.n_frames; i++, frame += wav.block_align)
+				out[i * stride] = (finder::int32) ((frame[0] << 8) | (frame[1] << 16) | ((finder::uint32) frame[2] << 24)) >> 16;
+			break;
+		case 32:
+			for (size_t i = 0; i < wav.n_frames; i++, frame += wav.block_align)
+				out[i * stride] = (finder::int32) GetU32(frame) >> 16;
+			break;
+		case 0:
+			for (size_t i = 0; i < wav.n_frames; i++, frame += wav.block_align)
+			{
+				float v;
+				finder::uint32 bits = GetU32(frame);
+				memcpy(&v, &bits, sizeof(v));
+				out[i * stride] = std::clamp(lrintf(v * 32767.0f), -32768L, 32767L);
+			}
+			break;
+		}
+	}
+}
+
+namespace finder
+{
+	std::vector<std::vector<float>> StrideWindows(const std::vector<float>& data, size_t blocksize, size_t overlap)
+	{
+		// https://stackoverflow.com/questions/21344296/striding-windows/21345055
+		std::vector<std::vector<float>> res;
+		if (data.size() < blocksize || overlap >= blocksize)
+			return res; // Not even one window's worth
+		size_t minlen = (data.size() - overlap) / (blocksize - overlap);
+		size_t start_idx = 0;
+		for (size_t i = 0; i < blocksize; ++i)
+		{
+			res.emplace_back(std::vector<float>());
+			std::vector<float>& block = res.back();
+			size_t idx = start_idx++;
+			for (size_t j = 0; j < minlen; ++j)
+			{
+				block.push_back(data[idx]);
+				idx += blocksize - overlap;
+			}
+		}
+		return res;
+	}
+
 	void GenerateHashes(std::vector<std::pair<int, int>>& v_in, boost::unordered_map<std::string, int>& out)
 	{
 		// Sorting
@@ -119,7 +242,7 @@ namespace
 		});
 		for (int i = 0; i < v_in.size(); i++)
 		{
-			for (int j = 1; j < finder::settings.default_fan_value; j++)
+			for (int j = 1; j < settings.default_fan_value; j++)
 			{
 				if (i + j >= v_in.size())
 					continue;
@@ -129,21 +252,27 @@ namespace
 				int time1 = v_in[i].second;
 				int time2 = v_in[i + j].second;
 				int t_delta = time2 - time1;
-				if ((t_delta >= finder::settings.min_hash_time_delta) && (t_delta <= finder::settings.max_hash_time_delta))
+				if ((t_delta >= settings.min_hash_time_delta) && (t_delta <= settings.max_hash_time_delta))
 				{
-					char buffer[100];
-					snprintf(buffer, sizeof(buffer), "%d|%d|%d", freq1, freq2, t_delta);
-					std::string to_be_hashed = buffer;
-					std::string hash_result = GetSHA1(to_be_hashed).erase(finder::settings.fingerprint_reduction, 40);
-
-					out.emplace(hash_result, time1);
+					out.emplace(HashPeakPair(freq1, freq2, t_delta), time1);
 				}
 			}
 		}
 	}
 
-	void Get2DPeaks(cv::Mat data, std::vector<std::pair<int, int>>& out)
+	std::string HashPeakPair(int freq1, int freq2, int t_delta)
 	{
+		char buffer[100];
+		snprintf(buffer, sizeof(buffer), "%d|%d|%d", freq1, freq2, t_delta);
+		std::string to_be_hashed = buffer;
+
+		return GetSHA1(to_be_hashed).erase(settings.fingerprint_reduction, 40);
+	}
+
+	void Get2DPeaks(const cv::Mat& data, std::vector<std::pair<int, int>>& out)
+	{
+		FINDER_PROFILE(PROFILE_PEAKS);
+
 		// Generate binary structure and apply maximum filter
 		cv::Mat tmpkernel = cv::getStructuringElement(cv::MORPH_CROSS, cv::Size(3, 3), cv::Point(-1, -1));
 		cv::Mat kernel = cv::Mat(finder::settings.peak_neighborhood_size * 2 + 1, finder::settings.peak_neighborhood_size * 2 + 1, CV_8U, uint8_t(0));
@@ -167,14 +296,95 @@ namespace
 			}
 		}
 	}
-}
 
-namespace finder
-{
+	void ComputeSpectrogram(const std::vector<float>& samples, cv::Mat& out)
+	{
+		/*
+		 * FFT the signal and extract frequency components
+		 */
+		int max_freq = 0; // One-sided; reference mlab.py
+		if (finder::settings.default_window_size % 2)
+			max_freq = int(std::floor((finder::settings.default_window_size + 1) / 2));
+		else
+			max_freq = int(std::floor(finder::settings.default_window_size / 2)) + 1;
+
+		// Apply hanning windows
+		std::vector<std::vector<float>> blocks;
+		std::vector<float> hann_window;
+		cv::Mat result;
+		{
+			FINDER_PROFILE(PROFILE_FRAMING);
+			blocks = StrideWindows(samples, finder::settings.default_window_size, finder::settings.default_window_size * finder::settings.default_overlap_ratio);
+			if (blocks.empty())
+			{
+				out.release();
+				return;
+			}
+			hann_window = CreateWindow(finder::settings.default_window_size);
+			ApplyWindow(hann_window, blocks);
+			Detrend(blocks);
+			// Reshape
+			result.create(blocks[0].size(), blocks.size(), CV_32F);
+			for (int i = 0; i < result.rows; i++)
+			{
+				for (int j = 0; j < result.cols; j++)
+					result.at<float>(i, j) = blocks[j][i];
+			}
+		}
+		// He looooves fourier transforms!
+		{
+			FINDER_PROFILE(PROFILE_FFT);
+			cv::dft(result, result, cv::DftFlags::DFT_COMPLEX_OUTPUT | cv::DftFlags::DFT_ROWS, 0);
+			cv::mulSpectrums(result, result, result, 0, true); // i.e. result *= conj(result)
+		}
+
+		// Compute the DFT sample frequencies
+		FINDER_PROFILE(PROFILE_LOG_SCALE);
+		cv::Mat& freqs = out;
+		freqs.create(max_freq, blocks[0].size(), CV_32F);
+		for (int i = 0; i < max_freq; i++)
+		{
+			for (int j = 0; j < freqs.cols; j++)
+				freqs.at<float>(i, j) = result.ptr<float>(j)[2 * i];
+		}
+		for (int i = 1; i < freqs.rows - 1; i++)
+		{
+			for (int j = 0; j < freqs.cols; j++)
+				freqs.at<float>(i, j) *= 2;
+		}
+
+		// Divide by sampling frequency so that density function has units of dB/Hz and can be integrated by the plotted frequency values.
+		freqs /= finder::settings.fs;
+		float sum = 0.0f;
+		for (float window: hann_window)
+			sum += fabsf(window) * fabsf(window);
+		// Scale the spectrum by the norm of the window to compensate for windowing loss;
+		// See Bendat & Piersol Sec 11.5.2.
+		freqs /= sum;
+
+		/*
+		 * Apply log transform since specgram function returns linear array. 0s are excluded to avoid np warning.
+		 */
+		for (int i = 0; i < freqs.rows; i++)
+		{
+			for (int j = 0; j < freqs.cols; j++)
+			{
+				if (freqs.at<float>(i, j) < std::numeric_limits<float>::epsilon())
+					freqs.at<float>(i, j) = std::numeric_limits<float>::epsilon();
+				freqs.at<float>(i, j) = 10 * log10(freqs.at<float>(i, j));
+				// See https://github.com/worldveil/dejavu/issues/118
+				// if (freqs.at<float>(i, j) == -INFINITY)
+				//     freqs.at<float>(i, j) = 0;
+			}
+		}
+	}
+
+	/****************************************************************/
+
 	AudioFile::AudioFile():
 		volume(1.0f),
+		digest(0),
 		loaded(false),
-		sdl_object(nullptr),
 		processed(false)
 	{
 		dims[0] = 0;
@@ -183,59 +393,93 @@ namespace finder
 
 	AudioFile::~AudioFile()
 	{
-		if (sdl_object)
-			Mix_FreeMusic(sdl_object);
 	}
 
-	ErrCode AudioFile::Load(const std::string& path, bool load_sdl)
+	/*
+	 * Decodes the file once. Analysis only needs the first channel; when it's for playback, all channels are kept long
+	 * enough to hand them to a PcmPlayer.
+	 */
+	ErrCode AudioFile::Load(const std::string& path, bool for_playback)
 	{
+		FINDER_PROFILE_TRACK(path);
+		FINDER_PROFILE(PROFILE_DECODE);
 		this->path = path;
 
 		// Clear out any old data
 		Reset();
 
-		// Loading the file twice is crude, but SDL doesn't have a better way to play audio that's already in memory (e.g. by sndfile)
-		// I guess in theory we could ditch sndfile and just use SDL, but I prefer sndfile's API :^)
-		if (load_sdl)
-			sdl_object = Mix_LoadMUS(path.c_str());
+		std::vector<int16> interleaved;
+		int channels = 0;
+		int rate = 0;
 
-		// Anyways, let's load it using sndfile now
-		SF_INFO sfinfo;
-		memset(&sfinfo, 0, sizeof(sfinfo));
-		SNDFILE* sf_in = sf_open(path.c_str(), SFM_READ, &sfinfo);
-		if (!sf_in)
+		// Plain PCM WAV files are read in place, which skips sndfile's buffers and the intermediate short copy
+		MappedFile mapped;
+		WavLayout wav;
+		if (mapped.Open(path) == SUCCESS && ParseWav(mapped.Data(), mapped.Size(), wav))
 		{
-			std::cerr << "Failed to open audio file: " << sf_strerror(sf_in) << std::endl;
-			return FAILURE;
+			sample_data.resize(wav.n_frames);
+			ReadChannel(wav, 0, sample_data.data(), 1);
+
+			channels = wav.channels;
+			rate = wav.sample_rate;
+			if (for_playback)
+			{
+				interleaved.resize(wav.n_frames * channels);
+				for (int c = 0; c < channels; c++)
+					ReadChannel(wav, c, interleaved.data() + c, channels);
+			}
 		}
+		else
+		{
+			// Anyways, let's load it using sndfile now
+			SF_INFO sfinfo;
+			memset(&sfinfo, 0, sizeof(sfinfo));
+			SNDFILE* sf_in = sf_open(path.c_str(), SFM_READ, &sfinfo);
+			if (!sf_in)
+			{
+				std::cerr << "Failed to open audio file: " << sf_strerror(sf_in) << std::endl;
+				return FAILURE;
+			}
 
-		double fs = sfinfo.samplerate;
-		sf_count_t n_frames = sfinfo.frames;
-		sf_count_t n_samples = sfinfo.frames * sfinfo.channels;
+			channels = sfinfo.channels;
+			rate = sfinfo.samplerate;
+			sf_count_t n_frames = sfinfo.frames;
+			interleaved.resize(n_frames * channels);
 
-		short* stereo_datai = new short[n_samples];
-		sample_data.resize(n_frames);
+			sf_count_t n_read = sf_readf_short(sf_in, interleaved.data(), n_frames);
+			if (n_read == 0) // != n_frames)
+			{
+				std::cerr << "Error reading data from audio file: " << sf_strerror(sf_in) << std::endl;
+				sf_close(sf_in);
+				return FAILURE;
+			}
+			sf_close(sf_in);
 
-		sf_count_t n_read = sf_readf_short(sf_in, stereo_datai, n_frames);
-		if (n_read == 0) // != n_frames)
-		{
-			std::cerr << "Error reading data from audio file: " << sf_strerror(sf_in) << std::endl;
-			return FAILURE;
+			// Convert data to mono
+			sample_data.resize(n_frames);
+			for (int i = 0; i < n_frames; i++)
+			{
+				float v = 0;
+				// Uncomment later to restore original behavior; opting to do this instead of averaging to better replicate DejaVu.
+				//for (int c = 0; c < sfinfo.channels; c++)
+				v += (float) interleaved[i * channels + 0 /* c */];
+				sample_data[i] = v;// * (1.0f / 65536.0f);
+			}
 		}
-		sf_close(sf_in);
+		mapped.Close();
 
-		length = n_frames / fs;
+		length = sample_data.size() / (double) rate;
 
-		// Convert data to mono
-		for (int i = 0; i < n_frames; i++)
+		if (for_playback)
 		{
-			float v = 0;
-			// Uncomment later to restore original behavior; opting to do this instead of averaging to better replicate DejaVu.
-			//for (int c = 0; c < sfinfo.channels; c++)
-			v += (float) stereo_datai[i * sfinfo.channels + 0 /* c */];
-			sample_data[i] = v;// * (1.0f / 65536.0f);
+			waveform.Build(sample_data);
+
+			player.reset(new PcmPlayer());
+			if (player->Open(interleaved.data(), sample_data.size(), channels, rate) != SUCCESS)
+				player.reset();
+			else
+				player->SetVolume(volume);
 		}
-		delete[] stereo_datai;
 
 		loaded = true;
 
@@ -244,207 +488,132 @@ namespace finder
 
 	void AudioFile::Play(bool loop)
 	{
-		if (!Mix_PlayingMusic())
-		{
-			AdjustVolume(volume);
-			Mix_PlayMusic(sdl_object, -((int) loop));
-		}
-		else
-		{
-			Mix_ResumeMusic();
-		}
+		if (player)
+			player->Play(loop);
 	}
 
 	void AudioFile::Pause()
 	{
-		Mix_PauseMusic();
+		if (player)
+			player->Pause();
 	}
 
 	void AudioFile::Stop()
 	{
-		Mix_SetMusicPosition(0);
-		Mix_HaltMusic();
+		if (player)
+			player->Stop();
+	}
+
+	void AudioFile::Seek(double seconds)
+	{
+		if (player)
+			player->Seek(seconds);
 	}
 
 	void AudioFile::AdjustVolume(float volume)
 	{
 		this->volume = volume;
-		Mix_VolumeMusic((int) (volume * 128.0f));
+		if (player)
+			player->SetVolume(volume);
 	}
 
 	void AudioFile::Reload()
 	{
+		bool for_playback = player != nullptr;
 		Stop();
-		Load(path);
+		Load(path, for_playback);
 	}
 
-	void AudioFile::Reset(bool reset_sdl, bool reset_samples)
+	void AudioFile::Reset(bool reset_playback, bool reset_samples)
 	{
-		if (sdl_object && reset_sdl)
-			Mix_FreeMusic(sdl_object);
+		if (reset_playback)
+			player.reset();
 		if (!sample_data.empty() && reset_samples)
+		{
 			sample_data.clear();
+			waveform.Clear();
+		}
+	}
+
+	bool AudioFile::IsPlaying() const
+	{
+		return player && player->IsPlaying();
 	}
 
-	std::unique_ptr<Bitmap> AudioFile::RenderWaveform()
+	double AudioFile::GetPosition() const
+	{
+		return player ? player->GetPosition() : 0.0;
+	}
+
+	/*
+	 * Draws [from, to) of the track (as fractions of its length), one column per pixel: the min to max range, with the
+	 * RMS level on top
+	 */
+	std::unique_ptr<Bitmap> AudioFile::RenderWaveform(float from, float to)
 	{
 		std::unique_ptr<Bitmap> bmp(new Bitmap(1024, 512));
 
 		bmp->Clear(0xFF000000);
-
-		float absmax = 0.0f;
-		for (int i = 0; i < sample_data.size(); i++)
-			absmax = std::max(absmax, fabsf(sample_data[i]));
-		for (int x = 1; x < sample_data.size(); x++)
+		if (sample_data.empty())
+			return bmp;
+
+		// Files loaded for playback already have one, anything else gets it built on first use
+		if (waveform.IsEmpty())
+			waveform.Build(sample_data);
+		float absmax = waveform.GetPeak();
+		if (absmax == 0.0f)
+			return bmp;
+
+		std::vector<WaveformBin> columns;
+		waveform.Summarize(sample_data, from * sample_data.size(), to * sample_data.size(), bmp->width, columns);
+
+		float yc = (float) bmp->height / 2.0f;
+		float scale = (1.0f / absmax) * (bmp->height / 2.0f);
+		for (int x = 0; x < bmp->width; x++)
 		{
-			float p0 = (float)(x - 1) / (float) sample_data.size();
-			float p1 = (float) x / (float) sample_data.size();
-
-			float yc = (float) bmp->height / 2.0f;
-
-			float sample0 = sample_data[x - 1] * (1.0f / absmax) * (bmp->height / 2.0f);
-			float sample1 = sample_data[x] * (1.0f / absmax) * (bmp->height / 2.0f);
-
-			int xx0 = p0 * bmp->width;
-			int xx1 = p1 * bmp->width;
-
-			bmp->DrawLine(xx0, yc - sample0, xx1, yc - sample1, 0xFFBA4040);
+			const WaveformBin& column = columns[x];
+			bmp->DrawLine(x, yc - column.max * scale, x, yc - column.min * scale, 0xFFBA4040);
+			bmp->DrawLine(x, yc - column.rms * scale, x, yc + column.rms * scale, 0xFFE08080);
 		}
 
 		return bmp;
 	}
 
-	void AudioFile::Process(Bitmap* hd_spectrogram)
+	void AudioFile::Process(SpectrogramPyramid* spectrogram)
 	{
+		FINDER_PROFILE_TRACK(path);
 		peaks.clear();
 		fingerprint.hashes.clear();
+		fingerprint.source = this;
 
-		/*
-		 * FFT the signal and extract frequency components
-		 */
-		int max_freq = 0; // One-sided; reference mlab.py
-		if (finder::settings.default_window_size % 2)
-			max_freq = int(std::floor((finder::settings.default_window_size + 1) / 2));
-		else
-			max_freq = int(std::floor(finder::settings.default_window_size / 2)) + 1;
-
-		// Apply hanning windows
-		std::vector<std::vector<float>> blocks = StrideWindows(sample_data, finder::settings.default_window_size, finder::settings.default_window_size * finder::settings.default_overlap_ratio);
-		std::vector<float> hann_window = CreateWindow(finder::settings.default_window_size);
-		ApplyWindow(hann_window, blocks);
-		Detrend(blocks);
-		// Reshape
-		cv::Mat result(blocks[0].size(), blocks.size(), CV_32F);
-		for (int i = 0; i < result.rows; i++)
-		{
-			for (int j = 0; j < result.cols; j++)
-				result.at<float>(i, j) = blocks[j][i];
-		}
-		// He looooves fourier transforms!
-		cv::dft(result, result, cv::DftFlags::DFT_COMPLEX_OUTPUT | cv::DftFlags::DFT_ROWS, 0);
-		cv::mulSpectrums(result, result, result, 0, true); // i.e. result *= conj(result)
-
-		// Compute the DFT sample frequencies
-		cv::Mat freqs(max_freq, blocks[0].size(), CV_32F);
-		for (int i = 0; i < max_freq; i++)
-		{
-			for (int j = 0; j < freqs.cols; j++)
-				freqs.at<float>(i, j) = result.ptr<float>(j)[2 * i];
-		}
-		for (int i = 1; i < freqs.rows - 1; i++)
+		// Anything shorter than a window has no spectrogram to speak of, so it just gets no hashes
+		if (sample_data.size() < (size_t) finder::settings.default_window_size)
 		{
-			for (int j = 0; j < freqs.cols; j++)
-				freqs.at<float>(i, j) *= 2;
+			processed = true;
+			std::cout << "Too short to fingerprint: " << sample_data.size() << " samples" << std::endl;
+			return;
 		}
 
-		// Divide by sampling frequency so that density function has units of dB/Hz and can be integrated by the plotted frequency values.
-		freqs /= finder::settings.fs;
-		float sum = 0.0f;
-		for (float window: hann_window)
-			sum += fabsf(window) * fabsf(window);
-		// Scale the spectrum by the norm of the window to compensate for windowing loss;
-		// See Bendat & Piersol Sec 11.5.2.
-		freqs /= sum;
-
-		/*
-		 * Apply log transform since specgram function returns linear array. 0s are excluded to avoid np warning.
-		 */
-		for (int i = 0; i < freqs.rows; i++)
-		{
-			for (int j = 0; j < freqs.cols; j++)
-			{
-				if (freqs.at<float>(i, j) < std::numeric_limits<float>::epsilon())
-					freqs.at<float>(i, j) = std::numeric_limits<float>::epsilon();
-				freqs.at<float>(i, j) = 10 * log10(freqs.at<float>(i, j));
-				// See https://github.com/worldveil/dejavu/issues/118
-				// if (freqs.at<float>(i, j) == -INFINITY)
-				//     freqs.at<float>(i, j) = 0;
-			}
-		}
+		cv::Mat final_specgram;
+		ComputeSpectrogram(sample_data, final_specgram);
 
 		// Build the fingerprint!
 		std::cout << "Getting peaks..." << std::endl;
-		cv::Mat& final_specgram = freqs;
 		Get2DPeaks(final_specgram, peaks);
-		GenerateHashes(peaks, fingerprint.hashes);
+		{
+			FINDER_PROFILE(PROFILE_HASHING);
+			GenerateHashes(peaks, fingerprint.hashes);
+		}
 		fingerprint.source = this;
 		processed = true;
 		std::cout << "# of hash/offset pairs after proc: " << fingerprint.hashes.size() << std::endl;
 
-		// Optionally we can render out a spectrogram to look at what's happening
-		if (hd_spectrogram)
+		// Optionally we can keep the spectrogram around to look at what's happening
+		if (spectrogram)
 		{
-			int extent_x = final_specgram.cols;
-			int extent_y = final_specgram.rows;
-
-			dims[0] = extent_x;
-			dims[1] = extent_y;
-
-			hd_spectrogram->width = std::min(extent_x, 8192);
-			hd_spectrogram->height = std::min(extent_y, 8192);
-			delete[] hd_spectrogram->px;
-			hd_spectrogram->px = new int[hd_spectrogram->width * hd_spectrogram->height];
-			hd_spectrogram->Clear(0xFF000000);
-
-			int lo_v = INFINITY;
-			int hi_v = -INFINITY;
-
-			for (int i = 1; i < hd_spectrogram->width - 1; i++)
-			{
-				int vi = (int)(((float) i / (float) hd_spectrogram->width) * extent_x);
-				if (vi < 0) vi = 0;
-				if (vi >= extent_x) vi = extent_x - 1;
-
-				for (int j = 1; j < hd_spectrogram->height - 1; j++)
-				{
-					int vj = (int)(((float) j / (float) hd_spectrogram->height) * extent_y);
-					if (vj < 0) vj = 0;
-					if (vj >= extent_y) vj = extent_y - 1;
-					vj = extent_y - vj;
-
-					float v = final_specgram.at<float>(vj, vi);
-
-					if (v < lo_v) lo_v = v;
-					if (v > hi_v) hi_v = v;
-
-					int r = 0x00, g = 0x00, b = 0x00;
-
-					float rv = v * (255.0f / 80.0f);
-					b += (int)(rv * 2.0f);
-					r += (int)(rv);
-
-					if (r < 0) r = 0; if (r > 255) r = 255;
-					if (g < 0) g = 0; if (g > 255) g = 255;
-					if (b < 0) b = 0; if (b > 255) b = 255;
-
-					hd_spectrogram->px[i + j * hd_spectrogram->width] = 0xFF << 24 | r << 16 | g << 8 | b;
-				}
-			}
-
-#if 0
-			std::cout << lo_v << " => " << hi_v << std::endl;
-			hd_spectrogram->Save("fuck.png");
-#endif
+			dims[0] = final_specgram.cols;
+			dims[1] = final_specgram.rows;
+			spectrogram->Build(final_specgram);
 		}
 	}
 }
@@ -6,9 +6,14 @@
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
 #include <execution>
 #include <chrono>
+#include <functional>
+#include <numeric>
+
+#include <string.h>
 
 namespace
 {
@@ -16,27 +21,207 @@ namespace
 	{
 		return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
 	}
+
+	constexpr char KPSF_MAGIC[4] = { 'K', 'P', 'S', 'F' };
+	constexpr int KPSF_VERSION = 4;
+	constexpr size_t HASH_PAIR_SIZE = 20 + 4;
+	constexpr size_t SEGMENT_ENTRY_SIZE = 8 + 8 + 8;
+	constexpr size_t PROFILE_BLOCK_SIZE = 6 * 4 + 3 * 4;
+
+	/*
+	 * The fingerprint settings a segment was made with. Only the profile hash is needed to pick a segment, but having the
+	 * actual values in the file makes it possible to tell what a segment is without this build.
+	 */
+	void PutProfileBlock(finder::Saver& svr, const finder::Settings& profile)
+	{
+		svr.PutInt(profile.default_fan_value);
+		svr.PutInt(profile.min_hash_time_delta);
+		svr.PutInt(profile.max_hash_time_delta);
+		svr.PutInt(profile.fingerprint_reduction);
+		svr.PutInt(profile.peak_neighborhood_size);
+		svr.PutInt(profile.default_window_size);
+		svr.PutFloat(profile.default_amp_min);
+		svr.PutFloat(profile.default_overlap_ratio);
+		svr.PutFloat(profile.fs);
+	}
+
+	struct CachedTrack
+	{
+		std::string path;
+		float length = 0.0f;
+		finder::uint64 digest = 0;
+		bool owned = false;
+		boost::unordered_map<std::string, int> hashes;
+	};
+
+	using OwnsTrackFn = std::function<bool(const std::string&)>;
+
+	/*
+	 * One fingerprint record; see KPSFFormat.md. Hashes of tracks we don't own are skipped over rather than decoded.
+	 */
+	finder::ErrCode ReadTrackRecord(finder::Loader& ldr, int version, const OwnsTrackFn& owns, std::vector<finder::byte>& scratch, CachedTrack& out)
+	{
+		out.path = ldr.NextString();
+		out.length = ldr.NextFloat();
+		if (version >= 3)
+			out.digest = ldr.NextUInt64();
+		int num_hash_offset_pairs = ldr.NextInt();
+		if (!ldr.Good() || num_hash_offset_pairs < 0)
+			return finder::FAILURE;
+
+		out.owned = owns(out.path);
+		if (!out.owned)
+		{
+			ldr.Skip(num_hash_offset_pairs * HASH_PAIR_SIZE);
+			return finder::SUCCESS;
+		}
+
+		// Pull the whole track's pairs in one read and decode them out of the block
+		scratch.resize(num_hash_offset_pairs * HASH_PAIR_SIZE);
+		if (ldr.NextBytes(scratch.data(), scratch.size()) == finder::FAILURE)
+			return finder::FAILURE;
+
+		out.hashes.reserve(num_hash_offset_pairs);
+		for (int j = 0; j < num_hash_offset_pairs; j++)
+		{
+			const finder::byte* pair = scratch.data() + j * HASH_PAIR_SIZE;
+			int offset = (finder::int32) ((finder::uint32) pair[20] | (finder::uint32) pair[21] << 8 | (finder::uint32) pair[22] << 16 | (finder::uint32) pair[23] << 24);
+			out.hashes.emplace(std::string(reinterpret_cast<const char*>(pair), 20), offset);
+		}
+
+		return finder::SUCCESS;
+	}
+
+	/*
+	 * Version 1 caches have no header or offset table, so there's nothing to do but walk them front to back
+	 */
+	void ReadLegacyCache(finder::Loader& ldr, const OwnsTrackFn& owns, std::vector<CachedTrack>& tracks, float& total_length)
+	{
+		total_length = (float) ldr.NextInt();
+		int num_fps = ldr.NextInt();
+		if (!ldr.Good() || num_fps < 0)
+			return;
+
+		tracks.resize(num_fps);
+		std::vector<finder::byte> scratch;
+		for (int i = 0; i < num_fps; i++)
+		{
+			if (ReadTrackRecord(ldr, 1, owns, scratch, tracks[i]) == finder::FAILURE)
+			{
+				std::cerr << "Cache file is truncated, ignoring the rest of it" << std::endl;
+				tracks.resize(i);
+				return;
+			}
+		}
+	}
+
+	/*
+	 * Version 2+ caches carry the offset of every record, so the records are split into one contiguous run per core and each
+	 * run is decoded (hash maps and all) on its own reader. Offsets are relative to base, the start of the profile segment
+	 * (or of the file, before version 4).
+	 */
+	void ReadIndexedCache(const std::string& cache_path, finder::Loader& ldr, int version, finder::uint64 base, const OwnsTrackFn& owns, std::vector<CachedTrack>& tracks, float& total_length)
+	{
+		total_length = (float) ldr.NextInt();
+		int num_fps = ldr.NextInt();
+		if (!ldr.Good() || num_fps < 0)
+			return;
+
+		std::vector<finder::uint64> offsets(num_fps);
+		for (int i = 0; i < num_fps; i++)
+			offsets[i] = ldr.NextUInt64();
+		if (!ldr.Good() || num_fps == 0)
+			return;
+
+		int num_chunks = std::max(1, std::min<int>(std::thread::hardware_concurrency(), num_fps));
+		std::vector<int> chunks(num_chunks);
+		std::iota(chunks.begin(), chunks.end(), 0);
+		std::vector<int> decoded(num_chunks, 0);
+
+		tracks.resize(num_fps);
+		std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](int c)
+		{
+			int first = (int) ((size_t) num_fps * c / num_chunks);
+			int last = (int) ((size_t) num_fps * (c + 1) / num_chunks);
+
+			finder::Loader chunk_ldr(cache_path);
+			chunk_ldr.Seek(base + offsets[first]);
+			std::vector<finder::byte> scratch;
+			for (int i = first; i < last; i++)
+			{
+				if (ReadTrackRecord(chunk_ldr, version, owns, scratch, tracks[i]) == finder::FAILURE)
+					break;
+				decoded[c]++;
+			}
+		});
+
+		// Keep everything up to the first damaged record, same as a serial read would
+		for (int c = 0; c < num_chunks; c++)
+		{
+			int first = (int) ((size_t) num_fps * c / num_chunks);
+			int last = (int) ((size_t) num_fps * (c + 1) / num_chunks);
+			if (first + decoded[c] < last)
+			{
+				std::cerr << "Cache file " << cache_path << " is truncated, ignoring the rest of it" << std::endl;
+				tracks.resize(first + decoded[c]);
+				break;
+			}
+		}
+	}
+
+	bool RanksHigher(const finder::FoundSong& a, const finder::FoundSong& b)
+	{
+		// Prioritize confidence over offsets
+		if (a.overall_confidence > b.overall_confidence) return true;
+		if (b.overall_confidence > a.overall_confidence) return false;
+
+		if (a.offset > b.offset) return true;
+		if (b.offset > a.offset) return false;
+
+		return false;
+	}
 }
 
 namespace finder
 {
+	bool IsAudioPath(const std::string& path)
+	{
+		return EndsWith(path, ".wav") || EndsWith(path, ".mp3");
+	}
+
 	AudioLibrary::AudioLibrary():
+		profile(settings),
 		cached_fps_present(false),
 		loading(false),
-		load_min(0.0f),
-		load_max(1.0f)
+		load_stage(STAGE_IDLE),
+		load_min(0),
+		load_max(1),
+		num_shards(std::max(1u, std::thread::hardware_concurrency())),
+		shard_index(0),
+		shard_count(1)
 	{
+		Publish(nullptr);
 	}
 
 	AudioLibrary::~AudioLibrary()
 	{
+		watcher.reset();
 	}
 
 	ErrCode AudioLibrary::Load(const std::string& path)
 	{
-		loading = true;
+		if (loading.exchange(true))
+		{
+			std::cerr << "Library is busy, not loading" << std::endl;
+			return FAILURE;
+		}
+
+		// Whatever we were watching is about to go away
+		watcher.reset();
+		BeginStage(STAGE_LOADING, 1);
 
-		// Reset state
+		// Reset state. Indexes and snapshots still out there own the tracks they point at, so they stay good.
+		Publish(nullptr);
 		files.clear();
 		fingerprints.clear();
 		matches.clear();
@@ -47,180 +232,623 @@ namespace finder
 		library_path = path;
 		cache_path = path + "/library.kpsf";
 		exclude.clear();
+		other_profiles.clear();
+		profile = settings;
 		
-		// kk, now do the rest of the loading
-		load_min = load_max = 0;
-		for (const auto& file : std::filesystem::recursive_directory_iterator(path))
-			load_max++;
-
+		// kk, now do the rest of the loading. Progress is indeterminate until we know how many files need decoding.
 		avg_length = 0;
 
 		std::thread loading_thread([&]()
 		{
+			// Both of these mostly wait on the disk, so let them wait at the same time
+			std::vector<ManifestEntry> manifest;
+			std::thread crawler([&]() { CrawlLibrary(library_path, manifest); });
 			if (std::filesystem::exists(cache_path))
 				RetrieveCachedMusic();
+			crawler.join();
 
-			for (const auto& file: std::filesystem::recursive_directory_iterator(path))
+			// Where each cached track lives, by path and by content
+			std::unordered_map<std::string, size_t> cached_paths;
+			std::unordered_map<uint64, size_t> cached_digests;
+			size_t num_cached = files.size();
+			for (size_t i = 0; i < num_cached; i++)
+				cached_paths.emplace(std::filesystem::proximate(files[i]->path, library_path).string(), i);
+			std::vector<char> on_disk(num_cached, 0);
+
+			std::vector<std::string> candidates;
+			for (const ManifestEntry& entry: manifest)
 			{
+				const std::string& file_path = entry.path;
+				std::string relative_path = std::filesystem::proximate(file_path, library_path).string();
+
+				// Tracks another worker process is responsible for
+				if (shard_count > 1 && !OwnsTrack(relative_path))
+					continue;
+
+				// Check if it's in the cache before loading
+				auto cached = cached_paths.find(relative_path);
+				if (cached != cached_paths.end())
 				{
-					std::unique_lock<std::mutex> lck(mutex);
-					load_min++;
+					on_disk[cached->second] = 1;
+					continue;
 				}
 
-				if (file.is_directory())
-					continue;
+				candidates.push_back(file_path);
+			}
 
-				std::string file_path = file.path().string();
+			load_max = std::max<int>(1, candidates.size());
 
-				// Check if it's in the cache before loading
-				bool should_process = true;
-				for (int i = 0; i < exclude.size(); i++)
+			// Digest the new files, plus cached ones from caches that predate digests, all in parallel. Skipped entirely when
+			// nothing is new, so an unchanged library doesn't pay for reading every file.
+			std::vector<uint64> candidate_digests(candidates.size(), 0);
+			if (!candidates.empty())
+			{
+				std::vector<size_t> jobs(num_cached + candidates.size());
+				std::iota(jobs.begin(), jobs.end(), 0);
+				std::for_each(std::execution::par, jobs.begin(), jobs.end(), [&](size_t job)
 				{
-					if (file_path.find(exclude[i]) != std::string::npos)
-						should_process = false;
+					if (job >= num_cached)
+						DigestFile(candidates[job - num_cached], candidate_digests[job - num_cached]);
+					else if (on_disk[job] && !files[job]->digest)
+						DigestFile(files[job]->path, files[job]->digest);
+				});
+
+				for (size_t i = 0; i < num_cached; i++)
+				{
+					if (files[i]->digest)
+						cached_digests.emplace(files[i]->digest, i);
 				}
-				if (!should_process)
-					continue;
+			}
 
-				if (!EndsWith(file_path, ".wav") && !EndsWith(file_path, ".mp3"))
+			std::unordered_map<uint64, size_t> new_digests;
+			for (size_t i = 0; i < candidates.size(); i++)
+			{
+				load_min++;
+
+				uint64 digest = candidate_digests[i];
+
+				// Same bytes as something in the cache (moved, renamed or copied), so its fingerprint is still good
+				auto cached = digest ? cached_digests.find(digest) : cached_digests.end();
+				if (cached != cached_digests.end())
+				{
+					size_t original = cached->second;
+					AudioFile* sid = files.emplace_back(std::make_shared<AudioFile>()).get();
+					sid->path = candidates[i];
+					sid->length = files[original]->length;
+					sid->digest = digest;
+					sid->fingerprint.source = sid;
+					sid->fingerprint.hashes = files[original]->fingerprint.hashes;
+					sid->processed = true;
+					fingerprints.push_back(&sid->fingerprint);
+					avg_length += sid->length;
 					continue;
+				}
 
-				files.push_back({});
-				if (files.back().Load(file_path) == FAILURE)
+				// A copy of another new file. No need to decode it, Process hands it the original's fingerprint.
+				auto duplicate = digest ? new_digests.find(digest) : new_digests.end();
+				if (duplicate != new_digests.end())
 				{
-					files.pop_back();
+					AudioFile& file = *files.emplace_back(std::make_shared<AudioFile>());
+					file.path = candidates[i];
+					file.length = files[duplicate->second]->length;
+					file.digest = digest;
+					avg_length += file.length;
 					continue;
 				}
-				avg_length += files.back().length;
+
+				auto file = std::make_shared<AudioFile>();
+				if (file->Load(candidates[i]) == FAILURE)
+					continue;
+				file->digest = digest;
+				if (digest)
+					new_digests.emplace(digest, files.size());
+				avg_length += file->length;
+				files.push_back(std::move(file));
 			}
 
-			loading = false;
-			avg_length /= files.size();
+			// Cached tracks that are gone from disk. Moved ones were picked up under their new path above.
+			std::unordered_set<const AudioFile*> stale;
+			for (size_t i = 0; i < num_cached; i++)
+			{
+				if (!on_disk[i])
+					stale.insert(files[i].get());
+			}
+			if (!stale.empty())
+			{
+				fingerprints.erase(std::remove_if(fingerprints.begin(), fingerprints.end(), [&](const Fingerprint* fp)
+				{
+					if (!stale.count(fp->source))
+						return false;
+					avg_length -= fp->source->length;
+					return true;
+				}), fingerprints.end());
+				files.erase(std::remove_if(files.begin(), files.end(), [&](const std::shared_ptr<AudioFile>& file)
+				{
+					return stale.count(file.get()) > 0;
+				}), files.end());
+			}
+
+			avg_length = files.empty() ? 0.0f : avg_length / files.size();
 			std::cout << "Average track length is " << avg_length << " seconds." << std::endl;
+			RebuildIndex();
+			BeginStage(STAGE_IDLE, 1);
+			loading = false;
 		});
 		loading_thread.detach();
 
 		return SUCCESS;
 	}
 
+	/*
+	 * Saving runs in the background behind the loading popup. The tracks are snapshotted up front, and the snapshot shares
+	 * ownership of them, so one the watcher drops meanwhile stays alive until it's written. Everything goes to a temporary
+	 * file first and only replaces the real cache once it's complete, so a crash mid-save keeps the old one intact.
+	 */
 	ErrCode AudioLibrary::Save()
 	{
 		if (cache_path.empty() || library_path.empty())
 			return FAILURE;
 
-		Saver svr(cache_path);
-		// Encode header info
-		svr.PutInt(avg_length * files.size());
-		svr.PutInt(fingerprints.size());
-		// Encode fingerprints
-		for (const Fingerprint* fp: fingerprints)
+		if (loading.exchange(true))
 		{
-			if (!fp->source)
-				continue;
-			std::string path = std::filesystem::proximate(fp->source->path, library_path).string();
-			svr.PutString(path);
-			svr.PutFloat(fp->source->length);
-			svr.PutInt(fp->hashes.size());
-			for (const auto& [k, v]: fp->hashes)
+			std::cerr << "Library is busy, not saving" << std::endl;
+			return FAILURE;
+		}
+
+		// Let a change the watcher is already applying finish before taking the snapshot
+		std::unique_lock<std::mutex> paused;
+		if (watcher)
+			paused = watcher->Pause();
+
+		std::vector<std::pair<std::string, std::shared_ptr<const AudioFile>>> snapshot;
+		std::vector<CacheSegment> carried;
+		float total_length = 0.0f;
+		{
+			std::unique_lock<std::mutex> lck(mutex);
+			BeginStage(STAGE_SAVING, std::max<int>(1, fingerprints.size()));
+
+			snapshot.reserve(fingerprints.size());
+			for (const Fingerprint* fp: fingerprints)
 			{
-				svr.PutString(k, true);
-				svr.PutInt(v);
+				if (fp->source)
+				{
+					snapshot.push_back({std::filesystem::proximate(fp->source->path, library_path).string(), fp->source->shared_from_this()});
+					total_length += fp->source->length;
+				}
 			}
+			carried = other_profiles;
 		}
+
+		std::thread saving_thread([this, snapshot = std::move(snapshot), carried = std::move(carried), total_length]()
+		{
+			std::string temp_path = cache_path + ".tmp";
+			ErrCode status = SUCCESS;
+			{
+				FINDER_PROFILE(PROFILE_CACHE_IO);
+
+				// Every size is known up front, so all the offsets are just running sums
+				uint64 segment_size = PROFILE_BLOCK_SIZE + 4 + 4 + 8 * snapshot.size();
+				std::vector<uint64> record_offsets;
+				record_offsets.reserve(snapshot.size());
+				for (const auto& [path, file]: snapshot)
+				{
+					record_offsets.push_back(segment_size);
+					segment_size += 4 + path.size() + 4 + 8 + 4 + file->fingerprint.hashes.size() * HASH_PAIR_SIZE;
+				}
+
+				Saver svr(temp_path);
+				// Encode header info
+				svr.PutBytes(KPSF_MAGIC, 4);
+				svr.PutInt(KPSF_VERSION);
+				svr.PutInt(1 + carried.size());
+				// Encode the segment table: ours first, then the other profiles' segments as they were
+				uint64 segment_offset = 4 + 4 + 4 + SEGMENT_ENTRY_SIZE * (1 + carried.size());
+				svr.PutUInt64(SettingsProfile(profile));
+				svr.PutUInt64(segment_offset);
+				svr.PutUInt64(segment_size);
+				segment_offset += segment_size;
+				for (const CacheSegment& segment: carried)
+				{
+					svr.PutUInt64(segment.profile);
+					svr.PutUInt64(segment_offset);
+					svr.PutUInt64(segment.size);
+					segment_offset += segment.size;
+				}
+				// Encode our segment header and its offset table
+				PutProfileBlock(svr, profile);
+				svr.PutInt(total_length);
+				svr.PutInt(snapshot.size());
+				for (uint64 offset: record_offsets)
+					svr.PutUInt64(offset);
+				// Encode fingerprints
+				for (const auto& [path, file]: snapshot)
+				{
+					svr.PutString(path);
+					svr.PutFloat(file->length);
+					svr.PutUInt64(file->digest);
+					svr.PutInt(file->fingerprint.hashes.size());
+					for (const auto& [k, v]: file->fingerprint.hashes)
+					{
+						svr.PutString(k, true);
+						svr.PutInt(v);
+					}
+
+					load_min++;
+				}
+				// Copy the other profiles over from the old cache untouched
+				if (!carried.empty())
+				{
+					Loader old_cache(cache_path);
+					std::vector<byte> block(1 << 20);
+					for (const CacheSegment& segment: carried)
+					{
+						old_cache.Seek(segment.offset);
+						for (uint64 left = segment.size; left > 0 && old_cache.Good(); )
+						{
+							size_t n = (size_t) std::min<uint64>(left, block.size());
+							old_cache.NextBytes(block.data(), n);
+							svr.PutBytes(block.data(), n);
+							left -= n;
+						}
+					}
+					if (!old_cache.Good())
+					{
+						std::cerr << "Failed to carry over other settings profiles from " << cache_path << std::endl;
+						svr.Close();
+						status = FAILURE;
+					}
+				}
+				if (status == SUCCESS)
+					status = svr.Close();
+			}
+
+			std::error_code ec;
+			if (status == SUCCESS)
+			{
+				std::filesystem::rename(temp_path, cache_path, ec);
+				if (ec)
+					status = FAILURE;
+			}
+			if (status == FAILURE)
+			{
+				std::cerr << "Failed to save library to " << cache_path << std::endl;
+				std::filesystem::remove(temp_path, ec);
+			}
+			else
+			{
+				std::cout << "Saved " << snapshot.size() << " fingerprints to " << cache_path << std::endl;
+			}
+
+			BeginStage(STAGE_IDLE, 1);
+			loading = false;
+		});
+		saving_thread.detach();
+
+		return SUCCESS;
 	}
 
 	void AudioLibrary::Process(bool force)
 	{
-		loading = true;
+		// Mixing fingerprints from two settings profiles in one index would make every match score meaningless
+		if (SettingsProfile(settings) != SettingsProfile(profile) && !files.empty())
+		{
+			std::cerr << "Fingerprint settings changed since the library was loaded. Reopen it to switch profiles." << std::endl;
+			return;
+		}
 
-		load_min = 0;
-		load_max = files.size();
+		if (loading.exchange(true))
+		{
+			std::cerr << "Library is busy, not processing" << std::endl;
+			return;
+		}
+
+		std::unique_lock<std::mutex> paused;
+		if (watcher)
+			paused = watcher->Pause();
+		BeginStage(STAGE_FINGERPRINTING, std::max<int>(1, files.size()));
 
-		std::thread processing_thread([&]()
+		std::thread processing_thread([this, force]()
 		{
-			std::for_each(std::execution::par, files.begin(), files.end(), [&](AudioFile& file)
+			// Byte-identical files only get fingerprinted once; the rest copy from the first of them
+			std::vector<long> copy_of(files.size(), -1);
+			std::unordered_map<uint64, size_t> first_with_digest;
+			for (size_t i = 0; i < files.size(); i++)
+			{
+				if ((!files[i]->processed || force) && files[i]->digest)
+				{
+					auto [first, inserted] = first_with_digest.emplace(files[i]->digest, i);
+					if (!inserted)
+						copy_of[i] = first->second;
+				}
+			}
+
+			std::vector<char> processed_now(files.size(), 0);
+			std::vector<size_t> ids(files.size());
+			std::iota(ids.begin(), ids.end(), 0);
+			std::for_each(std::execution::par, ids.begin(), ids.end(), [&](size_t i)
 			{
-				bool should_proc = !file.processed || force;
+				AudioFile& file = *files[i];
+				bool should_proc = (!file.processed || force) && copy_of[i] < 0;
 				if (should_proc)
+				{
 					file.Process();
-				std::unique_lock<std::mutex> lck(mutex);
+					processed_now[i] = 1;
+				}
 				load_min++;
-				if (load_min == files.size())
-					loading = false;
-				// Should really revisit this whole thing soon... kinda ugly
-				if (should_proc)
-					fingerprints.push_back(&file.fingerprint);
 			});
+
+			for (size_t i = 0; i < files.size(); i++)
+			{
+				if (copy_of[i] < 0)
+					continue;
+				files[i]->fingerprint.hashes = files[copy_of[i]]->fingerprint.hashes;
+				files[i]->fingerprint.source = files[i].get();
+				files[i]->processed = true;
+				processed_now[i] = 1;
+			}
+
+			// Cached tracks are already in here; only add the ones that weren't (forcing reprocesses them in place)
+			{
+				std::unique_lock<std::mutex> lck(mutex);
+				std::unordered_set<Fingerprint*> known(fingerprints.begin(), fingerprints.end());
+				for (size_t i = 0; i < files.size(); i++)
+				{
+					if (processed_now[i] && !known.count(&files[i]->fingerprint))
+						fingerprints.push_back(&files[i]->fingerprint);
+				}
+			}
+			RebuildIndex();
+
+			// Done out here so an empty library doesn't leave us stuck loading
+			BeginStage(STAGE_IDLE, 1);
+			loading = false;
 		});
 		processing_thread.detach();
 	}
 
-	void AudioLibrary::TestSong(AudioFile& missing)
+	/*
+	 * Queries are fingerprinted with the current settings, so they can only be matched against an index built with the
+	 * same ones. An empty index matches nothing either way.
+	 */
+	ErrCode CheckProfile(const LibrarySnapshot& snapshot)
 	{
-		Results results;
-		FindMatches(missing.fingerprint, results);
-		AlignMatches(results, missing.fingerprint.hashes.size(), 10, matches);
+		if (snapshot.index && snapshot.profile != SettingsProfile(settings))
+		{
+			std::cerr << "Fingerprint settings changed since the library was loaded. Reopen it to query with them." << std::endl;
+			return FAILURE;
+		}
+		return SUCCESS;
 	}
 
-	//
+	ErrCode AudioLibrary::TestSong(AudioFile& missing)
+	{
+		matches.clear();
+		return Query(missing.fingerprint, 10, matches);
+	}
 
 	/*
-	 * Return a list of (song_id, offset_difference) pairs and a map with the amount of hashes matched (not considering
-	 * duplicated hashes) in each song.
+	 * Doesn't touch any library state, so it's safe to run several of these at once (see QueryServer).
+	 *
+	 * The index is split into shards by track, and each shard is scanned and ranked on its own. Rankings don't depend on
+	 * other tracks, so merging the per-shard top N gives the same answer as ranking everything in one go.
 	 */
-	void AudioLibrary::FindMatches(Fingerprint& missing_fp, Results& results)
+	ErrCode AudioLibrary::Query(const Fingerprint& missing_fp, int topn, std::vector<FoundSong>& songs_result) const
 	{
-		matches.clear();
+		return Query(*GetSnapshot(), missing_fp, topn, songs_result);
+	}
+
+	/*
+	 * Same, against a snapshot the caller already has. The SIDs that come back belong to its index, so holding on to the
+	 * snapshot keeps them good even after the library moves on.
+	 */
+	ErrCode AudioLibrary::Query(const LibrarySnapshot& snapshot, const Fingerprint& missing_fp, int topn, std::vector<FoundSong>& songs_result) const
+	{
+		if (CheckProfile(snapshot) == FAILURE)
+			return FAILURE;
+		std::shared_ptr<const LibraryIndex> idx = snapshot.index;
+		if (!idx)
+			return SUCCESS;
 
 		// Create a map of hash => offset pairs for later lookups
-		boost::unordered_map<std::string, std::vector<int>> mapper;
+		QueryHashes mapper;
 		for (const auto& [hsh, offset]: missing_fp.hashes)
+			mapper[HashKey(hsh)].push_back(offset);
+
+		// Skip the one we're trying to find
+		std::vector<bool> skip(idx->tracks.size(), false);
+		if (missing_fp.source)
 		{
-			if (mapper.count(hsh) != 0)
-				mapper[hsh].push_back(offset);
-			else
-				mapper.emplace(hsh, std::vector<int>(1, offset));
+			std::string in_path = std::filesystem::path(missing_fp.source->path).filename().string();
+			for (size_t i = 0; i < idx->tracks.size(); i++)
+				skip[i] = idx->tracks[i] && std::filesystem::path(idx->tracks[i]->path).filename().string() == in_path;
 		}
 
-		std::vector<std::string> values;
-		for (const auto& [hash, offsets]: mapper)
-			values.push_back(hash);
+		int shards = idx->shards.size();
+		std::vector<std::vector<FoundSong>> shard_results(shards);
+		std::vector<int> shard_ids(shards);
+		for (int i = 0; i < shards; i++)
+			shard_ids[i] = i;
 
-		// In order to count each hash only once per db offset we use the map below
-		for (int i = 0; i < values.size(); i++)
+		std::for_each(std::execution::par, shard_ids.begin(), shard_ids.end(), [&](int shard)
 		{
-			std::string* it = &values[i];
+			Results results;
+			FindMatches(mapper, *idx, shard, skip, results);
+			AlignMatches(snapshot, results, missing_fp.hashes.size(), topn, shard_results[shard]);
+		});
+
+		for (const std::vector<FoundSong>& shard_result: shard_results)
+			songs_result.insert(songs_result.end(), shard_result.begin(), shard_result.end());
+		std::sort(songs_result.begin(), songs_result.end(), RanksHigher);
+		if (topn > 0 && songs_result.size() > topn)
+			songs_result.resize(topn);
+
+		return SUCCESS;
+	}
+
+	/*
+	 * Swap in a freshly built index. Anyone still querying the old one keeps it alive until they're done.
+	 */
+	void AudioLibrary::RebuildIndex()
+	{
+		// Building can't report how far along it is, but the stage is still worth showing
+		int stage = load_stage;
+		BeginStage(STAGE_INDEXING, 1);
 
-			// Pull the hash, SID, and offset for each fingerprint containing hashes from the missing sample
-			std::vector<FoundMatch> cur;
-			for (Fingerprint* fp: fingerprints)
+		std::vector<Fingerprint*> fps;
+		{
+			std::unique_lock<std::mutex> lck(mutex);
+			fps = fingerprints;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		std::shared_ptr<const LibraryIndex> built = BuildIndex(fps, num_shards);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		size_t postings = 0;
+		for (const auto& shard: built->shards)
+			postings += shard->Size();
+		std::cout << "Indexed " << postings << " hashes from " << fps.size() << " tracks in "
+			<< std::chrono::duration<float>(end - start).count() << " seconds." << std::endl;
+
+		Publish(built);
+		BeginStage((LibraryStage) stage, 1);
+	}
+
+	/*
+	 * Splice a handful of changed tracks into the live library without a full rebuild (see LibraryWatcher). Removed tracks
+	 * leave files right away; any index that can still return them owns them until it goes.
+	 */
+	void AudioLibrary::UpdateTracks(const std::vector<SID>& added, const std::vector<SID>& removed)
+	{
+		{
+			std::unique_lock<std::mutex> lck(mutex);
+			std::unordered_set<SID> gone(removed.begin(), removed.end());
+			fingerprints.erase(std::remove_if(fingerprints.begin(), fingerprints.end(), [&](const Fingerprint* fp)
 			{
-				// Skip the one we're trying to find
-				std::string fp_path = std::filesystem::path(fp->source->path).filename().string();
-				std::string in_path = std::filesystem::path(missing_fp.source->path).filename().string();
-				if (fp->source && fp_path == in_path)
-					continue;
+				return gone.count(fp->source) > 0;
+			}), fingerprints.end());
+			files.erase(std::remove_if(files.begin(), files.end(), [&](const std::shared_ptr<AudioFile>& file)
+			{
+				return gone.count(file.get()) > 0;
+			}), files.end());
+			for (SID sid: added)
+				fingerprints.push_back(&sid->fingerprint);
 
-				// Add the matching hash!
-				if (fp->hashes.count(*it))
-				{
-					cur.push_back({
-						*it,            // hsh
-						fp->source,     // sid
-						fp->hashes[*it] // offset
-					});
-				}
+			float total_length = 0.0f;
+			for (const Fingerprint* fp: fingerprints)
+				total_length += fp->source->length;
+			avg_length = fingerprints.empty() ? 0.0f : total_length / fingerprints.size();
+		}
+
+		std::shared_ptr<const LibraryIndex> previous = GetIndex();
+		if (!previous)
+		{
+			RebuildIndex();
+			return;
+		}
+
+		Publish(UpdateIndex(*previous, added, removed));
+	}
+
+	ErrCode AudioLibrary::Watch(bool enable)
+	{
+		if (!enable)
+		{
+			watcher.reset();
+			return SUCCESS;
+		}
+		if (watcher)
+			return SUCCESS;
+		if (library_path.empty())
+			return FAILURE;
+
+		auto started = std::make_unique<LibraryWatcher>(*this);
+		if (started->Start() == FAILURE)
+			return FAILURE;
+		watcher = std::move(started);
+
+		return SUCCESS;
+	}
+
+	bool AudioLibrary::IsWatching() const
+	{
+		return watcher != nullptr;
+	}
+
+	std::shared_ptr<const LibraryIndex> AudioLibrary::GetIndex() const
+	{
+		return GetSnapshot()->index;
+	}
+
+	/*
+	 * Never null
+	 */
+	std::shared_ptr<const LibrarySnapshot> AudioLibrary::GetSnapshot() const
+	{
+		return std::atomic_load(&m_snapshot);
+	}
+
+	//
+
+	/*
+	 * Readers can catch this halfway, which at worst shows one frame of a progress bar from the wrong stage
+	 */
+	void AudioLibrary::BeginStage(LibraryStage stage, int total)
+	{
+		load_min = 0;
+		load_max = total;
+		load_stage = stage;
+	}
+
+	/*
+	 * Puts together what everyone else gets to see of the library alongside the given index, and swaps it in
+	 */
+	void AudioLibrary::Publish(std::shared_ptr<const LibraryIndex> index)
+	{
+		std::shared_ptr<LibrarySnapshot> snapshot = std::make_shared<LibrarySnapshot>();
+		snapshot->index = std::move(index);
+		{
+			std::unique_lock<std::mutex> lck(mutex);
+
+			snapshot->tracks.reserve(files.size());
+			for (const std::shared_ptr<AudioFile>& file: files)
+			{
+				std::string relative_path = std::filesystem::path(file->path).lexically_proximate(library_path).string();
+				snapshot->tracks.emplace_back(std::move(relative_path), file->processed);
 			}
-			for (const FoundMatch& c: cur)
+			snapshot->num_cached = exclude.size();
+			snapshot->avg_length = avg_length;
+			snapshot->profile = SettingsProfile(profile);
+			snapshot->other_profiles = other_profiles.size();
+		}
+
+		std::atomic_store(&m_snapshot, std::shared_ptr<const LibrarySnapshot>(std::move(snapshot)));
+	}
+
+	/*
+	 * Return a list of (song_id, offset_difference) pairs and a map with the amount of hashes matched (not considering
+	 * duplicated hashes) in each song, looking only at one shard of the index.
+	 */
+	void AudioLibrary::FindMatches(const QueryHashes& mapper, const LibraryIndex& idx, int shard, const std::vector<bool>& skip, Results& results) const
+	{
+		FINDER_PROFILE(PROFILE_FIND_MATCHES);
+		const HashIndex& postings = *idx.shards[shard];
+		for (const auto& [key, offsets]: mapper)
+		{
+			// Pull the SID and offset for each track containing this hash. A track only ever has one posting per hash, so
+			// each one counts once towards that track's matched hashes.
+			auto [first, last] = postings.Find(key);
+			for (const Posting* p = first; p != last; p++)
 			{
-				if (results.dedups.count(c.sid) == 0)
-					results.dedups.emplace(c.sid, 1);
-				else
-					results.dedups[c.sid]++;
+				if (skip[p->track])
+					continue;
+
+				SID sid = idx.tracks[p->track].get();
+				results.dedups[sid]++;
 
 				// We now evaluate all offsets for each hash matched
-				for (int song_sampled_offset: mapper[c.hash])
-					results.matches.push_back({c.sid, c.offset - song_sampled_offset});
+				for (int song_sampled_offset: offsets)
+					results.matches.push_back({sid, p->offset - song_sampled_offset});
 			}
 		}
 	}
@@ -230,8 +858,10 @@ namespace finder
 	 * audio. This is basically the final step of the ranking process. For our purposes we do a few things differently from the
 	 * original DejaVu implementation.
 	 */
-	void AudioLibrary::AlignMatches(const Results& results, int queried_hashes, int topn, std::vector<FoundSong>& songs_result)
+	void AudioLibrary::AlignMatches(const LibrarySnapshot& snapshot, const Results& results, int queried_hashes, int topn, std::vector<FoundSong>& songs_result) const
 	{
+		FINDER_PROFILE(PROFILE_ALIGN_MATCHES);
+
 		// Keep only the maximum offset occurrences.
 		// Note: We don't count peak offsets like DejaVu, as (AFAIK) the original code doesn't use the count for anything.
 		// Also note: If you want to retrieve multiple matches in one song, this code should be adjusted.
@@ -268,7 +898,7 @@ namespace finder
 			float adj_input_confidence = input_confidence;
 			if (settings.demote_songs)
 			{
-				float length_adjust = (avg_length / song->length) * settings.demotion_factor;
+				float length_adjust = (snapshot.avg_length / song->length) * settings.demotion_factor;
 				adj_input_confidence *= std::min(length_adjust, 1.0f);
 			}
 			float overall_confidence = fingerprinted_confidence + adj_input_confidence;
@@ -289,17 +919,28 @@ namespace finder
 			songs_result.push_back(found_song);
 		}
 
-		// Prioritize confidence over offsets
-		std::sort(songs_result.begin(), songs_result.end(), [](const FoundSong& a, const FoundSong& b)
-		{
-			if (a.overall_confidence > b.overall_confidence) return true;
-			if (b.overall_confidence > a.overall_confidence) return false;
+		std::sort(songs_result.begin(), songs_result.end(), RanksHigher);
+		if (topn > 0 && songs_result.size() > topn)
+			songs_result.resize(topn);
+	}
 
-			if (a.offset > b.offset) return true;
-			if (b.offset > a.offset) return false;
+	/*
+	 * When the library is split across several worker processes (see QueryServer), each one only keeps the tracks whose
+	 * path hashes to its shard. Paths are hashed with FNV-1a so every process agrees regardless of load order.
+	 */
+	bool AudioLibrary::OwnsTrack(const std::string& relative_path) const
+	{
+		if (shard_count <= 1)
+			return true;
 
-			return false;
-		});
+		uint64 hash = 14695981039346656037ull;
+		for (char c: relative_path)
+		{
+			hash ^= (byte) c;
+			hash *= 1099511628211ull;
+		}
+
+		return (int) (hash % shard_count) == shard_index;
 	}
 
 	/*
@@ -307,38 +948,87 @@ namespace finder
 	 */
 	void AudioLibrary::RetrieveCachedMusic()
 	{
+		FINDER_PROFILE(PROFILE_CACHE_IO);
 		Loader ldr(cache_path);
+		OwnsTrackFn owns = [this](const std::string& path) { return OwnsTrack(path); };
 
-		// Decode our header info
-		avg_length = (float) ldr.NextInt(); // Note we're actually pulling the total here and we average it later
-		int num_fps = ldr.NextInt();
+		std::vector<CachedTrack> tracks;
+		float total_length = 0.0f;
+		char magic[4] = { 0 };
+		ldr.NextBytes(magic, 4);
+		if (memcmp(magic, KPSF_MAGIC, 4) == 0)
+		{
+			int version = ldr.NextInt();
+			if (version > KPSF_VERSION)
+			{
+				std::cerr << "Cache file " << cache_path << " is version " << version << ", which is newer than this build understands" << std::endl;
+				return;
+			}
 
-		exclude.reserve(num_fps);
-		files.reserve(std::max(load_max, num_fps));
-		fingerprints.reserve(fingerprints.size() + num_fps);
+			if (version >= 4)
+			{
+				// Pick out the segment for the current settings and remember where the others are so saving can carry them over
+				uint64 current = SettingsProfile(profile);
+				bool found = false;
+				uint64 base = 0;
+				int num_segments = ldr.NextInt();
+				for (int i = 0; i < num_segments && ldr.Good(); i++)
+				{
+					CacheSegment segment;
+					segment.profile = ldr.NextUInt64();
+					segment.offset = ldr.NextUInt64();
+					segment.size = ldr.NextUInt64();
+					if (segment.profile == current && !found)
+					{
+						found = true;
+						base = segment.offset;
+					}
+					else
+					{
+						other_profiles.push_back(segment);
+					}
+				}
+				if (!found || !ldr.Good())
+				{
+					std::cout << "No cached fingerprints for the current settings (" << other_profiles.size() << " other profiles cached)" << std::endl;
+					return;
+				}
 
-		// Process fingerprints
-		for (int i = 0; i < num_fps; i++)
+				ldr.Seek(base + PROFILE_BLOCK_SIZE);
+				ReadIndexedCache(cache_path, ldr, version, base, owns, tracks, total_length);
+			}
+			else
+			{
+				// Caches from before profiles are assumed to match whatever we're running with, as they always were
+				ReadIndexedCache(cache_path, ldr, version, 0, owns, tracks, total_length);
+			}
+		}
+		else
 		{
-			std::string path = ldr.NextString();
-			float length = ldr.NextFloat();
-			int num_hash_offset_pairs = ldr.NextInt();
+			ldr.Seek(0);
+			ReadLegacyCache(ldr, owns, tracks, total_length);
+		}
 
-			files.push_back({});
-			exclude.push_back(path);
+		// Merge into the library. Moving the hash maps over is cheap; the expensive part already happened in parallel.
+		avg_length = total_length; // Note we're actually pulling the total here and we average it later
+		exclude.reserve(exclude.size() + tracks.size());
+		fingerprints.reserve(fingerprints.size() + tracks.size());
+		for (CachedTrack& track: tracks)
+		{
+			exclude.push_back(track.path);
+			if (!track.owned)
+			{
+				avg_length -= track.length;
+				continue;
+			}
 
-			AudioFile* sid = &files.back(); // FIXME: This pointer may be invalidated & cause crashes!
-			sid->path = library_path + "/" + path;
-			sid->length = length;
+			AudioFile* sid = files.emplace_back(std::make_shared<AudioFile>()).get();
+			sid->path = library_path + "/" + track.path;
+			sid->length = track.length;
+			sid->digest = track.digest;
 			sid->fingerprint.source = sid; // Gross coupling
+			sid->fingerprint.hashes = std::move(track.hashes);
 			sid->processed = true;
-			sid->fingerprint.hashes.reserve(num_hash_offset_pairs);
-			for (int j = 0; j < num_hash_offset_pairs; j++)
-			{
-				std::string hash = ldr.NextBufString<20>();
-				int offset = ldr.NextInt();
-				sid->fingerprint.hashes.emplace(hash, offset);
-			}
 
 			fingerprints.push_back(&sid->fingerprint);
 		}
@@ -0,0 +1,400 @@
+#include "SampleFinder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <execution>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <nlohmann/json.hpp>
+
+namespace
+{
+	constexpr int BENCH_FORMAT_VERSION = 1;
+	constexpr int BENCH_TOPN = 10;
+	constexpr float QUERY_SECONDS = 5.0f;
+
+	struct BenchResult
+	{
+		std::string name;
+		std::vector<double> times; // Seconds, one per repeat
+		double audio_seconds = 0.0; // Per repeat, for throughput
+		double hashes = 0.0;
+		double bytes = 0.0;
+	};
+
+	double Median(std::vector<double> values)
+	{
+		std::sort(values.begin(), values.end());
+		size_t n = values.size();
+		return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) * 0.5;
+	}
+
+	double Min(const std::vector<double>& values)
+	{
+		return *std::min_element(values.begin(), values.end());
+	}
+
+	/*
+	 * One untimed run first, so the first repeat doesn't pay for page faults and cold caches the others don't
+	 */
+	template <class Fn>
+	BenchResult Measure(const std::string& name, int repeats, Fn fn)
+	{
+		BenchResult result;
+		result.name = name;
+		fn(0);
+		for (int r = 0; r < repeats; r++)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			fn(r);
+			auto end = std::chrono::high_resolution_clock::now();
+			result.times.push_back(std::chrono::duration<double>(end - start).count());
+		}
+		return result;
+	}
+
+	nlohmann::json ToJson(const BenchResult& result)
+	{
+		double median = Median(result.times);
+		nlohmann::json json;
+		json["name"] = result.name;
+		json["repeats"] = result.times.size();
+		json["median_s"] = median;
+		json["min_s"] = Min(result.times);
+		if (result.audio_seconds > 0.0)
+			json["audio_seconds_per_s"] = result.audio_seconds / median;
+		if (result.hashes > 0.0)
+			json["hashes_per_s"] = result.hashes / median;
+		if (result.bytes > 0.0)
+			json["mb_per_s"] = result.bytes / median / (1024.0 * 1024.0);
+		return json;
+	}
+
+	void PrintResult(const BenchResult& result)
+	{
+		double median = Median(result.times);
+		fprintf(stderr, "%-24s %10.3f %10.3f", result.name.c_str(), median * 1000.0, Min(result.times) * 1000.0);
+		if (result.audio_seconds > 0.0)
+			fprintf(stderr, " %12.1f", result.audio_seconds / median);
+		else
+			fprintf(stderr, " %12s", "-");
+		if (result.hashes > 0.0)
+			fprintf(stderr, " %14.0f", result.hashes / median);
+		else
+			fprintf(stderr, " %14s", "-");
+		if (result.bytes > 0.0)
+			fprintf(stderr, " %10.1f", result.bytes / median / (1024.0 * 1024.0));
+		fprintf(stderr, "\n");
+	}
+
+	/*
+	 * Same stages as AudioFile::Process, minus its logging and the bookkeeping on the file
+	 */
+	void FingerprintSamples(const std::vector<float>& samples, finder::Fingerprint& out)
+	{
+		cv::Mat specgram;
+		std::vector<std::pair<int, int>> peaks;
+		finder::ComputeSpectrogram(samples, specgram);
+		finder::Get2DPeaks(specgram, peaks);
+		finder::GenerateHashes(peaks, out.hashes);
+	}
+
+	void BenchStages(finder::SignalKind kind, finder::uint64 seed, float seconds, int repeats, std::vector<BenchResult>& results)
+	{
+		std::vector<float> samples;
+		finder::SynthesizeSignal(kind, seed, seconds, finder::settings.fs, samples);
+		std::string suffix = std::string("/") + finder::SignalKindName(kind);
+
+		int window = finder::settings.default_window_size;
+		size_t sink = 0; // Keeps the results alive as far as the optimizer is concerned
+		BenchResult stride = Measure("stride_windows" + suffix, repeats, [&](int)
+		{
+			sink += finder::StrideWindows(samples, window, window * finder::settings.default_overlap_ratio).size();
+		});
+		stride.audio_seconds = seconds;
+		results.push_back(stride);
+
+		cv::Mat specgram;
+		BenchResult stft = Measure("stft" + suffix, repeats, [&](int)
+		{
+			finder::ComputeSpectrogram(samples, specgram);
+		});
+		stft.audio_seconds = seconds;
+		results.push_back(stft);
+
+		std::vector<std::pair<int, int>> peaks;
+		BenchResult peak = Measure("peaks" + suffix, repeats, [&](int)
+		{
+			peaks.clear();
+			finder::Get2DPeaks(specgram, peaks);
+		});
+		peak.audio_seconds = seconds;
+		results.push_back(peak);
+
+		// GenerateHashes sorts its input in place, so every run (the warm-up included) gets its own unsorted copy
+		std::vector<std::vector<std::pair<int, int>>> inputs(repeats + 1, peaks);
+		size_t next_input = 0;
+		size_t num_hashes = 0;
+		BenchResult hashing = Measure("hashes" + suffix, repeats, [&](int)
+		{
+			boost::unordered_map<std::string, int> hashes;
+			finder::GenerateHashes(inputs[next_input++], hashes);
+			num_hashes = hashes.size();
+		});
+		hashing.audio_seconds = seconds;
+		hashing.hashes = num_hashes;
+		results.push_back(hashing);
+
+		if (sink == 0)
+			std::cerr << "Signal too short to frame: " << suffix << std::endl;
+	}
+
+	/*
+	 * Same record layout as the cache file (see KPSFFormat.md), minus the header and offset table
+	 */
+	finder::ErrCode WriteRecords(const std::string& path, const std::vector<finder::Fingerprint*>& fps)
+	{
+		finder::Saver svr(path);
+		for (const finder::Fingerprint* fp: fps)
+		{
+			svr.PutString(fp->source->path);
+			svr.PutFloat(fp->source->length);
+			svr.PutUInt64(fp->source->digest);
+			svr.PutInt(fp->hashes.size());
+			for (const auto& [hash, offset]: fp->hashes)
+			{
+				svr.PutString(hash, true);
+				svr.PutInt(offset);
+			}
+		}
+		// Not Close: its fsync would be timing the disk, not us
+		return svr.Flush() == finder::SUCCESS && svr.Good() ? finder::SUCCESS : finder::FAILURE;
+	}
+
+	finder::ErrCode ReadRecords(const std::string& path, size_t count, std::vector<boost::unordered_map<std::string, int>>& out)
+	{
+		finder::Loader ldr(path);
+		size_t hash_size = finder::settings.fingerprint_reduction;
+		size_t pair_size = hash_size + 4;
+		std::vector<finder::byte> scratch;
+		out.assign(count, {});
+		for (size_t i = 0; i < count; i++)
+		{
+			ldr.NextString();
+			ldr.NextFloat();
+			ldr.NextUInt64();
+			int num_pairs = ldr.NextInt();
+			if (!ldr.Good() || num_pairs < 0)
+				return finder::FAILURE;
+
+			scratch.resize(num_pairs * pair_size);
+			if (ldr.NextBytes(scratch.data(), scratch.size()) == finder::FAILURE)
+				return finder::FAILURE;
+
+			out[i].reserve(num_pairs);
+			for (int j = 0; j < num_pairs; j++)
+			{
+				const finder::byte* pair = scratch.data() + j * pair_size;
+				const finder::byte* le = pair + hash_size;
+				int offset = (finder::int32) ((finder::uint32) le[0] | (finder::uint32) le[1] << 8 | (finder::uint32) le[2] << 16 | (finder::uint32) le[3] << 24);
+				out[i].emplace(std::string(reinterpret_cast<const char*>(pair), hash_size), offset);
+			}
+		}
+		return finder::SUCCESS;
+	}
+}
+
+namespace finder
+{
+	/*
+	 * Times the fingerprinting stages on each kind of synthetic signal, then matching and cache I/O against a synthetic
+	 * library. The JSON is meant to be kept and diffed between builds, so everything in it is deterministic except the
+	 * timings themselves.
+	 */
+	int RunBenchmarks(const std::vector<std::string>& args)
+	{
+		int num_tracks = 0;
+		float seconds = 0.0f;
+		int repeats = 0;
+		uint64 seed = 0;
+		if (GetIntOption(args, "tracks", 50, num_tracks) == FAILURE ||
+			GetFloatOption(args, "seconds", 30.0f, seconds) == FAILURE ||
+			GetIntOption(args, "repeats", 5, repeats) == FAILURE ||
+			GetUInt64Option(args, "seed", 1, seed) == FAILURE)
+		{
+			PrintUsage();
+			return EXIT_FAILURE;
+		}
+		std::string json_path = GetOption(args, "json", "");
+		if (num_tracks < 1 || repeats < 1 || seconds < QUERY_SECONDS)
+		{
+			std::cerr << "Need at least 1 track, 1 repeat and " << QUERY_SECONDS << " seconds of audio" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		std::vector<BenchResult> results;
+		for (int kind = 0; kind < SIGNAL_KIND_COUNT; kind++)
+			BenchStages((SignalKind) kind, seed, seconds, repeats, results);
+
+		// Synthetic library, every kind of signal in turn
+		std::cerr << "Fingerprinting " << num_tracks << " synthetic tracks..." << std::endl;
+		std::vector<std::shared_ptr<AudioFile>> files(num_tracks);
+		std::vector<int> ids(num_tracks);
+		std::iota(ids.begin(), ids.end(), 0);
+		std::for_each(std::execution::par, ids.begin(), ids.end(), [&](int i)
+		{
+			files[i] = std::make_shared<AudioFile>();
+			AudioFile& file = *files[i];
+			SignalKind kind = (SignalKind) (i % SIGNAL_KIND_COUNT);
+			file.path = "synthetic/" + std::to_string(i) + "_" + SignalKindName(kind) + ".wav";
+			file.length = seconds;
+			file.fingerprint.source = &file;
+
+			std::vector<float> samples;
+			SynthesizeSignal(kind, seed + i, seconds, settings.fs, samples);
+			FingerprintSamples(samples, file.fingerprint);
+			file.processed = true;
+		});
+
+		std::vector<Fingerprint*> fps;
+		double library_hashes = 0.0;
+		for (const std::shared_ptr<AudioFile>& file: files)
+		{
+			fps.push_back(&file->fingerprint);
+			library_hashes += file->fingerprint.hashes.size();
+		}
+
+		AudioLibrary library;
+		int num_shards = library.num_shards;
+
+		std::shared_ptr<const LibraryIndex> index;
+		BenchResult build = Measure("build_index", repeats, [&](int)
+		{
+			index = BuildIndex(fps, num_shards);
+		});
+		build.audio_seconds = seconds * num_tracks;
+		build.hashes = library_hashes;
+		results.push_back(build);
+
+		// The query is an excerpt from the middle of the library, so there's a right answer to check for
+		int target = num_tracks / 2;
+		std::vector<float> samples;
+		SynthesizeSignal((SignalKind) (target % SIGNAL_KIND_COUNT), seed + target, seconds, settings.fs, samples);
+		size_t first = (size_t) ((seconds - QUERY_SECONDS) * 0.5f * settings.fs);
+		std::vector<float> excerpt(samples.begin() + first, samples.begin() + first + (size_t) (QUERY_SECONDS * settings.fs));
+		Fingerprint query;
+		query.source = nullptr;
+		FingerprintSamples(excerpt, query);
+
+		QueryHashes mapper;
+		for (const auto& [hsh, offset]: query.hashes)
+			mapper[HashKey(hsh)].push_back(offset);
+		std::vector<bool> skip(index->tracks.size(), false);
+		LibrarySnapshot snapshot = {};
+		snapshot.index = index;
+		snapshot.avg_length = seconds;
+
+		// Single-threaded over every shard, where a real query spreads the shards over cores
+		std::vector<Results> shard_results(index->shards.size());
+		BenchResult find = Measure("find_matches", repeats, [&](int)
+		{
+			for (size_t shard = 0; shard < index->shards.size(); shard++)
+			{
+				shard_results[shard] = Results();
+				library.FindMatches(mapper, *index, shard, skip, shard_results[shard]);
+			}
+		});
+		find.audio_seconds = QUERY_SECONDS;
+		find.hashes = query.hashes.size();
+		results.push_back(find);
+
+		std::vector<FoundSong> songs;
+		BenchResult align = Measure("align_matches", repeats, [&](int)
+		{
+			songs.clear();
+			for (size_t shard = 0; shard < index->shards.size(); shard++)
+				library.AlignMatches(snapshot, shard_results[shard], query.hashes.size(), BENCH_TOPN, songs);
+		});
+		align.audio_seconds = QUERY_SECONDS;
+		align.hashes = query.hashes.size();
+		results.push_back(align);
+
+		auto best = std::max_element(songs.begin(), songs.end(), [](const FoundSong& a, const FoundSong& b)
+		{
+			return a.overall_confidence < b.overall_confidence;
+		});
+		bool found = best != songs.end() && best->sid == files[target].get();
+
+		// Cache round trip, through the same block I/O the library cache uses
+		std::string cache_path = (std::filesystem::temp_directory_path() / "samplefinder_bench.bin").string();
+		double cache_bytes = 0.0;
+		for (const Fingerprint* fp: fps)
+			cache_bytes += fp->source->path.size() + 4 + 4 + 8 + 4 + fp->hashes.size() * (settings.fingerprint_reduction + 4);
+
+		bool cache_ok = true;
+		BenchResult save = Measure("cache_save", repeats, [&](int)
+		{
+			cache_ok &= WriteRecords(cache_path, fps) == SUCCESS;
+		});
+		save.hashes = library_hashes;
+		save.bytes = cache_bytes;
+		results.push_back(save);
+
+		std::vector<boost::unordered_map<std::string, int>> loaded;
+		BenchResult load = Measure("cache_load", repeats, [&](int)
+		{
+			cache_ok &= ReadRecords(cache_path, fps.size(), loaded) == SUCCESS;
+		});
+		load.hashes = library_hashes;
+		load.bytes = cache_bytes;
+		results.push_back(load);
+
+		for (size_t i = 0; cache_ok && i < fps.size(); i++)
+			cache_ok = loaded[i] == fps[i]->hashes;
+		std::filesystem::remove(cache_path);
+
+		fprintf(stderr, "\n%-24s %10s %10s %12s %14s %10s\n", "benchmark", "median ms", "min ms", "audio s/s", "hashes/s", "MB/s");
+		for (const BenchResult& result: results)
+			PrintResult(result);
+		fprintf(stderr, "\nQuery %s, cache round trip %s\n", found ? "found its track" : "MISSED its track", cache_ok ? "intact" : "CORRUPTED");
+
+		char profile[17];
+		snprintf(profile, sizeof(profile), "%016llx", (unsigned long long) SettingsProfile(settings));
+
+		nlohmann::json json;
+		json["version"] = BENCH_FORMAT_VERSION;
+		json["settings_profile"] = profile;
+		json["rate"] = settings.fs;
+		json["seed"] = seed;
+		json["seconds"] = seconds;
+		json["repeats"] = repeats;
+		json["library"] = {
+			{ "tracks", num_tracks },
+			{ "shards", num_shards },
+			{ "hashes", library_hashes },
+			{ "query_hashes", query.hashes.size() },
+			{ "query_found", found }
+		};
+		json["cache_intact"] = cache_ok;
+		json["results"] = nlohmann::json::array();
+		for (const BenchResult& result: results)
+			json["results"].push_back(ToJson(result));
+
+		if (json_path.empty())
+			printf("%s\n", json.dump(2).c_str());
+		else if (SaveTextFile(json_path, json.dump(2) + "\n") == FAILURE)
+			return EXIT_FAILURE;
+
+		return found && cache_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,408 @@
+#include "SampleFinder.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+
+#include <sndfile.h>
+
+#include <nlohmann/json.hpp>
+
+namespace
+{
+	constexpr int STREAM_CHUNK_FRAMES = 4096;
+	constexpr const char* DEFAULT_SOCKET_PATH = "/tmp/samplefinder.sock";
+
+	void PrintMatches(const std::vector<finder::FoundSong>& matches, const std::string& library_path, int topn)
+	{
+		int i = 1;
+		for (const finder::FoundSong& match: matches)
+		{
+			if (i > topn)
+				break;
+			std::string filename = std::filesystem::proximate(match.sid->path, library_path).string();
+			printf(
+				"#%d: %s, c: %.2f, ic: %.2f, fc: %.2f, offsec: %f\n",
+				i,
+				filename.c_str(),
+				match.overall_confidence * 100.0f,
+				match.input_confidence * 100.0f,
+				match.fingerprinted_confidence * 100.0f,
+				match.offset_secs
+			);
+			i++;
+		}
+	}
+
+	int Recognize(const std::vector<std::string>& args)
+	{
+		if (args.size() < 2)
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		const std::string library_path = args[0];
+		const std::string input = args[1];
+
+		SF_INFO sfinfo;
+		memset(&sfinfo, 0, sizeof(sfinfo));
+		for (size_t i = 2; i < args.size(); i++)
+		{
+			if (args[i].rfind("--raw=", 0) == 0)
+			{
+				if (sscanf(args[i].c_str(), "--raw=%d:%d", &sfinfo.samplerate, &sfinfo.channels) != 2 || sfinfo.channels <= 0)
+				{
+					std::cerr << "Invalid raw format: " << args[i] << std::endl;
+					return EXIT_FAILURE;
+				}
+				sfinfo.format = SF_FORMAT_RAW | SF_FORMAT_PCM_16;
+			}
+		}
+
+		// sndfile can read WAV (and raw PCM) straight off a pipe, so stdin works for live sources too
+		SNDFILE* sf_in = input == "-" ? sf_open_fd(fileno(stdin), SFM_READ, &sfinfo, 0) : sf_open(input.c_str(), SFM_READ, &sfinfo);
+		if (!sf_in)
+		{
+			std::cerr << "Failed to open audio input: " << sf_strerror(sf_in) << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		// Fingerprints are only comparable at the rate the library was hashed at, same as the server insists on
+		if (sfinfo.samplerate != (int) finder::settings.fs)
+		{
+			std::cerr << "PCM must be at " << (int) finder::settings.fs << " Hz, got " << sfinfo.samplerate << std::endl;
+			sf_close(sf_in);
+			return EXIT_FAILURE;
+		}
+
+		finder::AudioLibrary library;
+		if (finder::OpenLibrary(library, library_path) == finder::FAILURE)
+		{
+			sf_close(sf_in);
+			return EXIT_FAILURE;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		finder::StreamRecognizer recognizer(library, input);
+		std::vector<short> interleaved(STREAM_CHUNK_FRAMES * sfinfo.channels);
+		std::vector<float> mono(STREAM_CHUNK_FRAMES);
+		bool confident = false;
+		while (!confident)
+		{
+			sf_count_t n_read = sf_readf_short(sf_in, interleaved.data(), STREAM_CHUNK_FRAMES);
+			if (n_read <= 0)
+				break;
+
+			// First channel only, same as AudioFile::Load
+			for (sf_count_t i = 0; i < n_read; i++)
+				mono[i] = (float) interleaved[i * sfinfo.channels];
+
+			recognizer.Feed(mono.data(), n_read);
+			confident = recognizer.Confident();
+		}
+		sf_close(sf_in);
+		recognizer.Finish();
+
+		auto end = std::chrono::high_resolution_clock::now();
+		float elapsed = std::chrono::duration<float>(end - start).count();
+
+		std::vector<finder::FoundSong> matches;
+		recognizer.Rank(10, matches);
+
+		printf(
+			"%s after %.1fs of audio (%d hashes, %.2fs elapsed)\n",
+			confident ? "Confident match" : "End of input",
+			recognizer.GetSecondsFed(),
+			recognizer.GetHashCount(),
+			elapsed
+		);
+		PrintMatches(matches, library_path, 10);
+
+		return confident || !matches.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int Serve(const std::vector<std::string>& args)
+	{
+		if (args.empty())
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		std::string socket_path = finder::GetOption(args, "socket", DEFAULT_SOCKET_PATH);
+		int workers = 0;
+		if (finder::GetIntOption(args, "workers", 0, workers) == finder::FAILURE || workers < 0)
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		finder::QueryServer server(args[0], socket_path, workers);
+
+		std::string shard = finder::GetOption(args, "shard", "");
+		if (!shard.empty())
+		{
+			int index = 0, count = 1;
+			if (sscanf(shard.c_str(), "%d/%d", &index, &count) != 2 || count < 1 || index < 0 || index >= count)
+			{
+				std::cerr << "Invalid shard: " << shard << std::endl;
+				return EXIT_FAILURE;
+			}
+			server.SetShard(index, count);
+		}
+
+		return server.Run();
+	}
+
+	int Coordinate(const std::vector<std::string>& args)
+	{
+		std::vector<std::string> backends;
+		std::stringstream list(finder::GetOption(args, "backends", ""));
+		for (std::string backend; std::getline(list, backend, ','); )
+		{
+			if (!backend.empty())
+				backends.push_back(backend);
+		}
+		if (backends.empty())
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		std::string socket_path = finder::GetOption(args, "socket", DEFAULT_SOCKET_PATH);
+		int workers = 0;
+		int timeout = 0;
+		if (finder::GetIntOption(args, "workers", 0, workers) == finder::FAILURE || workers < 0 ||
+			finder::GetIntOption(args, "timeout", 5000, timeout) == finder::FAILURE || timeout <= 0)
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		finder::QueryServer coordinator("", socket_path, workers);
+		coordinator.SetBackends(backends, timeout);
+		return coordinator.Run();
+	}
+
+	int Query(const std::vector<std::string>& args)
+	{
+		if (args.empty())
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		int topn = 0;
+		if (finder::GetIntOption(args, "top", 10, topn) == finder::FAILURE || topn < 1)
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		nlohmann::json request;
+		request["path"] = std::filesystem::absolute(args[0]).string();
+		request["top"] = topn;
+
+		std::string response;
+		if (finder::SendQuery(finder::GetOption(args, "socket", DEFAULT_SOCKET_PATH), request.dump(), response) == finder::FAILURE)
+			return EXIT_FAILURE;
+
+		printf("%s\n", response.c_str());
+		return EXIT_SUCCESS;
+	}
+
+	int Crawl(const std::vector<std::string>& args)
+	{
+		if (args.empty())
+		{
+			finder::PrintUsage();
+			return EXIT_FAILURE;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<finder::ManifestEntry> manifest;
+		if (finder::CrawlLibrary(args[0], manifest) == finder::FAILURE)
+			return EXIT_FAILURE;
+		auto end = std::chrono::high_resolution_clock::now();
+
+		finder::uint64 total_size = 0;
+		for (const finder::ManifestEntry& entry: manifest)
+		{
+			std::string path = std::filesystem::proximate(entry.path, args[0]).string();
+			printf("%llu\t%lld\t%s\n", entry.size, entry.mtime, path.c_str());
+			total_size += entry.size;
+		}
+
+		std::cerr << manifest.size() << " audio files, " << total_size << " bytes, found in "
+			<< std::chrono::duration<float>(end - start).count() << " seconds" << std::endl;
+
+		return EXIT_SUCCESS;
+	}
+}
+
+namespace finder
+{
+	void PrintUsage()
+	{
+		std::cerr <<
+			"Usage: SampleFinder [command] [args...]\n"
+			"Runs the GUI when no command is given.\n"
+			"\n"
+			"Commands:\n"
+			"  recognize <library> <audio|-> [--raw=<rate>:<channels>]\n"
+			"      Progressively match audio from a file or stdin against a library, stopping as soon as the best\n"
+			"      match is confident enough. Use --raw for headerless 16-bit PCM (e.g. from a live source).\n"
+			"  serve <library> [--socket=<path>] [--workers=<n>] [--shard=<i>/<n>]\n"
+			"      Keep the library resident and answer JSON queries over a Unix domain socket. With --shard, only\n"
+			"      keep the i-th of n slices of the library, to run as one worker behind a coordinator.\n"
+			"  coordinate --backends=<socket,socket,...> [--socket=<path>] [--timeout=<ms>]\n"
+			"      Fingerprint queries once, fan them out to shard workers and merge their results. Workers that\n"
+			"      don't answer within the timeout are reported as missing instead of failing the query.\n"
+			"  query <audio> [--socket=<path>] [--top=<n>]\n"
+			"      Ask a running server to match an audio file and print its JSON response.\n"
+			"  crawl <library>\n"
+			"      List the audio files a library would load, sorted by path, one \"size<TAB>mtime<TAB>path\" line each.\n"
+			"  bench [--tracks=<n>] [--seconds=<s>] [--repeats=<n>] [--seed=<n>] [--json=<path>]\n"
+			"      Time the fingerprinting and matching stages on synthetic audio and a synthetic library. Prints a\n"
+			"      table to stderr and JSON to stdout (or the given file) that can be diffed between builds.\n"
+			"  harness [--tracks=<n>] [--seconds=<s>] [--queries=<n>] [--clip=<s>] [--seed=<n>] [--library=<path>]\n"
+			"          [--json=<path>] [--min-recall=<0-1>]\n"
+			"      Query a synthetic library (or up to --tracks tracks of a real one) with cut, noisy, EQ'd, resampled,\n"
+			"      pitch-shifted and time-stretched clips of its own tracks. Reports recall@1/@10, offset error and\n"
+			"      query latency, and fails below --min-recall.\n"
+			"  tune [harness options] [--trials=<n>] [--grid] [--min-recall=<0-1>] [--prefer=latency|throughput|size]\n"
+			"       [--save[=<path>]] [--json=<path>]\n"
+			"      Run the harness over a sample (or with --grid, all) of fan value, peak neighborhood, min. amplitude,\n"
+			"      window size and overlap combinations and print the Pareto front. Only with --save is the best one\n"
+			"      written, to settings.json or the given path.\n"
+			<< std::endl;
+	}
+
+	std::string GetOption(const std::vector<std::string>& args, const std::string& name, const std::string& fallback)
+	{
+		std::string prefix = "--" + name + "=";
+		for (const std::string& arg: args)
+		{
+			if (arg.rfind(prefix, 0) == 0)
+				return arg.substr(prefix.size());
+		}
+		return fallback;
+	}
+
+	/*
+	 * The numeric options fail on anything that isn't entirely a number (and say so), rather than throwing or quietly
+	 * turning a typo into 0. Range checks are up to the caller.
+	 */
+	ErrCode GetIntOption(const std::vector<std::string>& args, const std::string& name, int fallback, int& out)
+	{
+		std::string value = GetOption(args, name, std::to_string(fallback));
+		char* end = nullptr;
+		errno = 0;
+		long parsed = strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end || errno || parsed < INT_MIN || parsed > INT_MAX)
+		{
+			std::cerr << "Invalid --" << name << ": " << value << std::endl;
+			return FAILURE;
+		}
+		out = (int) parsed;
+		return SUCCESS;
+	}
+
+	ErrCode GetFloatOption(const std::vector<std::string>& args, const std::string& name, float fallback, float& out)
+	{
+		std::string value = GetOption(args, name, std::to_string(fallback));
+		char* end = nullptr;
+		errno = 0;
+		float parsed = strtof(value.c_str(), &end);
+		if (value.empty() || *end || errno || !std::isfinite(parsed))
+		{
+			std::cerr << "Invalid --" << name << ": " << value << std::endl;
+			return FAILURE;
+		}
+		out = parsed;
+		return SUCCESS;
+	}
+
+	ErrCode GetUInt64Option(const std::vector<std::string>& args, const std::string& name, uint64 fallback, uint64& out)
+	{
+		std::string value = GetOption(args, name, std::to_string(fallback));
+		char* end = nullptr;
+		errno = 0;
+		unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+		if (value.empty() || value[0] == '-' || *end || errno)
+		{
+			std::cerr << "Invalid --" << name << ": " << value << std::endl;
+			return FAILURE;
+		}
+		out = parsed;
+		return SUCCESS;
+	}
+
+	/*
+	 * The library loads and processes on its own threads, which is what the UI wants. Command-line tools just want it done.
+	 */
+	ErrCode OpenLibrary(AudioLibrary& library, const std::string& path)
+	{
+		if (!std::filesystem::is_directory(path))
+		{
+			std::cerr << "Library path is not a directory: " << path << std::endl;
+			return FAILURE;
+		}
+
+		auto wait = [&library]()
+		{
+			while (library.loading)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		};
+
+		if (library.Load(path) == FAILURE)
+			return FAILURE;
+		wait();
+		library.Process();
+		wait();
+
+		std::cerr << "Library ready: " << library.fingerprints.size() << " fingerprinted tracks" << std::endl;
+
+		return SUCCESS;
+	}
+
+	int RunCommand(int argc, char* argv[])
+	{
+		LoadSettings("./settings.json", settings);
+
+		std::string command = argv[1];
+		std::vector<std::string> args(argv + 2, argv + argc);
+
+		if (command == "recognize")
+			return Recognize(args);
+		if (command == "serve")
+			return Serve(args);
+		if (command == "coordinate")
+			return Coordinate(args);
+		if (command == "query")
+			return Query(args);
+		if (command == "crawl")
+			return Crawl(args);
+		if (command == "bench")
+			return RunBenchmarks(args);
+		if (command == "harness")
+			return RunHarness(args);
+		if (command == "tune")
+			return RunTuning(args);
+
+		PrintUsage();
+		return command == "help" || command == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+}
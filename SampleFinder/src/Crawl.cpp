@@ -0,0 +1,112 @@
+#include "SampleFinder.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+	// Crawling is all waiting on the filesystem (especially over the network), so it's worth having more threads than cores
+	constexpr int MIN_CRAWL_THREADS = 8;
+	constexpr int CRAWL_THREADS_PER_CORE = 2;
+}
+
+namespace finder
+{
+	/*
+	 * Walk the library with a pool of threads sharing a queue of directories: each one lists a directory, queues up the
+	 * subdirectories it finds and keeps the audio files. Everything is listed exactly once, and the result comes back
+	 * sorted by path so loading order (and therefore the cache) doesn't depend on which thread got where first.
+	 */
+	ErrCode CrawlLibrary(const std::string& root, std::vector<ManifestEntry>& manifest)
+	{
+		manifest.clear();
+
+		std::error_code ec;
+		if (!std::filesystem::is_directory(root, ec))
+		{
+			std::cerr << "Library path is not a directory: " << root << std::endl;
+			return FAILURE;
+		}
+
+		std::deque<std::string> queue = { root };
+		size_t busy = 0;
+		std::mutex queue_mutex;
+		std::condition_variable queue_cv;
+
+		int num_threads = std::max<int>(MIN_CRAWL_THREADS, std::thread::hardware_concurrency() * CRAWL_THREADS_PER_CORE);
+		std::vector<std::vector<ManifestEntry>> found(num_threads);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < num_threads; t++)
+		{
+			threads.emplace_back([&, t]()
+			{
+				std::vector<std::string> subdirectories;
+				while (true)
+				{
+					std::string directory;
+					{
+						std::unique_lock<std::mutex> lck(queue_mutex);
+						queue_cv.wait(lck, [&]() { return !queue.empty() || busy == 0; });
+						if (queue.empty())
+							return; // Nothing queued and nobody left who could queue more
+						directory = std::move(queue.front());
+						queue.pop_front();
+						busy++;
+					}
+
+					std::error_code dir_ec;
+					for (auto it = std::filesystem::directory_iterator(directory, std::filesystem::directory_options::skip_permission_denied, dir_ec);
+						!dir_ec && it != std::filesystem::directory_iterator(); it.increment(dir_ec))
+					{
+						// Linked directories aren't followed, same as recursive_directory_iterator (and the watcher): a link
+						// back up the tree would have us listing forever
+						std::error_code entry_ec;
+						if (it->is_directory(entry_ec))
+						{
+							if (!it->is_symlink(entry_ec))
+								subdirectories.push_back(it->path().string());
+							continue;
+						}
+
+						std::string path = it->path().string();
+						if (!IsAudioPath(path) || !it->is_regular_file(entry_ec))
+							continue;
+
+						ManifestEntry entry;
+						entry.path = std::move(path);
+						entry.size = it->file_size(entry_ec);
+						entry.mtime = it->last_write_time(entry_ec).time_since_epoch().count();
+						found[t].push_back(std::move(entry));
+					}
+					if (dir_ec)
+						std::cerr << "Failed to list " << directory << ": " << dir_ec.message() << std::endl;
+
+					std::unique_lock<std::mutex> lck(queue_mutex);
+					for (std::string& subdirectory: subdirectories)
+						queue.push_back(std::move(subdirectory));
+					subdirectories.clear();
+					busy--;
+					queue_cv.notify_all();
+				}
+			});
+		}
+		for (std::thread& thread: threads)
+			thread.join();
+
+		size_t total = 0;
+		for (const auto& entries: found)
+			total += entries.size();
+		manifest.reserve(total);
+		for (auto& entries: found)
+			std::move(entries.begin(), entries.end(), std::back_inserter(manifest));
+		std::sort(manifest.begin(), manifest.end(), [](const ManifestEntry& a, const ManifestEntry& b)
+		{
+			return a.path < b.path;
+		});
+
+		return SUCCESS;
+	}
+}
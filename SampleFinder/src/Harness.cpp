@@ -0,0 +1,540 @@
+#include "SampleFinder.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <execution>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace
+{
+	constexpr double TWO_PI = 6.283185307179586;
+	constexpr int HARNESS_FORMAT_VERSION = 1;
+
+	// How hard each distortion hits. Fixed, so reports from different builds are comparable.
+	constexpr float NOISE_SNR_DB = 10.0f;
+	constexpr float RESAMPLE_RATE = 8000.0f;
+	constexpr float PITCH_SEMITONES = 0.5f; // Up or down, picked per query
+	constexpr float STRETCH_AMOUNT = 0.04f; // Faster or slower, picked per query
+	constexpr int STRETCH_FRAME = 1024;
+	constexpr int STRETCH_HOP = STRETCH_FRAME / 4;
+	constexpr int STRETCH_SEARCH = STRETCH_HOP / 2; // How far either side of its nominal position a frame may move
+
+	enum Distortion
+	{
+		DISTORT_CUT,
+		DISTORT_NOISE,
+		DISTORT_EQ,
+		DISTORT_RESAMPLE,
+		DISTORT_PITCH,
+		DISTORT_STRETCH,
+		DISTORTION_COUNT
+	};
+
+	const char* DISTORTION_NAMES[DISTORTION_COUNT] = {
+		"cut",
+		"noise",
+		"eq",
+		"resample",
+		"pitch",
+		"stretch"
+	};
+
+	struct QueryPlan
+	{
+		int track;
+		size_t start; // Sample the clip starts at in the track
+		Distortion distortion;
+		finder::uint64 seed;
+	};
+
+	/*
+	 * RBJ cookbook biquad, direct form I
+	 */
+	struct Biquad
+	{
+		double b0, b1, b2, a1, a2;
+
+		static Biquad Peaking(float rate, double freq, double gain_db, double q)
+		{
+			double a = pow(10.0, gain_db / 40.0);
+			double w0 = TWO_PI * freq / rate;
+			double alpha = sin(w0) / (2.0 * q);
+			double a0 = 1.0 + alpha / a;
+			return { (1.0 + alpha * a) / a0, -2.0 * cos(w0) / a0, (1.0 - alpha * a) / a0, -2.0 * cos(w0) / a0, (1.0 - alpha / a) / a0 };
+		}
+
+		static Biquad LowPass(float rate, double freq, double q)
+		{
+			double w0 = TWO_PI * freq / rate;
+			double alpha = sin(w0) / (2.0 * q);
+			double a0 = 1.0 + alpha;
+			double c = cos(w0);
+			return { (1.0 - c) * 0.5 / a0, (1.0 - c) / a0, (1.0 - c) * 0.5 / a0, -2.0 * c / a0, (1.0 - alpha) / a0 };
+		}
+
+		void Apply(std::vector<float>& samples) const
+		{
+			double x1 = 0.0, x2 = 0.0, y1 = 0.0, y2 = 0.0;
+			for (float& v: samples)
+			{
+				double y = b0 * v + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+				x2 = x1;
+				x1 = v;
+				y2 = y1;
+				y1 = y;
+				v = (float) y;
+			}
+		}
+	};
+
+	/*
+	 * Linear interpolation; callers low-pass first when they're going down
+	 */
+	std::vector<float> Resample(const std::vector<float>& in, double ratio)
+	{
+		std::vector<float> out((size_t) (in.size() * ratio));
+		for (size_t i = 0; i < out.size(); i++)
+		{
+			double pos = i / ratio;
+			size_t a = std::min((size_t) pos, in.size() - 1);
+			size_t b = std::min(a + 1, in.size() - 1);
+			double t = pos - a;
+			out[i] = (float) (in[a] * (1.0 - t) + in[b] * t);
+		}
+		return out;
+	}
+
+	/*
+	 * WSOLA: each frame is taken from wherever near its nominal position best continues the previous one, so the pitch
+	 * stays put. It still smears transients, which is the kind of damage a real stretch does too.
+	 */
+	std::vector<float> TimeStretch(const std::vector<float>& in, double factor)
+	{
+		if (in.size() < STRETCH_FRAME * 2)
+			return Resample(in, factor);
+
+		std::vector<float> out((size_t) (in.size() * factor), 0.0f);
+		std::vector<float> weights(out.size(), 0.0f);
+		std::vector<float> window(STRETCH_FRAME);
+		for (int n = 0; n < STRETCH_FRAME; n++)
+			window[n] = (float) (0.5 - 0.5 * cos(TWO_PI * n / STRETCH_FRAME));
+
+		double analysis_hop = STRETCH_HOP / factor;
+		size_t last_from = in.size() - STRETCH_FRAME;
+		size_t previous = 0;
+		for (size_t k = 0; k * STRETCH_HOP < out.size(); k++)
+		{
+			size_t to = k * STRETCH_HOP;
+			size_t from = std::min((size_t) (k * analysis_hop), last_from);
+			if (k > 0)
+			{
+				// Compare against what would have followed the previous frame, over the part the frames overlap
+				size_t natural = std::min(previous + STRETCH_HOP, last_from);
+				size_t lo = from > STRETCH_SEARCH ? from - STRETCH_SEARCH : 0;
+				size_t hi = std::min(from + STRETCH_SEARCH, last_from);
+				double best = -INFINITY;
+				for (size_t candidate = lo; candidate <= hi; candidate++)
+				{
+					double score = 0.0;
+					for (int n = 0; n < STRETCH_FRAME - STRETCH_HOP; n += 2)
+						score += in[candidate + n] * in[natural + n];
+					if (score > best)
+					{
+						best = score;
+						from = candidate;
+					}
+				}
+			}
+			previous = from;
+
+			for (int n = 0; n < STRETCH_FRAME && to + n < out.size(); n++)
+			{
+				out[to + n] += in[from + n] * window[n];
+				weights[to + n] += window[n];
+			}
+		}
+		for (size_t i = 0; i < out.size(); i++)
+		{
+			if (weights[i] > 1e-3f)
+				out[i] /= weights[i];
+		}
+		return out;
+	}
+
+	float Rms(const std::vector<float>& samples)
+	{
+		double sum = 0.0;
+		for (float v: samples)
+			sum += (double) v * v;
+		return samples.empty() ? 0.0f : (float) sqrt(sum / samples.size());
+	}
+
+	void Distort(Distortion distortion, finder::uint64 seed, float rate, std::vector<float>& clip)
+	{
+		bool up = seed & 1;
+		switch (distortion)
+		{
+		case DISTORT_NOISE:
+		{
+			std::vector<float> noise;
+			finder::SynthesizeSignal(finder::SIGNAL_NOISE, seed, clip.size() / rate + 1.0f, rate, noise);
+			float gain = Rms(clip) / std::max(Rms(noise), 1e-6f) / powf(10.0f, NOISE_SNR_DB / 20.0f);
+			for (size_t i = 0; i < clip.size(); i++)
+				clip[i] += noise[i] * gain;
+			break;
+		}
+		case DISTORT_EQ:
+			// Thin and boxy, roughly what a laptop speaker into a phone mic does
+			Biquad::Peaking(rate, 120.0, -12.0, 0.7).Apply(clip);
+			Biquad::Peaking(rate, 1000.0, 6.0, 1.0).Apply(clip);
+			Biquad::Peaking(rate, 6000.0, -12.0, 0.7).Apply(clip);
+			break;
+		case DISTORT_RESAMPLE:
+		{
+			size_t length = clip.size();
+			Biquad::LowPass(rate, RESAMPLE_RATE * 0.45, 0.707).Apply(clip);
+			clip = Resample(Resample(clip, RESAMPLE_RATE / rate), rate / RESAMPLE_RATE);
+			clip.resize(length, 0.0f);
+			break;
+		}
+		case DISTORT_PITCH:
+		{
+			// Speed up (or down) to move the pitch, then stretch back to the original duration
+			size_t length = clip.size();
+			double ratio = pow(2.0, (up ? PITCH_SEMITONES : -PITCH_SEMITONES) / 12.0);
+			clip = TimeStretch(Resample(clip, 1.0 / ratio), ratio);
+			clip.resize(length, 0.0f);
+			break;
+		}
+		case DISTORT_STRETCH:
+			clip = TimeStretch(clip, up ? 1.0 + STRETCH_AMOUNT : 1.0 - STRETCH_AMOUNT);
+			break;
+		default:
+			break;
+		}
+	}
+
+	double Percentile(std::vector<double> values, double p)
+	{
+		if (values.empty())
+			return 0.0;
+		std::sort(values.begin(), values.end());
+		size_t rank = (size_t) ceil(p * values.size());
+		return values[std::clamp(rank, (size_t) 1, values.size()) - 1];
+	}
+
+	float Median(std::vector<float> values)
+	{
+		if (values.empty())
+			return 0.0f;
+		std::sort(values.begin(), values.end());
+		size_t n = values.size();
+		return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) * 0.5f;
+	}
+
+	nlohmann::json RowJson(const finder::HarnessRow& row)
+	{
+		nlohmann::json json;
+		json["name"] = row.name;
+		json["queries"] = row.queries;
+		json["recall_at_1"] = row.queries ? (double) row.top1 / row.queries : 0.0;
+		json["recall_at_10"] = row.queries ? (double) row.top10 / row.queries : 0.0;
+		json["offset_error_s"] = row.offset_error;
+		return json;
+	}
+
+	void PrintRow(const finder::HarnessRow& row)
+	{
+		fprintf(stderr, "%-12s %8d %9.1f%% %9.1f%% %12.3f\n", row.name.c_str(), row.queries,
+			row.queries ? 100.0 * row.top1 / row.queries : 0.0,
+			row.queries ? 100.0 * row.top10 / row.queries : 0.0,
+			row.offset_error);
+	}
+}
+
+namespace finder
+{
+	ErrCode GetHarnessOptions(const std::vector<std::string>& args, HarnessOptions& out)
+	{
+		if (GetIntOption(args, "tracks", 30, out.tracks) == FAILURE ||
+			GetFloatOption(args, "seconds", 30.0f, out.seconds) == FAILURE ||
+			GetIntOption(args, "queries", 20, out.queries) == FAILURE ||
+			GetFloatOption(args, "clip", 5.0f, out.clip_seconds) == FAILURE ||
+			GetUInt64Option(args, "seed", 1, out.seed) == FAILURE)
+			return FAILURE;
+		out.library_path = GetOption(args, "library", "");
+		return SUCCESS;
+	}
+
+	/*
+	 * Fingerprints a library with the current settings, then queries it with distorted clips of its own tracks and scores
+	 * the answers. The library is synthetic unless options.library_path is set, in which case up to options.tracks real
+	 * tracks are picked from it by the seed; their fingerprinting time then includes decoding them. Everything goes through
+	 * AudioFile::Process and AudioLibrary::TestSong, the same as the UI, so this measures what users would get.
+	 */
+	ErrCode EvaluateAccuracy(const HarnessOptions& options, HarnessReport& out)
+	{
+		bool synthetic = options.library_path.empty();
+		if (options.tracks < 1 || options.queries < 1 || options.clip_seconds <= 0.0f || (synthetic && options.seconds < options.clip_seconds))
+		{
+			std::cerr << "Need at least 1 track and 1 query, and tracks at least as long as the clips" << std::endl;
+			return FAILURE;
+		}
+
+		out = HarnessReport();
+		float rate = settings.fs;
+		size_t clip_samples = (size_t) (options.clip_seconds * rate);
+
+		// Shuffled by the seed rather than taken off the top, so a capped run doesn't only ever see one corner of the library
+		std::vector<std::string> paths;
+		if (!synthetic)
+		{
+			std::vector<ManifestEntry> manifest;
+			if (CrawlLibrary(options.library_path, manifest) == FAILURE)
+				return FAILURE;
+
+			std::mt19937_64 random(options.seed);
+			for (size_t i = manifest.size(); i > 1; i--)
+				std::swap(manifest[i - 1], manifest[random() % i]);
+			for (size_t i = 0; i < manifest.size() && i < (size_t) options.tracks; i++)
+				paths.push_back(manifest[i].path);
+		}
+		int num_tracks = synthetic ? options.tracks : (int) paths.size();
+
+		// Either way a track's audio can be had again from its number alone, so none of it needs to stay in memory
+		auto track_audio = [&](int i, std::vector<float>& samples)
+		{
+			if (synthetic)
+			{
+				SynthesizeSignal((SignalKind) (i % SIGNAL_KIND_COUNT), options.seed + i, options.seconds, rate, samples);
+				return SUCCESS;
+			}
+
+			AudioFile decoded;
+			if (decoded.Load(paths[i]) == FAILURE)
+				return FAILURE;
+			samples = std::move(decoded.sample_data);
+			return SUCCESS;
+		};
+
+		std::vector<std::shared_ptr<AudioFile>> tracks(num_tracks);
+		std::vector<size_t> track_samples(num_tracks, 0);
+		std::vector<int> ids(num_tracks);
+		std::iota(ids.begin(), ids.end(), 0);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		std::for_each(std::execution::par, ids.begin(), ids.end(), [&](int i)
+		{
+			auto file = std::make_shared<AudioFile>();
+			if (synthetic)
+				file->path = "synthetic/" + std::to_string(i) + "_" + SignalKindName((SignalKind) (i % SIGNAL_KIND_COUNT)) + ".wav";
+			else
+				file->path = paths[i];
+
+			// Tracks that won't decode, or that are too short to cut a clip from, are left out
+			if (track_audio(i, file->sample_data) == FAILURE || file->sample_data.size() < clip_samples)
+				return;
+			track_samples[i] = file->sample_data.size();
+			file->length = track_samples[i] / rate;
+			file->loaded = true;
+			file->Process();
+
+			// Queries regenerate what they need, a whole library of samples adds up
+			file->sample_data = std::vector<float>();
+			tracks[i] = file;
+		});
+		auto end = std::chrono::high_resolution_clock::now();
+		out.fingerprint_seconds = std::chrono::duration<double>(end - start).count();
+
+		AudioLibrary library;
+		std::vector<int> usable;
+		std::vector<SID> added;
+		for (int i = 0; i < num_tracks; i++)
+		{
+			if (!tracks[i])
+				continue;
+			usable.push_back(i);
+			library.files.push_back(tracks[i]);
+			added.push_back(tracks[i].get());
+			out.library_hashes += tracks[i]->fingerprint.hashes.size();
+			out.audio_seconds += track_samples[i] / rate;
+		}
+		if (usable.empty())
+		{
+			std::cerr << "No tracks in " << options.library_path << " could be loaded and are at least as long as the clips" << std::endl;
+			return FAILURE;
+		}
+		library.UpdateTracks(added, {});
+
+		std::shared_ptr<const LibraryIndex> index = library.GetIndex();
+		for (const std::shared_ptr<const HashIndex>& shard: index->shards)
+			out.index_bytes += shard->postings.size() * sizeof(Posting) + shard->buckets.size() * sizeof(uint32);
+
+		// Decide every query up front, so the same seed asks the same questions whatever the settings
+		std::mt19937_64 random(options.seed);
+		std::vector<QueryPlan> plans;
+		for (int d = 0; d < DISTORTION_COUNT; d++)
+		{
+			for (int q = 0; q < options.queries; q++)
+			{
+				QueryPlan plan;
+				plan.track = usable[random() % usable.size()];
+				plan.start = (size_t) (random() % (track_samples[plan.track] - clip_samples + 1));
+				plan.distortion = (Distortion) d;
+				plan.seed = random();
+				plans.push_back(plan);
+			}
+		}
+		// One track's audio is all that's needed at a time
+		std::stable_sort(plans.begin(), plans.end(), [](const QueryPlan& a, const QueryPlan& b)
+		{
+			return a.track < b.track;
+		});
+
+		int hop = settings.default_window_size - (int) (settings.default_window_size * settings.default_overlap_ratio);
+		std::vector<int> top1(DISTORTION_COUNT, 0);
+		std::vector<int> top10(DISTORTION_COUNT, 0);
+		std::vector<std::vector<float>> offset_errors(DISTORTION_COUNT);
+		std::vector<float> all_offset_errors;
+		std::vector<double> latencies;
+
+		std::vector<float> samples;
+		int loaded_track = -1;
+		for (const QueryPlan& plan: plans)
+		{
+			if (plan.track != loaded_track)
+			{
+				// A real track that changed since it was fingerprinted just counts as a miss
+				if (track_audio(plan.track, samples) == FAILURE)
+					samples.clear();
+				loaded_track = plan.track;
+			}
+			if (samples.size() < plan.start + clip_samples)
+				continue;
+
+			AudioFile query;
+			query.path = "query.wav"; // Anything that isn't a library track's name, or TestSong would skip that track
+			query.sample_data.assign(samples.begin() + plan.start, samples.begin() + plan.start + clip_samples);
+			Distort(plan.distortion, plan.seed, rate, query.sample_data);
+			query.length = query.sample_data.size() / rate;
+			query.loaded = true;
+			query.Process();
+
+			auto query_start = std::chrono::high_resolution_clock::now();
+			library.TestSong(query);
+			auto query_end = std::chrono::high_resolution_clock::now();
+			latencies.push_back(std::chrono::duration<double>(query_end - query_start).count());
+
+			SID expected = tracks[plan.track].get();
+			auto found = std::find_if(library.matches.begin(), library.matches.end(), [expected](const FoundSong& song)
+			{
+				return song.sid == expected;
+			});
+			if (found == library.matches.end())
+				continue;
+
+			top10[plan.distortion]++;
+			if (found == library.matches.begin())
+			{
+				top1[plan.distortion]++;
+
+				// In spectrogram frames, like FoundSong::offset, rather than trusting offset_secs' conversion
+				float error = fabsf(found->offset - (float) plan.start / hop) * hop / rate;
+				offset_errors[plan.distortion].push_back(error);
+				all_offset_errors.push_back(error);
+			}
+		}
+
+		out.overall = { "overall", 0, 0, 0, Median(all_offset_errors) };
+		for (int d = 0; d < DISTORTION_COUNT; d++)
+		{
+			out.rows.push_back({ DISTORTION_NAMES[d], options.queries, top1[d], top10[d], Median(offset_errors[d]) });
+			out.overall.queries += options.queries;
+			out.overall.top1 += top1[d];
+			out.overall.top10 += top10[d];
+		}
+		out.latency_p50 = Percentile(latencies, 0.5);
+		out.latency_p99 = Percentile(latencies, 0.99);
+
+		return SUCCESS;
+	}
+
+	void PrintHarnessReport(const HarnessReport& report)
+	{
+		fprintf(stderr, "\n%-12s %8s %10s %10s %12s\n", "distortion", "queries", "recall@1", "recall@10", "offset err s");
+		for (const HarnessRow& row: report.rows)
+			PrintRow(row);
+		PrintRow(report.overall);
+		fprintf(stderr, "\nLibrary: %llu hashes, %.1f MB of index, fingerprinted at %.1f audio s/s\n",
+			report.library_hashes, report.index_bytes / (1024.0 * 1024.0),
+			report.fingerprint_seconds > 0.0 ? report.audio_seconds / report.fingerprint_seconds : 0.0);
+		fprintf(stderr, "Query latency: p50 %.2f ms, p99 %.2f ms\n", report.latency_p50 * 1000.0, report.latency_p99 * 1000.0);
+	}
+
+	/*
+	 * AudioFile::Process logs to stdout as it goes, so the JSON only goes to a file. With --min-recall, exits non-zero when
+	 * overall recall@1 falls below it, for running from scripts.
+	 */
+	int RunHarness(const std::vector<std::string>& args)
+	{
+		HarnessOptions options;
+		float min_recall = 0.0f;
+		if (GetHarnessOptions(args, options) == FAILURE || GetFloatOption(args, "min-recall", 0.0f, min_recall) == FAILURE)
+		{
+			PrintUsage();
+			return EXIT_FAILURE;
+		}
+		std::string json_path = GetOption(args, "json", "");
+
+		HarnessReport report;
+		if (EvaluateAccuracy(options, report) == FAILURE)
+			return EXIT_FAILURE;
+		PrintHarnessReport(report);
+
+		double recall = (double) report.overall.top1 / report.overall.queries;
+		if (!json_path.empty())
+		{
+			char profile[17];
+			snprintf(profile, sizeof(profile), "%016llx", (unsigned long long) SettingsProfile(settings));
+
+			nlohmann::json json;
+			json["version"] = HARNESS_FORMAT_VERSION;
+			json["settings_profile"] = profile;
+			json["rate"] = settings.fs;
+			json["seed"] = options.seed;
+			if (!options.library_path.empty())
+				json["library"] = options.library_path;
+			json["tracks"] = options.tracks;
+			json["seconds"] = options.seconds;
+			json["clip_seconds"] = options.clip_seconds;
+			json["library_hashes"] = report.library_hashes;
+			json["index_bytes"] = report.index_bytes;
+			json["fingerprint_audio_seconds_per_s"] = report.fingerprint_seconds > 0.0 ? report.audio_seconds / report.fingerprint_seconds : 0.0;
+			json["latency_p50_s"] = report.latency_p50;
+			json["latency_p99_s"] = report.latency_p99;
+			json["overall"] = RowJson(report.overall);
+			json["distortions"] = nlohmann::json::array();
+			for (const HarnessRow& row: report.rows)
+				json["distortions"].push_back(RowJson(row));
+
+			if (SaveTextFile(json_path, json.dump(2) + "\n") == FAILURE)
+				return EXIT_FAILURE;
+		}
+
+		if (recall < min_recall)
+		{
+			fprintf(stderr, "Recall@1 %.1f%% is below the required %.1f%%\n", recall * 100.0, min_recall * 100.0);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+}
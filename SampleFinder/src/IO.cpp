@@ -1,61 +1,460 @@
 #include "SampleFinder.h"
 
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+	constexpr size_t IO_BLOCK_SIZE = 1 << 20;
+	constexpr size_t IO_BLOCK_ALIGNMENT = 4096;
+
+	bool IsLittleEndian()
+	{
+		const finder::uint16 probe = 1;
+		return *reinterpret_cast<const finder::byte*>(&probe) == 1;
+	}
+
+	finder::uint32 DecodeLE32(const finder::byte* in)
+	{
+		return (finder::uint32) in[0] | (finder::uint32) in[1] << 8 | (finder::uint32) in[2] << 16 | (finder::uint32) in[3] << 24;
+	}
+
+	void EncodeLE32(finder::uint32 v, finder::byte* out)
+	{
+		out[0] = v & 0xFF;
+		out[1] = (v >> 8) & 0xFF;
+		out[2] = (v >> 16) & 0xFF;
+		out[3] = (v >> 24) & 0xFF;
+	}
+
+	finder::byte* AllocateBlock()
+	{
+		return static_cast<finder::byte*>(::operator new[](IO_BLOCK_SIZE, std::align_val_t(IO_BLOCK_ALIGNMENT)));
+	}
+}
+
 namespace finder
 {
+	void IOBlockDeleter::operator()(byte* block) const
+	{
+		::operator delete[](block, std::align_val_t(IO_BLOCK_ALIGNMENT));
+	}
+
+	/****************************************************************/
+
 	Loader::Loader(const std::string& path):
-		m_file(path, std::ios::in | std::ios::binary)
+		m_file(path, std::ios::in | std::ios::binary),
+		m_buffer(AllocateBlock()),
+		m_pos(0),
+		m_end(0),
+		m_eof(false),
+		m_failed(!m_file)
 	{
 	}
 
 	int Loader::NextInt()
 	{
-		int i = 0;
-		m_file.read((char*) &i, 4);
+		byte b[4] = { 0 };
+		NextBytes(b, 4);
+
+		return (int32) DecodeLE32(b);
+	}
+
+	uint64 Loader::NextUInt64()
+	{
+		byte b[8] = { 0 };
+		NextBytes(b, 8);
 
-		return i;
+		return (uint64) DecodeLE32(b) | (uint64) DecodeLE32(b + 4) << 32;
 	}
 
 	float Loader::NextFloat()
 	{
-		float f = 0;
-		m_file.read((char*)&f, 4);
+		uint32 bits = (uint32) NextInt();
+		float f;
+		memcpy(&f, &bits, sizeof(f));
 
 		return f;
 	}
 
 	std::string Loader::NextString()
 	{
-		int size;
-		m_file.read((char*) &size, 4);
-		auto data = std::make_unique<finder::byte[]>(size);
-		char* buf = reinterpret_cast<char*>(data.get());
-		m_file.read(buf, size);
+		int size = NextInt();
+		if (size < 0 || m_failed)
+		{
+			m_failed = true;
+			return std::string();
+		}
 
-		return std::string(buf, size);
+		std::string ret(size, '\0');
+		NextBytes(&ret[0], size);
+
+		return ret;
+	}
+
+	/*
+	 * Copy straight out of the block buffer, and bypass it entirely for reads bigger than a block
+	 */
+	ErrCode Loader::NextBytes(void* out, size_t size)
+	{
+		byte* dest = static_cast<byte*>(out);
+		while (size > 0)
+		{
+			if (m_pos == m_end)
+			{
+				if (size >= IO_BLOCK_SIZE)
+				{
+					m_file.read(reinterpret_cast<char*>(dest), size);
+					size_t got = m_file.gcount();
+					dest += got;
+					size -= got;
+					if (size > 0)
+						break;
+					continue;
+				}
+				if (!Refill())
+					break;
+			}
+
+			size_t n = std::min(size, m_end - m_pos);
+			memcpy(dest, m_buffer.get() + m_pos, n);
+			m_pos += n;
+			dest += n;
+			size -= n;
+		}
+
+		if (size > 0)
+		{
+			// Ran off the end. Don't hand back garbage.
+			memset(dest, 0, size);
+			m_eof = m_failed = true;
+			return FAILURE;
+		}
+
+		return SUCCESS;
+	}
+
+	ErrCode Loader::NextInts(int32* out, size_t count)
+	{
+		ErrCode status = NextBytes(out, count * sizeof(int32));
+		if (!IsLittleEndian())
+		{
+			for (size_t i = 0; i < count; i++)
+				out[i] = (int32) DecodeLE32(reinterpret_cast<const byte*>(&out[i]));
+		}
+
+		return status;
+	}
+
+	void Loader::Skip(size_t bytes)
+	{
+		size_t buffered = std::min(bytes, m_end - m_pos);
+		m_pos += buffered;
+		bytes -= buffered;
+		if (bytes > 0)
+			m_file.seekg(bytes, std::ios::cur);
+	}
+
+	void Loader::Seek(uint64 offset)
+	{
+		m_pos = m_end = 0;
+		m_file.clear();
+		m_file.seekg(offset, std::ios::beg);
+		m_eof = false;
+	}
+
+	bool Loader::Good() const
+	{
+		return !m_failed;
+	}
+
+	bool Loader::Eof() const
+	{
+		return m_eof;
+	}
+
+	bool Loader::Refill()
+	{
+		m_pos = m_end = 0;
+		if (!m_file)
+			return false;
+
+		m_file.read(reinterpret_cast<char*>(m_buffer.get()), IO_BLOCK_SIZE);
+		m_end = m_file.gcount();
+
+		return m_end > 0;
 	}
 
 	/****************************************************************/
 
 	Saver::Saver(const std::string& path):
-		m_file(path, std::ios::out | std::ios::binary)
+		m_path(path),
+		m_file(path, std::ios::out | std::ios::binary),
+		m_buffer(AllocateBlock()),
+		m_pos(0),
+		m_failed(!m_file)
 	{
+		if (m_failed)
+			std::cerr << "Failed to open " << path << " for writing" << std::endl;
+	}
+
+	Saver::~Saver()
+	{
+		if (m_file.is_open())
+			Flush();
 	}
 
 	void Saver::PutInt(int v)
 	{
-		m_file.write(reinterpret_cast<const char*>(&v), sizeof(v));
+		byte b[4];
+		EncodeLE32((uint32) v, b);
+		PutBytes(b, 4);
+	}
+
+	void Saver::PutUInt64(uint64 v)
+	{
+		byte b[8];
+		EncodeLE32((uint32) (v & 0xFFFFFFFF), b);
+		EncodeLE32((uint32) (v >> 32), b + 4);
+		PutBytes(b, 8);
 	}
 
 	void Saver::PutFloat(float v)
 	{
-		m_file.write(reinterpret_cast<const char*>(&v), sizeof(v));
+		uint32 bits;
+		memcpy(&bits, &v, sizeof(bits));
+		PutInt((int) bits);
 	}
 
 	void Saver::PutString(const std::string& string, bool fixed_size)
 	{
 		if (!fixed_size)
 			PutInt(string.size());
-		m_file.write(string.c_str(), string.size());
+		PutBytes(string.data(), string.size());
+	}
+
+	void Saver::PutBytes(const void* data, size_t size)
+	{
+		const byte* src = static_cast<const byte*>(data);
+		if (m_pos + size > IO_BLOCK_SIZE)
+		{
+			Flush();
+			// Big writes go straight through
+			if (size >= IO_BLOCK_SIZE)
+			{
+				if (!m_file.write(reinterpret_cast<const char*>(src), size))
+					m_failed = true;
+				return;
+			}
+		}
+
+		memcpy(m_buffer.get() + m_pos, src, size);
+		m_pos += size;
+	}
+
+	ErrCode Saver::Flush()
+	{
+		if (m_pos > 0 && !m_failed)
+		{
+			if (!m_file.write(reinterpret_cast<const char*>(m_buffer.get()), m_pos) || !m_file.flush())
+				m_failed = true;
+		}
+		m_pos = 0;
+
+		return m_failed ? FAILURE : SUCCESS;
+	}
+
+	/*
+	 * Flush, close and make sure the bytes are actually on disk, so a rename over the old file afterwards can't leave us with
+	 * an empty one if the machine goes down
+	 */
+	ErrCode Saver::Close()
+	{
+		Flush();
+		m_file.close();
+		if (m_file.fail())
+			m_failed = true;
+
+#ifndef _WIN32
+		if (!m_failed)
+		{
+			int fd = open(m_path.c_str(), O_RDONLY);
+			if (fd < 0 || fsync(fd) != 0)
+				m_failed = true;
+			if (fd >= 0)
+				close(fd);
+		}
+#endif
+
+		return m_failed ? FAILURE : SUCCESS;
+	}
+
+	bool Saver::Good() const
+	{
+		return !m_failed;
+	}
+
+	/****************************************************************/
+
+	MappedFile::MappedFile():
+		m_data(nullptr),
+		m_size(0),
+		m_file(nullptr),
+		m_mapping(nullptr)
+	{
+	}
+
+	MappedFile::~MappedFile()
+	{
+		Close();
+	}
+
+	ErrCode MappedFile::Open(const std::string& path)
+	{
+		Close();
+
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return FAILURE;
+		m_file = file;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			Close();
+			return FAILURE;
+		}
+
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+		{
+			Close();
+			return FAILURE;
+		}
+		m_mapping = mapping;
+
+		m_data = static_cast<const byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!m_data)
+		{
+			Close();
+			return FAILURE;
+		}
+		m_size = (size_t) size.QuadPart;
+#else
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return FAILURE;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			return FAILURE;
+		}
+
+		// The mapping keeps the file alive on its own, no need to hold on to the descriptor
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+			return FAILURE;
+
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		m_data = static_cast<const byte*>(data);
+		m_size = st.st_size;
+#endif
+
+		return SUCCESS;
+	}
+
+	void MappedFile::Close()
+	{
+#ifdef _WIN32
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		if (m_file)
+			CloseHandle(m_file);
+#else
+		if (m_data)
+			munmap(const_cast<byte*>(m_data), m_size);
+#endif
+		m_data = nullptr;
+		m_size = 0;
+		m_file = nullptr;
+		m_mapping = nullptr;
+	}
+
+	const byte* MappedFile::Data() const
+	{
+		return m_data;
+	}
+
+	size_t MappedFile::Size() const
+	{
+		return m_size;
+	}
+
+	/****************************************************************/
+
+	/*
+	 * A fast 64-bit digest of a file's bytes, used to recognize the same audio under a different name. It only needs to tell
+	 * files apart, not resist tampering, so it's a simple multiply/rotate over 8-byte words followed by a final avalanche.
+	 */
+	ErrCode DigestFile(const std::string& path, uint64& out)
+	{
+		std::ifstream file(path, std::ios::in | std::ios::binary);
+		if (!file)
+			return FAILURE;
+
+		constexpr uint64 PRIME1 = 0x9E3779B185EBCA87ULL;
+		constexpr uint64 PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+
+		std::unique_ptr<byte[], IOBlockDeleter> block(AllocateBlock());
+		uint64 h = PRIME2;
+		uint64 total = 0;
+		while (file)
+		{
+			file.read(reinterpret_cast<char*>(block.get()), IO_BLOCK_SIZE);
+			size_t got = file.gcount();
+			if (got == 0)
+				break;
+
+			// Zero-pad up to a whole word; the length goes into the final mix so padding can't collide
+			size_t words = (got + 7) / 8;
+			memset(block.get() + got, 0, words * 8 - got);
+			for (size_t i = 0; i < words; i++)
+			{
+				const byte* w = block.get() + i * 8;
+				uint64 v = (uint64) DecodeLE32(w) | (uint64) DecodeLE32(w + 4) << 32;
+				h ^= v * PRIME1;
+				h = (h << 31 | h >> 33) * PRIME2;
+			}
+			total += got;
+		}
+		if (file.bad())
+			return FAILURE;
+
+		h ^= total;
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 33;
+
+		// 0 means "not known yet" everywhere else
+		out = h ? h : 1;
+
+		return SUCCESS;
 	}
 
 	/****************************************************************/
@@ -0,0 +1,269 @@
+#include "SampleFinder.h"
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <unordered_set>
+
+namespace
+{
+	constexpr int BUCKET_BITS = 16;
+	constexpr int NUM_BUCKETS = 1 << BUCKET_BITS;
+
+	inline int BucketOf(finder::uint64 key)
+	{
+		return (int) (key >> (64 - BUCKET_BITS));
+	}
+
+	inline int HexValue(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return 0;
+	}
+
+	std::vector<int> Iota(int count)
+	{
+		std::vector<int> out(count);
+		std::iota(out.begin(), out.end(), 0);
+		return out;
+	}
+
+	// Buckets are small once the postings are scattered into them, so each one just gets sorted in place
+	void SortBuckets(finder::HashIndex& shard)
+	{
+		for (int b = 0; b < NUM_BUCKETS; b++)
+		{
+			auto first = shard.postings.begin() + shard.buckets[b];
+			auto last = shard.postings.begin() + shard.buckets[b + 1];
+			if (last - first > 1)
+			{
+				std::sort(first, last, [](const finder::Posting& a, const finder::Posting& c)
+				{
+					if (a.key != c.key)
+						return a.key < c.key;
+					return a.track < c.track;
+				});
+			}
+		}
+	}
+
+	/*
+	 * Single-threaded build of one shard straight from the track list, for when only a few shards need redoing
+	 */
+	std::shared_ptr<const finder::HashIndex> BuildShard(const std::vector<std::shared_ptr<finder::AudioFile>>& tracks, int shard_id, int num_shards)
+	{
+		auto shard = std::make_shared<finder::HashIndex>();
+
+		std::vector<finder::uint32> cursors(NUM_BUCKETS, 0);
+		size_t total = 0;
+		for (size_t i = shard_id; i < tracks.size(); i += num_shards)
+		{
+			if (!tracks[i])
+				continue;
+			for (const auto& [hash, offset]: tracks[i]->fingerprint.hashes)
+				cursors[BucketOf(finder::HashKey(hash))]++;
+			total += tracks[i]->fingerprint.hashes.size();
+		}
+
+		shard->buckets.assign(NUM_BUCKETS + 1, 0);
+		finder::uint32 sum = 0;
+		for (int b = 0; b < NUM_BUCKETS; b++)
+		{
+			shard->buckets[b] = sum;
+			finder::uint32 count = cursors[b];
+			cursors[b] = sum;
+			sum += count;
+		}
+		shard->buckets[NUM_BUCKETS] = sum;
+
+		shard->postings.resize(total);
+		for (size_t i = shard_id; i < tracks.size(); i += num_shards)
+		{
+			if (!tracks[i])
+				continue;
+			for (const auto& [hash, offset]: tracks[i]->fingerprint.hashes)
+			{
+				finder::uint64 key = finder::HashKey(hash);
+				shard->postings[cursors[BucketOf(key)]++] = {key, (finder::int32) i, offset};
+			}
+		}
+
+		SortBuckets(*shard);
+
+		return shard;
+	}
+}
+
+namespace finder
+{
+	/*
+	 * Hashes are hex strings; the index works on their leading 64 bits, left-aligned so shorter (reduced) hashes still
+	 * spread across every radix bucket. With the default 20 hex digits the chance of two distinct hashes sharing a key is
+	 * on the order of 2^-64 per pair, i.e. not something we need to worry about.
+	 */
+	uint64 HashKey(const std::string& hash)
+	{
+		uint64 key = 0;
+		int digits = std::min<int>(hash.size(), 16);
+		for (int i = 0; i < digits; i++)
+			key = (key << 4) | HexValue(hash[i]);
+		if (digits < 16)
+			key <<= 4 * (16 - digits);
+
+		return key;
+	}
+
+	std::pair<const Posting*, const Posting*> HashIndex::Find(uint64 key) const
+	{
+		if (postings.empty())
+			return {nullptr, nullptr};
+
+		int bucket = BucketOf(key);
+		const Posting* first = postings.data() + buckets[bucket];
+		const Posting* last = postings.data() + buckets[bucket + 1];
+
+		return std::equal_range(first, last, Posting{key, 0, 0}, [](const Posting& a, const Posting& b)
+		{
+			return a.key < b.key;
+		});
+	}
+
+	size_t HashIndex::Size() const
+	{
+		return postings.size();
+	}
+
+	/*
+	 * Build the postings for every shard in one go:
+	 *
+	 * 1. Each thread turns its slice of the tracks into (key, track, offset) tuples, straight into its own per-shard buffer.
+	 *    Buffers are sized up front from the hash counts so nothing grows while we fill them.
+	 * 2. For each shard, one MSD radix pass on the top 16 bits of the key scatters every buffer directly into its final spot
+	 *    in the contiguous postings array. The bucket offsets it produces double as the lookup directory. Each shard keeps a
+	 *    single cursor array, so the transient memory doesn't grow with the core count.
+	 * 3. Buckets are small by then, so each one just gets sorted in place.
+	 */
+	std::shared_ptr<const LibraryIndex> BuildIndex(const std::vector<Fingerprint*>& fingerprints, int num_shards)
+	{
+		FINDER_PROFILE(PROFILE_INDEX_INSERT);
+		auto index = std::make_shared<LibraryIndex>();
+		index->tracks.reserve(fingerprints.size());
+		for (const Fingerprint* fp: fingerprints)
+			index->tracks.push_back(fp->source->shared_from_this());
+
+		int shards = std::max(1, num_shards);
+		int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), fingerprints.size()));
+		index->shards.resize(shards);
+
+		// Step 1: per-thread tuple buffers
+		std::vector<std::vector<std::vector<Posting>>> buffers(threads, std::vector<std::vector<Posting>>(shards));
+		std::vector<int> thread_ids = Iota(threads);
+		std::for_each(std::execution::par, thread_ids.begin(), thread_ids.end(), [&](int t)
+		{
+			size_t first = fingerprints.size() * t / threads;
+			size_t last = fingerprints.size() * (t + 1) / threads;
+
+			std::vector<size_t> sizes(shards, 0);
+			for (size_t i = first; i < last; i++)
+				sizes[i % shards] += fingerprints[i]->hashes.size();
+			for (int s = 0; s < shards; s++)
+				buffers[t][s].reserve(sizes[s]);
+
+			for (size_t i = first; i < last; i++)
+			{
+				std::vector<Posting>& out = buffers[t][i % shards];
+				for (const auto& [hash, offset]: fingerprints[i]->hashes)
+					out.push_back({HashKey(hash), (int32) i, offset});
+			}
+		});
+
+		std::vector<int> shard_ids = Iota(shards);
+		std::for_each(std::execution::par, shard_ids.begin(), shard_ids.end(), [&](int s)
+		{
+			auto built = std::make_shared<HashIndex>();
+			HashIndex& shard = *built;
+
+			// Step 2: count, prefix-sum and scatter. The thread buffers go in one after the other, so a single cursor per
+			// bucket lays them out exactly as one cursor per buffer would, at a fraction of the memory.
+			std::vector<uint32> cursors(NUM_BUCKETS, 0);
+			for (int t = 0; t < threads; t++)
+			{
+				for (const Posting& p: buffers[t][s])
+					cursors[BucketOf(p.key)]++;
+			}
+
+			shard.buckets.assign(NUM_BUCKETS + 1, 0);
+			uint32 total = 0;
+			for (int b = 0; b < NUM_BUCKETS; b++)
+			{
+				shard.buckets[b] = total;
+				total += cursors[b];
+				cursors[b] = shard.buckets[b];
+			}
+			shard.buckets[NUM_BUCKETS] = total;
+
+			shard.postings.resize(total);
+			for (int t = 0; t < threads; t++)
+			{
+				for (const Posting& p: buffers[t][s])
+					shard.postings[cursors[BucketOf(p.key)]++] = p;
+				std::vector<Posting>().swap(buffers[t][s]); // Give the memory back as soon as we can
+			}
+
+			// Step 3: finish each bucket off
+			SortBuckets(shard);
+			index->shards[s] = built;
+		});
+
+		return index;
+	}
+
+	/*
+	 * Incremental version of BuildIndex for small changes (see LibraryWatcher). Added tracks go on the end of the track list,
+	 * removed ones become null slots, and only the shards either of those land in get rebuilt; every other shard is shared
+	 * with the previous index as is.
+	 */
+	std::shared_ptr<const LibraryIndex> UpdateIndex(const LibraryIndex& previous, const std::vector<SID>& added, const std::vector<SID>& removed)
+	{
+		FINDER_PROFILE(PROFILE_INDEX_INSERT);
+		auto index = std::make_shared<LibraryIndex>();
+		index->tracks = previous.tracks;
+		index->shards = previous.shards;
+		int shards = std::max<int>(1, index->shards.size());
+		index->shards.resize(shards);
+
+		std::vector<char> affected(shards, 0);
+		if (!removed.empty())
+		{
+			std::unordered_set<SID> gone(removed.begin(), removed.end());
+			for (size_t i = 0; i < index->tracks.size(); i++)
+			{
+				if (index->tracks[i] && gone.count(index->tracks[i].get()))
+				{
+					index->tracks[i] = nullptr;
+					affected[i % shards] = 1;
+				}
+			}
+		}
+		for (SID sid: added)
+		{
+			affected[index->tracks.size() % shards] = 1;
+			index->tracks.push_back(sid->shared_from_this());
+		}
+
+		std::vector<int> shard_ids;
+		for (int s = 0; s < shards; s++)
+		{
+			if (affected[s] || !index->shards[s])
+				shard_ids.push_back(s);
+		}
+		std::for_each(std::execution::par, shard_ids.begin(), shard_ids.end(), [&](int s)
+		{
+			index->shards[s] = BuildShard(index->tracks, s, shards);
+		});
+
+		return index;
+	}
+}
@@ -0,0 +1,95 @@
+#include "SampleFinder.h"
+
+namespace finder
+{
+	JobRunner::JobRunner()
+	{
+	}
+
+	JobRunner::~JobRunner()
+	{
+		// Nothing's going to be around to take the results
+		for (auto& [job, thread]: m_running)
+			job->cancelled = true;
+		for (auto& [job, thread]: m_running)
+			thread.join();
+	}
+
+	/*
+	 * Only ever called from the render thread, like Update
+	 */
+	std::shared_ptr<Job> JobRunner::Submit(const std::string& name, std::function<void(Job&)> work, std::function<void()> finish)
+	{
+		std::shared_ptr<Job> job = std::make_shared<Job>();
+		job->name = name;
+		job->progress = 0.0f;
+		job->cancelled = false;
+		job->done = false;
+		job->work = std::move(work);
+		job->finish = std::move(finish);
+
+		std::thread thread([job]()
+		{
+			job->work(*job);
+			job->progress = 1.0f;
+			job->done = true;
+			WakeUI();
+		});
+		m_running.emplace_back(job, std::move(thread));
+
+		return job;
+	}
+
+	/*
+	 * Hands finished jobs' results over, in the order they were submitted
+	 */
+	void JobRunner::Update()
+	{
+		std::vector<std::shared_ptr<Job>> finished;
+		for (auto it = m_running.begin(); it != m_running.end(); )
+		{
+			if (!it->first->done)
+			{
+				++it;
+				continue;
+			}
+
+			it->second.join();
+			finished.push_back(it->first);
+			it = m_running.erase(it);
+		}
+
+		// Finishing can submit more work, so only once we're done with the list
+		for (const std::shared_ptr<Job>& job: finished)
+		{
+			if (!job->cancelled && job->finish)
+				job->finish();
+		}
+	}
+
+	std::vector<std::shared_ptr<Job>> JobRunner::GetJobs() const
+	{
+		std::vector<std::shared_ptr<Job>> jobs;
+		for (const auto& [job, thread]: m_running)
+			jobs.push_back(job);
+		return jobs;
+	}
+
+	/*
+	 * The UI doesn't redraw while it's idle, so anything that moves a progress bar has to say so
+	 */
+	void Job::SetProgress(float value)
+	{
+		progress = value;
+		WakeUI();
+	}
+
+	void WakeUI()
+	{
+		// The event itself doesn't matter, only that the main loop stops waiting
+		SDL_Event e;
+		SDL_zero(e);
+		e.type = SDL_USEREVENT;
+		SDL_PushEvent(&e);
+	}
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
 #include <string>
@@ -38,6 +39,14 @@ namespace
 	int ups = 0;
 	int fps = 0;
 
+	constexpr int IDLE_WAKE_MS = 500; // Redraw now and then anyway, for whatever doesn't wake us (the library watcher...)
+	constexpr int SETTLE_FRAMES = 2; // ImGui needs a frame or two after input before hovers and layout stop changing
+
+	double Seconds(Uint64 from, Uint64 to)
+	{
+		return (double) (to - from) / (double) SDL_GetPerformanceFrequency();
+	}
+
 	template <typename T>
 	void InitErr(const std::string& msg, T lib_err)
 	{
@@ -172,6 +181,42 @@ namespace finder
 		settings.fs = 22050.0f;
 		settings.demote_songs = true;
 		settings.demotion_factor = 2.0f;
+		settings.stream_min_aligned = 20;
+		settings.stream_confidence_margin = 2.0f;
+	}
+
+	/*
+	 * Identifies the fingerprint settings, i.e. the ones that change what hashes come out of a track. Ranking and streaming
+	 * settings are left out on purpose, changing those doesn't invalidate anything.
+	 */
+	uint64 SettingsProfile(const Settings& settings)
+	{
+		const float values[] = {
+			(float) settings.default_fan_value,
+			(float) settings.min_hash_time_delta,
+			(float) settings.max_hash_time_delta,
+			(float) settings.fingerprint_reduction,
+			(float) settings.peak_neighborhood_size,
+			(float) settings.default_window_size,
+			settings.default_amp_min,
+			settings.default_overlap_ratio,
+			settings.fs
+		};
+
+		// FNV-1a over the raw values
+		uint64 h = 0xCBF29CE484222325ULL;
+		for (float value: values)
+		{
+			uint32 bits;
+			memcpy(&bits, &value, sizeof(bits));
+			for (int i = 0; i < 4; i++)
+			{
+				h ^= (bits >> (8 * i)) & 0xFF;
+				h *= 0x100000001B3ULL;
+			}
+		}
+
+		return h;
 	}
 
 	ErrCode LoadSettings(const std::string& path, Settings& settings)
@@ -197,6 +242,9 @@ namespace finder
 		settings.fs = json["fs"];
 		settings.demote_songs = json["demote_songs"];
 		settings.demotion_factor = json["demotion_factor"];
+		// Newer settings might be missing from older files
+		settings.stream_min_aligned = json.value("stream_min_aligned", 20);
+		settings.stream_confidence_margin = json.value("stream_confidence_margin", 2.0f);
 
 		return SUCCESS;
 	}
@@ -217,6 +265,8 @@ namespace finder
 		json["fs"] = settings.fs;
 		json["demote_songs"] = settings.demote_songs;
 		json["demotion_factor"] = settings.demotion_factor;
+		json["stream_min_aligned"] = settings.stream_min_aligned;
+		json["stream_confidence_margin"] = settings.stream_confidence_margin;
 
 		json_str = json.dump();
 
@@ -229,6 +279,10 @@ namespace finder
 
 int main(int argc, char* argv[])
 {
+	// Anything passed on the command line means we're running headless
+	if (argc > 1)
+		return finder::RunCommand(argc, argv);
+
 	// Set up SDL
 	std::cout << "Initializing SDL..." << std::endl;
 	if (SDL_Init(SDL_INIT_EVERYTHING))
@@ -303,10 +357,25 @@ int main(int argc, char* argv[])
 
 		float frame_time = 1.0f / 60.0f;
 
+		finder::LoopStats stats = {};
+		int settle_frames = SETTLE_FRAMES;
+
 		while (running)
 		{
+			// Block until there's input, a job wakes us or playback needs the playhead moving, instead of redrawing the
+			// same frame at vsync rate
+			bool waited = false;
+			if (settle_frames <= 0 && ui.IsIdle())
+			{
+				Uint64 wait_start = SDL_GetPerformanceCounter();
+				SDL_WaitEventTimeout(nullptr, IDLE_WAKE_MS);
+				stats.idle += Seconds(wait_start, SDL_GetPerformanceCounter());
+				waited = true;
+			}
+
 			for (SDL_Event e; SDL_PollEvent(&e); )
 			{
+				settle_frames = SETTLE_FRAMES;
 				ImGui_ImplSDL2_ProcessEvent(&e);
 
 				switch (e.type)
@@ -318,6 +387,7 @@ int main(int argc, char* argv[])
 				}
 			}
 
+			Uint64 frame_start = SDL_GetPerformanceCounter();
 			ImGui_ImplOpenGL3_NewFrame();
 			ImGui_ImplSDL2_NewFrame(window);
 			ImGui::NewFrame();
@@ -327,8 +397,9 @@ int main(int argc, char* argv[])
 			if (previous == -1)
 				previous = now;
 
+			// Time spent idle isn't time to catch up on
 			double delta = now - previous;
-			if (delta >= 1.0)
+			if (delta >= 1.0 || waited)
 				delta = frame_time;
 
 			lag += delta;
@@ -346,14 +417,22 @@ int main(int argc, char* argv[])
 			Render(ui);
 			ImGui::Render();
 			ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+			stats.render += Seconds(frame_start, SDL_GetPerformanceCounter());
 
 			SDL_GL_SwapWindow(window);
+			settle_frames--;
 
 			if (now - last_stats_time >= 1.0)
 			{
 				ups = updates;
 				fps = frames;
 
+				stats.frames = frames;
+				stats.idle_total += stats.idle;
+				stats.render_total += stats.render;
+				ui.SetLoopStats(stats);
+				stats.idle = stats.render = 0.0;
+
 				updates = frames = 0;
 				last_stats_time = now;
 			}
@@ -0,0 +1,142 @@
+#include "SampleFinder.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+namespace
+{
+	float SortKey(const finder::FoundSong& match, finder::MatchSort sort)
+	{
+		switch (sort)
+		{
+		case finder::SORT_CONFIDENCE:
+			return match.overall_confidence;
+		case finder::SORT_OFFSET:
+			return match.offset_secs;
+		case finder::SORT_HASHES:
+			return (float) match.hashes_matched;
+		default:
+			return 0.0f;
+		}
+	}
+}
+
+namespace finder
+{
+	MatchList::MatchList():
+		m_sort(SORT_RANK),
+		m_descending(false),
+		m_min_confidence(0.0f)
+	{
+	}
+
+	void MatchList::Assign(std::vector<FoundSong>&& matches)
+	{
+		m_matches = std::move(matches);
+		for (std::vector<int>& order: m_orders)
+			order.clear();
+		Refresh();
+	}
+
+	void MatchList::Clear()
+	{
+		Assign({});
+	}
+
+	void MatchList::SetOrder(MatchSort sort, bool descending)
+	{
+		if (sort == m_sort && descending == m_descending)
+			return;
+
+		m_sort = sort;
+		m_descending = descending;
+		Refresh();
+	}
+
+	void MatchList::SetMinConfidence(float confidence)
+	{
+		if (confidence == m_min_confidence)
+			return;
+
+		m_min_confidence = confidence;
+		Refresh();
+	}
+
+	float MatchList::GetMinConfidence() const
+	{
+		return m_min_confidence;
+	}
+
+	size_t MatchList::GetCount() const
+	{
+		return m_rows.size();
+	}
+
+	size_t MatchList::GetTotal() const
+	{
+		return m_matches.size();
+	}
+
+	const FoundSong& MatchList::Get(size_t row) const
+	{
+		return m_matches[m_rows[row]];
+	}
+
+	int MatchList::GetRank(size_t row) const
+	{
+		return m_rows[row] + 1;
+	}
+
+	//
+
+	/*
+	 * Ties keep their rank order, so flipping the direction only flips what actually differs
+	 */
+	const std::vector<int>& MatchList::GetOrder(MatchSort sort)
+	{
+		std::vector<int>& order = m_orders[sort];
+		if (order.size() == m_matches.size())
+			return order;
+
+		order.resize(m_matches.size());
+		std::iota(order.begin(), order.end(), 0);
+		if (sort != SORT_RANK)
+		{
+			std::stable_sort(order.begin(), order.end(), [this, sort](int a, int b)
+			{
+				return SortKey(m_matches[a], sort) < SortKey(m_matches[b], sort);
+			});
+		}
+
+		return order;
+	}
+
+	void MatchList::Refresh()
+	{
+		const std::vector<int>& order = GetOrder(m_sort);
+
+		m_rows.clear();
+		m_rows.reserve(order.size());
+		for (int i: order)
+		{
+			if (m_matches[i].sid && m_matches[i].overall_confidence >= m_min_confidence)
+				m_rows.push_back(i);
+		}
+
+		if (m_descending)
+		{
+			// Reversing the whole thing would also reverse ties out of rank order, so reverse those first to cancel out
+			for (auto first = m_rows.begin(); m_sort != SORT_RANK && first != m_rows.end(); )
+			{
+				auto last = std::find_if(first, m_rows.end(), [&](int i)
+				{
+					return SortKey(m_matches[i], m_sort) != SortKey(m_matches[*first], m_sort);
+				});
+				std::reverse(first, last);
+				first = last;
+			}
+			std::reverse(m_rows.begin(), m_rows.end());
+		}
+	}
+}
@@ -0,0 +1,179 @@
+#include "SampleFinder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+namespace finder
+{
+	PcmPlayer::PcmPlayer():
+		m_format(AUDIO_S16SYS),
+		m_rate(0),
+		m_frame_bytes(0),
+		m_position(0),
+		m_playing(false),
+		m_looping(false),
+		m_volume(SDL_MIX_MAXVOLUME)
+	{
+	}
+
+	PcmPlayer::~PcmPlayer()
+	{
+		Stop();
+	}
+
+	/*
+	 * Takes interleaved 16-bit audio at the file's own rate and channel count and converts it to whatever the mixer was
+	 * opened with
+	 */
+	ErrCode PcmPlayer::Open(const int16* interleaved, size_t frames, int channels, int rate)
+	{
+		Stop();
+		m_buffer.clear();
+
+		int device_rate = 0;
+		Uint16 device_format = 0;
+		int device_channels = 0;
+		if (!Mix_QuerySpec(&device_rate, &device_format, &device_channels))
+		{
+			std::cerr << "Can't play audio, the mixer isn't open: " << Mix_GetError() << std::endl;
+			return FAILURE;
+		}
+
+		SDL_AudioCVT cvt;
+		if (SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, channels, rate, device_format, device_channels, device_rate) < 0)
+		{
+			std::cerr << "Can't convert " << channels << " channel " << rate << " Hz audio for playback: " << SDL_GetError() << std::endl;
+			return FAILURE;
+		}
+
+		// Conversion happens in place, in a buffer big enough for the intermediate stages
+		cvt.len = frames * channels * sizeof(int16);
+		m_buffer.resize((size_t) cvt.len * cvt.len_mult);
+		memcpy(m_buffer.data(), interleaved, cvt.len);
+		if (cvt.needed)
+		{
+			cvt.buf = m_buffer.data();
+			if (SDL_ConvertAudio(&cvt) < 0)
+			{
+				std::cerr << "Failed to convert audio for playback: " << SDL_GetError() << std::endl;
+				m_buffer.clear();
+				return FAILURE;
+			}
+			m_buffer.resize(cvt.len_cvt);
+		}
+		else
+		{
+			m_buffer.resize(cvt.len);
+		}
+		m_buffer.shrink_to_fit();
+
+		m_format = device_format;
+		m_rate = device_rate;
+		m_frame_bytes = SDL_AUDIO_BITSIZE(device_format) / 8 * device_channels;
+		m_position = 0;
+
+		return SUCCESS;
+	}
+
+	void PcmPlayer::Play(bool loop)
+	{
+		if (m_buffer.empty())
+			return;
+
+		// Picking up where we left off, unless that was the end
+		if (m_position >= m_buffer.size())
+			m_position = 0;
+		m_looping = loop;
+		m_playing = true;
+
+		// There's only one music hook, so this takes over from whatever else was playing
+		if (Mix_GetMusicHookData() != this)
+			Mix_HookMusic(&PcmPlayer::Mix, this);
+	}
+
+	void PcmPlayer::Pause()
+	{
+		m_playing = false;
+	}
+
+	void PcmPlayer::Stop()
+	{
+		m_playing = false;
+		m_position = 0;
+
+		// Mix_HookMusic waits for the mixer, so once it returns we're guaranteed not to be called with a dead buffer
+		if (Mix_GetMusicHookData() == this)
+			Mix_HookMusic(nullptr, nullptr);
+	}
+
+	void PcmPlayer::Seek(double seconds)
+	{
+		if (m_buffer.empty())
+			return;
+
+		size_t frame = std::max(0.0, seconds) * m_rate;
+		m_position = std::min(frame * m_frame_bytes, m_buffer.size());
+	}
+
+	void PcmPlayer::SetVolume(float volume)
+	{
+		m_volume = std::clamp((int) (volume * SDL_MIX_MAXVOLUME), 0, (int) SDL_MIX_MAXVOLUME);
+	}
+
+	bool PcmPlayer::IsPlaying() const
+	{
+		return m_playing && Mix_GetMusicHookData() == this;
+	}
+
+	double PcmPlayer::GetPosition() const
+	{
+		if (!m_rate)
+			return 0.0;
+		return (double) (m_position / m_frame_bytes) / m_rate;
+	}
+
+	double PcmPlayer::GetDuration() const
+	{
+		if (!m_rate)
+			return 0.0;
+		return (double) (m_buffer.size() / m_frame_bytes) / m_rate;
+	}
+
+	/*
+	 * Runs on the audio thread. SDL_mixer has already silenced the stream, we just mix ourselves in at our volume.
+	 */
+	void PcmPlayer::Mix(void* udata, Uint8* stream, int len)
+	{
+		PcmPlayer* player = static_cast<PcmPlayer*>(udata);
+		if (!player->m_playing)
+			return;
+
+		size_t start = player->m_position;
+		size_t position = start;
+		size_t size = player->m_buffer.size();
+		int volume = player->m_volume;
+		while (len > 0)
+		{
+			if (position >= size)
+			{
+				if (!player->m_looping)
+				{
+					player->m_playing = false;
+					break;
+				}
+				position = 0;
+			}
+
+			size_t n = std::min<size_t>(len, size - position);
+			SDL_MixAudioFormat(stream, player->m_buffer.data() + position, player->m_format, n, volume);
+			stream += n;
+			len -= n;
+			position += n;
+		}
+
+		// If the UI seeked while we were mixing, its position wins
+		player->m_position.compare_exchange_strong(start, position);
+	}
+}
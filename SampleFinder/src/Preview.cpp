@@ -0,0 +1,202 @@
+#include "SampleFinder.h"
+
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sndfile.h>
+
+namespace
+{
+	constexpr size_t PREVIEW_CACHE_SIZE = 32; // Snippets, so a few rounds of top 10 matches
+	constexpr sf_count_t SKIP_FRAMES = 4096;
+
+	std::string SnippetKey(const std::string& path, double start, double duration)
+	{
+		// Millisecond resolution is plenty to tell previews apart
+		return path + "@" + std::to_string(llround(start * 1000.0)) + "+" + std::to_string(llround(duration * 1000.0));
+	}
+
+	/*
+	 * Reads [start, start + duration) seconds of the file. Files sndfile can seek in (WAV, FLAC, MP3 through mpg123's seek
+	 * index...) jump straight there; anything else is read through up to the start.
+	 */
+	finder::ErrCode DecodeRange(const std::string& path, double start, double duration, finder::Snippet& out)
+	{
+		SF_INFO sfinfo;
+		memset(&sfinfo, 0, sizeof(sfinfo));
+		SNDFILE* sf_in = sf_open(path.c_str(), SFM_READ, &sfinfo);
+		if (!sf_in)
+		{
+			std::cerr << "Failed to open audio file for preview: " << sf_strerror(sf_in) << std::endl;
+			return finder::FAILURE;
+		}
+
+		sf_count_t first = std::clamp<sf_count_t>(start * sfinfo.samplerate, 0, sfinfo.frames);
+		sf_count_t n_frames = std::clamp<sf_count_t>(duration * sfinfo.samplerate, 0, sfinfo.frames - first);
+
+		out.channels = sfinfo.channels;
+		out.rate = sfinfo.samplerate;
+		out.pcm.resize(n_frames * sfinfo.channels);
+
+		if (sfinfo.seekable)
+		{
+			if (sf_seek(sf_in, first, SEEK_SET) < 0)
+			{
+				std::cerr << "Failed to seek in " << path << ": " << sf_strerror(sf_in) << std::endl;
+				sf_close(sf_in);
+				return finder::FAILURE;
+			}
+		}
+		else
+		{
+			std::vector<short> skipped(SKIP_FRAMES * sfinfo.channels);
+			for (sf_count_t left = first; left > 0; )
+			{
+				sf_count_t n_read = sf_readf_short(sf_in, skipped.data(), std::min(left, SKIP_FRAMES));
+				if (n_read <= 0)
+					break;
+				left -= n_read;
+			}
+		}
+
+		sf_count_t n_read = sf_readf_short(sf_in, out.pcm.data(), n_frames);
+		sf_close(sf_in);
+		out.pcm.resize(std::max<sf_count_t>(n_read, 0) * out.channels);
+
+		return finder::SUCCESS;
+	}
+}
+
+namespace finder
+{
+	PreviewService::PreviewService():
+		m_running(true)
+	{
+		m_worker = std::thread(&PreviewService::WorkerLoop, this);
+	}
+
+	PreviewService::~PreviewService()
+	{
+		{
+			std::unique_lock<std::mutex> lck(m_queue_mutex);
+			m_running = false;
+		}
+		m_queue_cv.notify_all();
+		m_worker.join();
+	}
+
+	/*
+	 * Decodes right away if it isn't cached yet
+	 */
+	std::shared_ptr<const Snippet> PreviewService::Get(const std::string& path, double start, double duration)
+	{
+		std::string key = SnippetKey(path, start, duration);
+		if (std::shared_ptr<const Snippet> snippet = Find(key))
+			return snippet;
+
+		std::shared_ptr<Snippet> snippet = std::make_shared<Snippet>();
+		if (DecodeRange(path, start, duration, *snippet) != SUCCESS)
+			return nullptr;
+		Insert(key, snippet);
+
+		return snippet;
+	}
+
+	/*
+	 * Queues snippets to decode in the background, replacing whatever was queued before (those were for older matches)
+	 */
+	void PreviewService::Prefetch(const std::vector<std::pair<std::string, double>>& starts, double duration)
+	{
+		std::unique_lock<std::mutex> lck(m_queue_mutex);
+		m_queue.clear();
+		for (const auto& [path, start]: starts)
+			m_queue.emplace_back(path, start, duration);
+		m_queue_cv.notify_one();
+	}
+
+	void PreviewService::Play(const std::string& path, double start, double duration)
+	{
+		std::shared_ptr<const Snippet> snippet = Get(path, start, duration);
+		if (!snippet || snippet->pcm.empty())
+			return;
+
+		if (m_player.Open(snippet->pcm.data(), snippet->pcm.size() / snippet->channels, snippet->channels, snippet->rate) != SUCCESS)
+			return;
+		m_player.Play();
+		m_playing = SnippetKey(path, start, duration);
+	}
+
+	void PreviewService::Stop()
+	{
+		m_player.Stop();
+		m_playing.clear();
+	}
+
+	bool PreviewService::IsPlaying(const std::string& path, double start, double duration) const
+	{
+		return m_player.IsPlaying() && m_playing == SnippetKey(path, start, duration);
+	}
+
+	bool PreviewService::IsPlaying() const
+	{
+		return m_player.IsPlaying();
+	}
+
+	//
+
+	std::shared_ptr<const Snippet> PreviewService::Find(const std::string& key)
+	{
+		std::unique_lock<std::mutex> lck(m_cache_mutex);
+		auto it = m_cache.find(key);
+		if (it == m_cache.end())
+			return nullptr;
+
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return it->second->second;
+	}
+
+	void PreviewService::Insert(const std::string& key, const std::shared_ptr<const Snippet>& snippet)
+	{
+		std::unique_lock<std::mutex> lck(m_cache_mutex);
+		auto it = m_cache.find(key);
+		if (it != m_cache.end())
+		{
+			// Someone beat us to it; either copy is fine
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+			return;
+		}
+
+		m_lru.emplace_front(key, snippet);
+		m_cache[key] = m_lru.begin();
+		while (m_lru.size() > PREVIEW_CACHE_SIZE)
+		{
+			m_cache.erase(m_lru.back().first);
+			m_lru.pop_back();
+		}
+	}
+
+	void PreviewService::WorkerLoop()
+	{
+		while (true)
+		{
+			std::string path;
+			double start;
+			double duration;
+			{
+				std::unique_lock<std::mutex> lck(m_queue_mutex);
+				m_queue_cv.wait(lck, [this]() { return !m_queue.empty() || !m_running; });
+				if (!m_running)
+					return;
+				std::tie(path, start, duration) = m_queue.front();
+				m_queue.pop_front();
+			}
+
+			Get(path, start, duration);
+		}
+	}
+}
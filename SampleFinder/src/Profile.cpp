@@ -0,0 +1,263 @@
+#include "SampleFinder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace
+{
+	constexpr size_t MAX_EVENTS_PER_THREAD = 1 << 20; // Past this only the totals keep counting
+
+	const char* STAGE_NAMES[finder::PROFILE_STAGE_COUNT] = {
+		"Decode",
+		"Framing",
+		"FFT",
+		"Log/scale",
+		"Peaks",
+		"Hashing",
+		"Index insert",
+		"Cache I/O",
+		"FindMatches",
+		"AlignMatches"
+	};
+
+	struct ProfileEvent
+	{
+		finder::uint64 start;
+		finder::uint64 duration;
+		finder::int32 track;
+		finder::ProfileStage stage;
+	};
+
+	struct StageTotals
+	{
+		finder::uint64 calls[finder::PROFILE_STAGE_COUNT];
+		finder::uint64 ns[finder::PROFILE_STAGE_COUNT];
+	};
+
+	/*
+	 * Only its own thread writes to one of these, so the mutex is only ever contended while someone's reading
+	 */
+	struct ThreadProfile
+	{
+		int id;
+		int track = -1;
+		std::mutex mutex;
+		StageTotals totals = {};
+		std::unordered_map<int, StageTotals> tracks;
+		std::vector<ProfileEvent> events;
+	};
+
+	// Threads' profiles outlive them, whatever they timed is still wanted afterwards
+	std::mutex registry_mutex;
+	std::vector<std::shared_ptr<ThreadProfile>> thread_profiles;
+	std::vector<std::string> track_names;
+	std::unordered_map<std::string, int> track_ids;
+	const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+	ThreadProfile& GetThreadProfile()
+	{
+		thread_local std::shared_ptr<ThreadProfile> profile;
+		if (!profile)
+		{
+			profile = std::make_shared<ThreadProfile>();
+			std::unique_lock<std::mutex> lck(registry_mutex);
+			profile->id = thread_profiles.size();
+			thread_profiles.push_back(profile);
+		}
+		return *profile;
+	}
+
+	finder::uint64 Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	void AddTotals(finder::ProfileRow& row, const StageTotals& totals)
+	{
+		for (int s = 0; s < finder::PROFILE_STAGE_COUNT; s++)
+		{
+			row.calls[s] += totals.calls[s];
+			row.ns[s] += totals.ns[s];
+			row.total_ns += totals.ns[s];
+		}
+	}
+
+	finder::ProfileRow EmptyRow(const std::string& name)
+	{
+		finder::ProfileRow row = {};
+		row.name = name;
+		return row;
+	}
+}
+
+namespace finder
+{
+	ProfileScope::ProfileScope(ProfileStage stage):
+		m_stage(stage),
+		m_start(Now())
+	{
+	}
+
+	ProfileScope::~ProfileScope()
+	{
+		uint64 duration = Now() - m_start;
+		ThreadProfile& profile = GetThreadProfile();
+
+		std::unique_lock<std::mutex> lck(profile.mutex);
+		profile.totals.calls[m_stage]++;
+		profile.totals.ns[m_stage] += duration;
+		if (profile.track >= 0)
+		{
+			StageTotals& track = profile.tracks[profile.track];
+			track.calls[m_stage]++;
+			track.ns[m_stage] += duration;
+		}
+		if (profile.events.size() < MAX_EVENTS_PER_THREAD)
+			profile.events.push_back({ m_start, duration, profile.track, m_stage });
+	}
+
+	ProfileTrack::ProfileTrack(const std::string& path)
+	{
+		int id;
+		{
+			std::unique_lock<std::mutex> lck(registry_mutex);
+			auto [it, inserted] = track_ids.emplace(path, track_names.size());
+			if (inserted)
+				track_names.push_back(path);
+			id = it->second;
+		}
+
+		ThreadProfile& profile = GetThreadProfile();
+		std::unique_lock<std::mutex> lck(profile.mutex);
+		m_previous = profile.track;
+		profile.track = id;
+	}
+
+	ProfileTrack::~ProfileTrack()
+	{
+		ThreadProfile& profile = GetThreadProfile();
+		std::unique_lock<std::mutex> lck(profile.mutex);
+		profile.track = m_previous;
+	}
+
+	const char* ProfileStageName(ProfileStage stage)
+	{
+		return STAGE_NAMES[stage];
+	}
+
+	void SummarizeProfile(ProfileSummary& out)
+	{
+		out.total = EmptyRow("Total");
+		out.threads.clear();
+		out.tracks.clear();
+
+		std::unique_lock<std::mutex> registry(registry_mutex);
+		std::vector<ProfileRow> tracks(track_names.size());
+		for (size_t i = 0; i < tracks.size(); i++)
+			tracks[i] = EmptyRow(track_names[i]);
+
+		for (const std::shared_ptr<ThreadProfile>& profile: thread_profiles)
+		{
+			std::unique_lock<std::mutex> lck(profile->mutex);
+			ProfileRow row = EmptyRow("Thread " + std::to_string(profile->id));
+			AddTotals(row, profile->totals);
+			if (row.total_ns == 0)
+				continue;
+
+			AddTotals(out.total, profile->totals);
+			out.threads.push_back(std::move(row));
+			for (const auto& [track, totals]: profile->tracks)
+				AddTotals(tracks[track], totals);
+		}
+
+		for (ProfileRow& track: tracks)
+		{
+			if (track.total_ns > 0)
+				out.tracks.push_back(std::move(track));
+		}
+		std::sort(out.tracks.begin(), out.tracks.end(), [](const ProfileRow& a, const ProfileRow& b)
+		{
+			return a.total_ns > b.total_ns;
+		});
+	}
+
+	/*
+	 * Track names are kept, scopes that are still open refer to them
+	 */
+	void ResetProfile()
+	{
+		std::unique_lock<std::mutex> registry(registry_mutex);
+		for (const std::shared_ptr<ThreadProfile>& profile: thread_profiles)
+		{
+			std::unique_lock<std::mutex> lck(profile->mutex);
+			profile->totals = {};
+			profile->tracks.clear();
+			profile->events.clear();
+		}
+	}
+
+	/*
+	 * Complete ("X") events in the Trace Event Format, which chrome://tracing and Perfetto both open. One row per thread,
+	 * each event tagged with the track it was for.
+	 */
+	ErrCode ExportChromeTrace(const std::string& path)
+	{
+		std::ofstream out(path, std::ios::binary);
+		if (!out)
+		{
+			std::cerr << "Failed to open " << path << " for writing" << std::endl;
+			return FAILURE;
+		}
+
+		std::unique_lock<std::mutex> registry(registry_mutex);
+		std::vector<std::string> quoted_tracks(track_names.size());
+		for (size_t i = 0; i < track_names.size(); i++)
+			quoted_tracks[i] = nlohmann::json(std::filesystem::path(track_names[i]).filename().string()).dump();
+
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		bool first = true;
+		char buffer[256];
+		for (const std::shared_ptr<ThreadProfile>& profile: thread_profiles)
+		{
+			std::unique_lock<std::mutex> lck(profile->mutex);
+			if (profile->events.empty())
+				continue;
+
+			snprintf(buffer, sizeof(buffer), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}",
+				first ? "" : ",\n", profile->id, profile->id);
+			out << buffer;
+			first = false;
+
+			for (const ProfileEvent& event: profile->events)
+			{
+				// Microseconds, with the nanoseconds kept as decimals
+				snprintf(buffer, sizeof(buffer), ",\n{\"name\":\"%s\",\"cat\":\"finder\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+					STAGE_NAMES[event.stage], profile->id,
+					(unsigned long long) (event.start / 1000), (unsigned long long) (event.start % 1000),
+					(unsigned long long) (event.duration / 1000), (unsigned long long) (event.duration % 1000));
+				out << buffer;
+				if (event.track >= 0)
+					out << ",\"args\":{\"track\":" << quoted_tracks[event.track] << "}";
+				out << "}";
+			}
+		}
+		out << "\n]}\n";
+
+		if (!out)
+		{
+			std::cerr << "Failed to write trace to " << path << std::endl;
+			return FAILURE;
+		}
+		return SUCCESS;
+	}
+}
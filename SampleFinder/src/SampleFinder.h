@@ -6,6 +6,13 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <tuple>
+#include <unordered_map>
 #include <fstream>
 #include <iostream>
 
@@ -26,6 +33,11 @@
 	#pragma warning(disable: 4996) // Secure function warnings
 #endif
 
+namespace cv
+{
+	class Mat;
+}
+
 namespace finder
 {
 	using uint8  = unsigned char;
@@ -47,6 +59,83 @@ namespace finder
 		FAILURE
 	};
 
+	/****************************************************************/
+	/* Profiling                                                    */
+	/****************************************************************/
+	/*
+	 * Scoped timers around the expensive stages of analysis and search. Totals are kept per thread and per track, and the
+	 * first million or so timings on each thread are kept as events for ExportChromeTrace. Build with
+	 * FINDER_DISABLE_PROFILING defined and the macros below expand to nothing.
+	 */
+	enum ProfileStage
+	{
+		PROFILE_DECODE,
+		PROFILE_FRAMING,
+		PROFILE_FFT,
+		PROFILE_LOG_SCALE,
+		PROFILE_PEAKS,
+		PROFILE_HASHING,
+		PROFILE_INDEX_INSERT,
+		PROFILE_CACHE_IO,
+		PROFILE_FIND_MATCHES,
+		PROFILE_ALIGN_MATCHES,
+		PROFILE_STAGE_COUNT
+	};
+
+	struct ProfileRow
+	{
+		std::string name; // Of the thread or track
+		uint64 calls[PROFILE_STAGE_COUNT];
+		uint64 ns[PROFILE_STAGE_COUNT];
+		uint64 total_ns;
+	};
+
+	struct ProfileSummary
+	{
+		ProfileRow total;
+		std::vector<ProfileRow> threads;
+		std::vector<ProfileRow> tracks; // Slowest first
+	};
+
+	class ProfileScope
+	{
+	public:
+		ProfileScope(ProfileStage stage);
+		~ProfileScope();
+
+	private:
+		ProfileStage m_stage;
+		uint64 m_start;
+
+	};
+
+	// Charges whatever's timed on this thread to a track, until it goes out of scope
+	class ProfileTrack
+	{
+	public:
+		ProfileTrack(const std::string& path);
+		~ProfileTrack();
+
+	private:
+		int m_previous;
+
+	};
+
+	extern const char* ProfileStageName(ProfileStage stage);
+	extern void SummarizeProfile(ProfileSummary& out);
+	extern void ResetProfile();
+	extern ErrCode ExportChromeTrace(const std::string& path);
+
+#define FINDER_CONCAT_INNER(a, b) a##b
+#define FINDER_CONCAT(a, b) FINDER_CONCAT_INNER(a, b)
+#ifndef FINDER_DISABLE_PROFILING
+	#define FINDER_PROFILE(stage) finder::ProfileScope FINDER_CONCAT(profile_scope_, __LINE__)(stage)
+	#define FINDER_PROFILE_TRACK(path) finder::ProfileTrack FINDER_CONCAT(profile_track_, __LINE__)(path)
+#else
+	#define FINDER_PROFILE(stage)
+	#define FINDER_PROFILE_TRACK(path)
+#endif
+
 	/****************************************************************/
 	/* Graphics utilities                                           */
 	/****************************************************************/
@@ -99,10 +188,45 @@ namespace finder
 
 	};
 
+	/****************************************************************/
+	/* Algorithm config                                           */
+	/****************************************************************/
+	struct Settings
+	{
+		// Fingerprint algorithm settings
+		int default_fan_value;
+		int min_hash_time_delta;
+		int max_hash_time_delta;
+		int fingerprint_reduction;
+		int peak_neighborhood_size;
+		int default_window_size;
+		float default_amp_min;
+		float default_overlap_ratio;
+		float fs;
+
+		// Ranking algorithm settings
+		bool demote_songs;
+		float demotion_factor;
+
+		// Streaming recognition settings
+		int stream_min_aligned;
+		float stream_confidence_margin;
+	};
+
+	extern Settings settings;
+
+	extern void LoadDefaults(Settings& settings);
+	extern uint64 SettingsProfile(const Settings& settings);
+
+	extern ErrCode LoadSettings(const std::string& path, Settings& settings);
+	extern ErrCode SaveSettings(const std::string& path, const Settings& settings);
+
 	/****************************************************************/
 	/* Audio processing                                             */
 	/****************************************************************/
 	class AudioFile;
+	class AudioLibrary;
+	class LibraryWatcher;
 
 	using SID = AudioFile*; // Don't want this to always be the case
 
@@ -118,12 +242,7 @@ namespace finder
 		std::unordered_map<SID, int> dedups;
 	};
 
-	struct FoundMatch
-	{
-		std::string hash;
-		SID sid;
-		int offset;
-	};
+	using QueryHashes = boost::unordered_map<uint64, std::vector<int>>;
 
 	struct FoundSong
 	{
@@ -138,31 +257,237 @@ namespace finder
 		float offset_secs;
 	};
 
-	class AudioFile
+	// One (hash, track, offset) tuple. Tracks are indices into LibraryIndex::tracks.
+	struct Posting
+	{
+		uint64 key;
+		int32 track;
+		int32 offset;
+	};
+
+	// Contiguous postings sorted by key, with a directory of where each radix bucket starts
+	class HashIndex
+	{
+	public:
+		std::pair<const Posting*, const Posting*> Find(uint64 key) const;
+		size_t Size() const;
+
+	public:
+		std::vector<Posting> postings;
+		std::vector<uint32> buckets;
+
+	};
+
+	// Immutable once built, so queries can hold on to one while the library builds the next. Shards that didn't change are
+	// shared between successive indexes. Tracks removed since the last full build are left as null slots. The index owns
+	// its tracks, so SIDs found through it stay good for as long as it's around, whatever the library has done since.
+	struct LibraryIndex
+	{
+		std::vector<std::shared_ptr<AudioFile>> tracks;
+		std::vector<std::shared_ptr<const HashIndex>> shards;
+	};
+
+	extern uint64 HashKey(const std::string& hash);
+	extern std::shared_ptr<const LibraryIndex> BuildIndex(const std::vector<Fingerprint*>& fingerprints, int num_shards);
+	extern std::shared_ptr<const LibraryIndex> UpdateIndex(const LibraryIndex& previous, const std::vector<SID>& added, const std::vector<SID>& removed);
+
+	// Fingerprinting stages, in the order AudioFile::Process runs them. They're exposed so audio that isn't fully loaded up
+	// front (see StreamRecognizer) can be pushed through the exact same pipeline, and so the bench command can time them.
+	extern std::vector<std::vector<float>> StrideWindows(const std::vector<float>& data, size_t blocksize, size_t overlap);
+	extern void ComputeSpectrogram(const std::vector<float>& samples, cv::Mat& out);
+	extern void Get2DPeaks(const cv::Mat& data, std::vector<std::pair<int, int>>& out);
+	extern void GenerateHashes(std::vector<std::pair<int, int>>& v_in, boost::unordered_map<std::string, int>& out);
+	extern std::string HashPeakPair(int freq1, int freq2, int t_delta);
+
+	// Deterministic test audio for benchmarks, at the same 16-bit scale AudioFile::Load leaves samples in
+	enum SignalKind
+	{
+		SIGNAL_SWEEP,
+		SIGNAL_NOISE,
+		SIGNAL_CHORDS,
+		SIGNAL_KIND_COUNT
+	};
+
+	extern const char* SignalKindName(SignalKind kind);
+	extern void SynthesizeSignal(SignalKind kind, uint64 seed, float seconds, float rate, std::vector<float>& out);
+
+	// Summary of a run of samples
+	struct WaveformBin
+	{
+		float min;
+		float max;
+		float rms;
+	};
+
+	/*
+	 * Min/max/sum of squares of a signal at several resolutions. The finest level summarizes WAVEFORM_BASE_BIN samples
+	 * per bin and every level above halves the number of bins, so any stretch of the signal can be drawn by looking at
+	 * about one bin per pixel.
+	 */
+	class WaveformPyramid
+	{
+	public:
+		WaveformPyramid();
+
+		void Build(const std::vector<float>& samples);
+		void Clear();
+		void Summarize(const std::vector<float>& samples, size_t first, size_t last, int columns, std::vector<WaveformBin>& out) const;
+		float GetPeak() const;
+		bool IsEmpty() const;
+
+	private:
+		struct Bin
+		{
+			float min;
+			float max;
+			float sum_sq;
+		};
+
+		std::vector<std::vector<Bin>> m_levels;
+		size_t m_samples;
+		float m_peak;
+
+	};
+
+	/*
+	 * Log-magnitude spectrogram at several resolutions, quantized to a byte per cell (0 to 80 dB) and stored highest
+	 * frequency first, the way it's drawn. Each level halves both dimensions of the one below, keeping the loudest of each
+	 * 2x2 block so peaks don't fade out when zoomed out.
+	 */
+	class SpectrogramPyramid
+	{
+	public:
+		SpectrogramPyramid();
+
+		void Build(const cv::Mat& spectrogram);
+		void Clear();
+
+		int GetLevels() const;
+		int GetWidth(int level) const;
+		int GetHeight(int level) const;
+		const uint8* GetRow(int level, int row) const;
+		uint64 GetGeneration() const;
+
+	private:
+		struct Level
+		{
+			int width;
+			int height;
+			std::vector<uint8> cells;
+		};
+
+		std::vector<Level> m_levels;
+		uint64 m_generation; // Different for every build, so views can tell their tiles are stale
+
+	};
+
+	/*
+	 * Draws a SpectrogramPyramid in tiles, from whichever level matches the zoom. Tiles are colorized and uploaded only
+	 * once they come into view, a few per frame through a pixel buffer object, into a pool of textures sized from the
+	 * view that get recycled least recently used first. Until a tile arrives, a coarser one that's already there stands in for it.
+	 */
+	class SpectrogramView
+	{
+	public:
+		SpectrogramView();
+		~SpectrogramView();
+
+		SpectrogramView(const SpectrogramView&) = delete;
+		SpectrogramView& operator=(const SpectrogramView&) = delete;
+
+		void Draw(const SpectrogramPyramid& pyramid, float x0, float y0, float x1, float y1, float from, float to);
+
+	private:
+		struct Tile
+		{
+			uint64 key;
+			GLuint texture;
+			uint64 last_used;
+		};
+
+		const Tile* Acquire(const SpectrogramPyramid& pyramid, int level, int tx, int ty, int& uploads_left);
+		void Upload(const SpectrogramPyramid& pyramid, int level, int tx, int ty, GLuint texture);
+
+	private:
+		std::vector<Tile> m_tiles;
+		std::unordered_map<uint64, size_t> m_resident;
+		size_t m_capacity; // How many tiles the pool may grow to, from what the last frame needed
+		GLuint m_pbo;
+		uint64 m_generation;
+		uint64 m_frame;
+
+	};
+
+	/*
+	 * Plays audio that's already been decoded, through SDL_mixer's music hook. The samples are converted to the mixer's
+	 * output format once up front, so positions map straight to frames and seeking is sample-accurate.
+	 */
+	class PcmPlayer
+	{
+	public:
+		PcmPlayer();
+		~PcmPlayer();
+
+		PcmPlayer(const PcmPlayer&) = delete;
+		PcmPlayer& operator=(const PcmPlayer&) = delete;
+
+		ErrCode Open(const int16* interleaved, size_t frames, int channels, int rate);
+		void Play(bool loop = false);
+		void Pause();
+		void Stop();
+		void Seek(double seconds);
+		void SetVolume(float volume);
+
+		bool IsPlaying() const;
+		double GetPosition() const;
+		double GetDuration() const;
+
+	private:
+		static void Mix(void* udata, Uint8* stream, int len);
+
+		std::vector<uint8> m_buffer;
+		SDL_AudioFormat m_format;
+		int m_rate;
+		int m_frame_bytes;
+		std::atomic<size_t> m_position; // In bytes, always on a frame boundary
+		std::atomic<bool> m_playing;
+		std::atomic<bool> m_looping;
+		std::atomic<int> m_volume;
+
+	};
+
+	// Library tracks are always owned by a shared_ptr, so an index can take a share of any SID it's handed
+	class AudioFile: public std::enable_shared_from_this<AudioFile>
 	{
 	public:
 		AudioFile();
 		~AudioFile();
 
-		ErrCode Load(const std::string& path, bool load_sdl = false);
+		ErrCode Load(const std::string& path, bool for_playback = false);
 		void Play(bool loop = false);
 		void Pause();
 		void Stop();
+		void Seek(double seconds);
 		void AdjustVolume(float volume);
 		void Reload();
-		void Reset(bool reset_sdl = true, bool reset_samples = true);
+		void Reset(bool reset_playback = true, bool reset_samples = true);
+
+		bool IsPlaying() const;
+		double GetPosition() const;
 
-		std::unique_ptr<Bitmap> RenderWaveform();
+		std::unique_ptr<Bitmap> RenderWaveform(float from = 0.0f, float to = 1.0f);
 
-		void Process(Bitmap* hd_spectrogram = nullptr);
+		void Process(SpectrogramPyramid* spectrogram = nullptr);
 
 	public:
 		std::string path;
 		std::vector<float> sample_data;
+		WaveformPyramid waveform;
 		std::vector<std::pair<int, int>> peaks;
-		Mix_Music* sdl_object;
+		std::unique_ptr<PcmPlayer> player; // Only when loaded for playback
 		float volume;
 		float length;
+		uint64 digest; // Of the file's bytes, 0 if not known yet
 		bool loaded;
 		bool processed;
 		int dims[2];
@@ -170,6 +495,42 @@ namespace finder
 
 	};
 
+	/*
+	 * Where one settings profile's fingerprints live in the cache file (see KPSFFormat.md)
+	 */
+	struct CacheSegment
+	{
+		uint64 profile;
+		uint64 offset;
+		uint64 size;
+	};
+
+	// What an AudioLibrary is busy with. Progress counts restart at every stage.
+	enum LibraryStage
+	{
+		STAGE_IDLE,
+		STAGE_LOADING, // Reading the cache and decoding new files. The only stage that replaces tracks.
+		STAGE_FINGERPRINTING,
+		STAGE_INDEXING,
+		STAGE_SAVING
+	};
+
+	/*
+	 * The library as of the last time it changed. Never modified once published, so any thread can read one without
+	 * locking and get a consistent view, while the library keeps working on the next.
+	 */
+	struct LibrarySnapshot
+	{
+		std::shared_ptr<const LibraryIndex> index;
+		std::vector<std::pair<std::string, bool>> tracks; // Path relative to the library, and whether it's fingerprinted
+		int num_cached;
+		float avg_length;
+		uint64 profile;
+		int other_profiles;
+	};
+
+	extern ErrCode CheckProfile(const LibrarySnapshot& snapshot);
+
 	class AudioLibrary
 	{
 	public:
@@ -179,33 +540,342 @@ namespace finder
 		ErrCode Load(const std::string& path);
 		ErrCode Save();
 		void Process(bool force = false);
-		void TestSong(AudioFile& missing);
+		ErrCode TestSong(AudioFile& missing);
+		ErrCode Query(const Fingerprint& missing_fp, int topn, std::vector<FoundSong>& songs_result) const;
+		ErrCode Query(const LibrarySnapshot& snapshot, const Fingerprint& missing_fp, int topn, std::vector<FoundSong>& songs_result) const;
+		bool OwnsTrack(const std::string& relative_path) const;
+		void RebuildIndex();
+		void UpdateTracks(const std::vector<SID>& added, const std::vector<SID>& removed);
+		std::shared_ptr<const LibraryIndex> GetIndex() const;
+		std::shared_ptr<const LibrarySnapshot> GetSnapshot() const;
+		ErrCode Watch(bool enable);
+		bool IsWatching() const;
 		
 	private:
-		void FindMatches(Fingerprint& missing_fp, Results& results);
-		void AlignMatches(const Results& results, int queried_hashes, int topn, std::vector<FoundSong>& songs_result);
+		friend class StreamRecognizer;
+		friend int RunBenchmarks(const std::vector<std::string>& args);
+
+		void FindMatches(const QueryHashes& mapper, const LibraryIndex& index, int shard, const std::vector<bool>& skip, Results& results) const;
+		void AlignMatches(const LibrarySnapshot& snapshot, const Results& results, int queried_hashes, int topn, std::vector<FoundSong>& songs_result) const;
 		void RetrieveCachedMusic();
+		void BeginStage(LibraryStage stage, int total);
+		void Publish(std::shared_ptr<const LibraryIndex> index);
 
 	public:
-		std::mutex mutex;
-		std::vector<AudioFile> files;
+		mutable std::mutex mutex;
+		std::vector<std::shared_ptr<AudioFile>> files;
 		std::vector<Fingerprint*> fingerprints;
 		std::vector<FoundSong> matches;
 		std::string library_path;
 		std::string cache_path;
 		std::vector<std::string> exclude;
+		Settings profile; // Fingerprint settings the library was loaded with
+		std::vector<CacheSegment> other_profiles;
 		float highest_match_percent;
 		float avg_length;
 		bool cached_fps_present;
-		bool loading;
-		int load_min;
-		int load_max;
+		std::atomic<bool> loading;
+		std::atomic<int> load_stage; // LibraryStage
+		std::atomic<int> load_min; // Done so far in this stage
+		std::atomic<int> load_max;
+		int num_shards;
+		int shard_index;
+		int shard_count;
+		std::unique_ptr<LibraryWatcher> watcher;
+
+	private:
+		std::shared_ptr<const LibrarySnapshot> m_snapshot; // Only ever swapped whole, through std::atomic_load/store
+
+	};
+
+	extern bool IsAudioPath(const std::string& path);
+
+	// One audio file found by CrawlLibrary
+	struct ManifestEntry
+	{
+		std::string path;
+		uint64 size;
+		int64 mtime; // In the filesystem clock's ticks, only good for comparing against other manifests
+	};
+
+	extern ErrCode CrawlLibrary(const std::string& root, std::vector<ManifestEntry>& manifest);
+
+	/*
+	 * Keeps a loaded library current: audio files created, modified or deleted under library_path are picked up through
+	 * inotify, fingerprinted on a low-priority worker once they've stopped changing, and spliced into the live index.
+	 * Only available on Linux.
+	 */
+	class LibraryWatcher
+	{
+	public:
+		LibraryWatcher(AudioLibrary& library);
+		~LibraryWatcher();
+
+		ErrCode Start();
+		void Stop();
+		std::unique_lock<std::mutex> Pause();
+		int GetPending() const;
+
+	private:
+		void EventLoop();
+		void WorkerLoop();
+		void AddWatches(const std::string& directory, std::vector<std::string>* found);
+		void Rescan();
+		void Enqueue(const std::string& path);
+		void ApplyChanges(const std::vector<std::string>& paths);
+
+	private:
+		AudioLibrary& m_library;
+		std::unordered_map<int, std::string> m_watches;
+		std::unordered_map<std::string, std::chrono::steady_clock::time_point> m_pending;
+		std::mutex m_apply_mutex;
+		mutable std::mutex m_pending_mutex;
+		std::condition_variable m_pending_cv;
+		std::thread m_event_thread;
+		std::thread m_worker_thread;
+		std::atomic<bool> m_running;
+		int m_inotify_fd;
+		int64 m_started; // In the filesystem clock's ticks, like ManifestEntry::mtime
+
+	};
+
+	/*
+	 * Progressive recognition: audio is fed in chunks (from a file, a pipe, a live source...), fingerprinted with an
+	 * incremental STFT and scored against the library as hashes come in. Once the top candidate clears the confidence margin
+	 * in the settings there's no point in reading any more audio.
+	 */
+	class StreamRecognizer
+	{
+	public:
+		StreamRecognizer(const AudioLibrary& library, const std::string& name = "");
+
+		void Feed(const float* samples, size_t count);
+		void Finish();
+		bool Confident() const;
+		void Rank(int topn, std::vector<FoundSong>& songs_result) const;
+
+		float GetSecondsFed() const;
+		int GetHashCount() const;
+
+	private:
+		void AppendColumns(const cv::Mat& spectrogram);
+		void FinalizePeaks(bool flush);
+		void HashPeaks(bool flush);
+		void AddHash(const std::string& hash, int offset);
+
+	private:
+		const AudioLibrary& m_library;
+		std::shared_ptr<const LibrarySnapshot> m_snapshot;
+		std::shared_ptr<const LibraryIndex> m_index; // Null if there's nothing in the snapshot we can match against
+		std::string m_name;
+		std::vector<bool> m_skip;
+		std::vector<float> m_pending;
+		std::vector<std::vector<float>> m_columns;
+		std::vector<std::pair<int, int>> m_peaks;
+		boost::unordered_map<std::string, int> m_hashes;
+		std::unordered_map<SID, std::unordered_map<int, int>> m_histograms;
+		Results m_results;
+		size_t m_samples_fed;
+		size_t m_next_peak;
+		int m_column_base;
+		int m_peaks_done;
+		int m_best_aligned;
+		int m_runner_up_aligned;
+		SID m_best_sid;
+		bool m_finished;
+
+	};
+
+	// A decoded stretch of a track
+	struct Snippet
+	{
+		int channels;
+		int rate;
+		std::vector<int16> pcm; // Interleaved
+	};
+
+	/*
+	 * Decodes only the part of a track that's needed to audition it, seeking with sndfile instead of loading the whole
+	 * thing, and keeps the most recently used snippets around. Matches can be queued up to decode in the background so
+	 * previewing them is instant.
+	 */
+	class PreviewService
+	{
+	public:
+		PreviewService();
+		~PreviewService();
+
+		std::shared_ptr<const Snippet> Get(const std::string& path, double start, double duration);
+		void Prefetch(const std::vector<std::pair<std::string, double>>& starts, double duration);
+		void Play(const std::string& path, double start, double duration);
+		void Stop();
+		bool IsPlaying(const std::string& path, double start, double duration) const;
+		bool IsPlaying() const;
+
+	private:
+		using CacheEntry = std::pair<std::string, std::shared_ptr<const Snippet>>;
+
+		std::shared_ptr<const Snippet> Find(const std::string& key);
+		void Insert(const std::string& key, const std::shared_ptr<const Snippet>& snippet);
+		void WorkerLoop();
+
+	private:
+		std::list<CacheEntry> m_lru; // Most recently used first
+		std::unordered_map<std::string, std::list<CacheEntry>::iterator> m_cache;
+		std::mutex m_cache_mutex;
+		std::deque<std::tuple<std::string, double, double>> m_queue;
+		std::mutex m_queue_mutex;
+		std::condition_variable m_queue_cv;
+		std::thread m_worker;
+		std::atomic<bool> m_running;
+		PcmPlayer m_player;
+		std::string m_playing;
 
 	};
 	
+	/****************************************************************/
+	/* Query server                                                 */
+	/****************************************************************/
+	/*
+	 * Keeps a library resident and answers queries over a Unix domain socket, so scripts don't pay for reloading the cache
+	 * every time. Requests and responses are one line of JSON each; see README.md for the protocol.
+	 */
+	class QueryServer
+	{
+	public:
+		QueryServer(const std::string& library_path, const std::string& socket_path, int num_workers = 0);
+		~QueryServer();
+
+		void SetShard(int index, int count);
+		void SetBackends(const std::vector<std::string>& sockets, int timeout_ms);
+		int Run();
+
+	private:
+		void WorkerLoop();
+		void ReloadLoop();
+		void HandleConnection(int fd);
+		void FanOut(const std::string& request, std::vector<std::string>& responses);
+		ErrCode OpenShard(AudioLibrary& library);
+		std::shared_ptr<AudioLibrary> GetLibrary();
+
+	private:
+		std::string m_library_path;
+		std::string m_socket_path;
+		std::shared_ptr<AudioLibrary> m_library;
+		std::mutex m_library_mutex;
+		std::deque<int> m_queue;
+		std::mutex m_queue_mutex;
+		std::condition_variable m_queue_cv;
+		std::vector<std::string> m_backends;
+		std::atomic<bool> m_running;
+		int m_backend_timeout_ms;
+		int m_shard_index;
+		int m_shard_count;
+		int m_num_workers;
+		int m_listen_fd;
+
+	};
+
+	extern ErrCode SendQuery(const std::string& socket_path, const std::string& request, std::string& response, int timeout_ms = -1);
+
 	/****************************************************************/
 	/* Program UI/UX                                                */
 	/****************************************************************/
+	/*
+	 * Something the UI hands off to a worker thread so it never stalls a frame. The work runs there, reporting progress
+	 * and checking for cancellation between steps. Finish runs on the render thread afterwards, unless the job was
+	 * cancelled; that's where results get swapped in and textures uploaded.
+	 */
+	struct Job
+	{
+		std::string name;
+		std::atomic<float> progress;
+		std::atomic<bool> cancelled;
+		std::atomic<bool> done;
+		std::function<void(Job&)> work;
+		std::function<void()> finish;
+
+		void SetProgress(float value);
+	};
+
+	class JobRunner
+	{
+	public:
+		JobRunner();
+		~JobRunner();
+
+		JobRunner(const JobRunner&) = delete;
+		JobRunner& operator=(const JobRunner&) = delete;
+
+		std::shared_ptr<Job> Submit(const std::string& name, std::function<void(Job&)> work, std::function<void()> finish);
+		void Update();
+		std::vector<std::shared_ptr<Job>> GetJobs() const;
+
+	private:
+		std::vector<std::pair<std::shared_ptr<Job>, std::thread>> m_running;
+
+	};
+
+	enum MatchSort
+	{
+		SORT_RANK, // The order the library ranked them in
+		SORT_CONFIDENCE,
+		SORT_OFFSET,
+		SORT_HASHES,
+		SORT_COUNT
+	};
+
+	/*
+	 * Query results as the Matches window shows them. Each sort key's order is worked out once per result set and kept,
+	 * so switching sorts or moving the confidence filter is a linear pass at most, and never happens just for drawing.
+	 */
+	class MatchList
+	{
+	public:
+		MatchList();
+
+		void Assign(std::vector<FoundSong>&& matches);
+		void Clear();
+		void SetOrder(MatchSort sort, bool descending);
+		void SetMinConfidence(float confidence);
+		float GetMinConfidence() const;
+
+		size_t GetCount() const; // Rows left after filtering
+		size_t GetTotal() const;
+		const FoundSong& Get(size_t row) const;
+		int GetRank(size_t row) const;
+
+	private:
+		const std::vector<int>& GetOrder(MatchSort sort);
+		void Refresh();
+
+	private:
+		std::vector<FoundSong> m_matches; // As ranked
+		std::vector<int> m_orders[SORT_COUNT]; // Ascending, empty until first asked for
+		std::vector<int> m_rows; // Indices into m_matches, sorted and filtered
+		MatchSort m_sort;
+		bool m_descending;
+		float m_min_confidence;
+
+	};
+
+	/*
+	 * Makes the main loop run a frame if it's idle. Safe to call from any thread.
+	 */
+	extern void WakeUI();
+
+	/*
+	 * Where the main loop's time went
+	 */
+	struct LoopStats
+	{
+		int frames; // Over the last second, like idle and render
+		double idle; // Seconds blocked waiting for something to happen
+		double render; // Seconds building and drawing frames, not counting the wait for vsync
+		double idle_total; // Since startup
+		double render_total;
+	};
+
 	class UI
 	{
 	public:
@@ -214,11 +884,15 @@ namespace finder
 
 		void Update();
 		void Render();
+		bool IsIdle() const;
+		void SetLoopStats(const LoopStats& stats);
 
 	private:
 		void OpenSampleDialog();
 		void OpenLibraryDialog();
+		void ExportTraceDialog();
 		void ReplaceSample(const std::string& path);
+		void ScanSample();
 
 		void RenderLibrary();
 		void RenderMissingSample();
@@ -227,12 +901,17 @@ namespace finder
 		void RenderLibraryStats();
 		void RenderSettings();
 		void RenderLoadingScreen();
+		void RenderJobs();
 
 	private:
-		AudioFile m_missing;
+		std::shared_ptr<AudioFile> m_missing; // Never null; replaced wholesale when a new sample finishes loading
 		AudioLibrary m_library;
+		PreviewService m_previews;
+		MatchList m_matches;
+		std::shared_ptr<const LibrarySnapshot> m_matches_snapshot; // What m_matches was found in, which keeps its SIDs alive
 		Texture m_missing_waveform;
-		Texture m_missing_spectral;
+		SpectrogramPyramid m_missing_spectrogram;
+		SpectrogramView m_spectrogram_view;
 		Texture m_peak;
 		Texture m_logo;
 		std::string m_library_path;
@@ -242,60 +921,64 @@ namespace finder
 		bool m_show_library_stats;
 		bool m_show_waveform;
 		bool m_show_spectrogram;
+		float m_view_from; // Zoomed in part of the missing sample, as fractions of its length
+		float m_view_to;
+		LoopStats m_loop_stats;
+		ProfileSummary m_profile;
+		double m_profile_time; // When m_profile was last summarized, in ImGui time
+		std::shared_ptr<Job> m_sample_job;
+		std::shared_ptr<Job> m_scan_job;
+		JobRunner m_jobs; // Last, so running jobs are stopped before anything they use goes away
 
 	};
 
 	/****************************************************************/
-	/* Algorithm config                                           */
+	/* Misc. I/O utilities                                          */
 	/****************************************************************/
-	struct Settings
+	struct IOBlockDeleter
 	{
-		// Fingerprint algorithm settings
-		int default_fan_value;
-		int min_hash_time_delta;
-		int max_hash_time_delta;
-		int fingerprint_reduction;
-		int peak_neighborhood_size;
-		int default_window_size;
-		float default_amp_min;
-		float default_overlap_ratio;
-		float fs;
-
-		// Ranking algorithm settings
-		bool demote_songs;
-		float demotion_factor;
+		void operator()(byte* block) const;
 	};
 
-	extern Settings settings;
-
-	extern void LoadDefaults(Settings& settings);
-
-	extern ErrCode LoadSettings(const std::string& path, Settings& settings);
-	extern ErrCode SaveSettings(const std::string& path, const Settings& settings);
-
-	/****************************************************************/
-	/* Misc. I/O utilities                                          */
-	/****************************************************************/
+	/*
+	 * Binary reader/writer for our cache files. Everything goes through 1 MiB aligned blocks and is little-endian on disk
+	 * regardless of the host. Reading past the end zero-fills and flips Good() to false instead of returning garbage.
+	 */
 	class Loader
 	{
 	public:
 		Loader(const std::string& path);
 
 		int NextInt();
+		uint64 NextUInt64();
 		float NextFloat();
 		std::string NextString();
+		ErrCode NextBytes(void* out, size_t size);
+		ErrCode NextInts(int32* out, size_t count);
+		void Skip(size_t bytes);
+		void Seek(uint64 offset);
 
 		template <size_t Size>
 		std::string NextBufString()
 		{
-			std::string ret;
-			ret.resize(Size);
-			m_file.read(&ret[0], Size);
+			std::string ret(Size, '\0');
+			NextBytes(&ret[0], Size);
 			return ret;
 		}
 
+		bool Good() const;
+		bool Eof() const;
+
+	private:
+		bool Refill();
+
 	private:
 		std::ifstream m_file;
+		std::unique_ptr<byte[], IOBlockDeleter> m_buffer;
+		size_t m_pos;
+		size_t m_end;
+		bool m_eof;
+		bool m_failed;
 
 	};
 
@@ -303,17 +986,107 @@ namespace finder
 	{
 	public:
 		Saver(const std::string& path);
+		~Saver();
 
 		void PutInt(int v);
+		void PutUInt64(uint64 v);
 		void PutFloat(float v);
 		void PutString(const std::string& string, bool fixed_size = false);
+		void PutBytes(const void* data, size_t size);
+		ErrCode Flush();
+		ErrCode Close();
+
+		bool Good() const;
 
 	private:
+		std::string m_path;
 		std::ofstream m_file;
+		std::unique_ptr<byte[], IOBlockDeleter> m_buffer;
+		size_t m_pos;
+		bool m_failed;
+
+	};
+
+	/*
+	 * Read-only view of a whole file (mmap/MapViewOfFile), so it can be parsed in place instead of being read into buffers
+	 */
+	class MappedFile
+	{
+	public:
+		MappedFile();
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		ErrCode Open(const std::string& path);
+		void Close();
+
+		const byte* Data() const;
+		size_t Size() const;
+
+	private:
+		const byte* m_data;
+		size_t m_size;
+		void* m_file; // Windows handles
+		void* m_mapping;
 
 	};
 
+	extern ErrCode DigestFile(const std::string& path, uint64& out);
 	extern ErrCode LoadTextFile(const std::string& path, std::string& out);
 	extern ErrCode SaveTextFile(const std::string& path, const std::string& in);
 
+	/****************************************************************/
+	/* Accuracy harness                                             */
+	/****************************************************************/
+	struct HarnessOptions
+	{
+		int tracks; // At most this many when picking from a real library
+		float seconds; // Per track, synthetic libraries only
+		int queries; // Per distortion
+		float clip_seconds;
+		uint64 seed;
+		std::string library_path; // Real tracks to query instead of synthetic ones, if set
+	};
+
+	struct HarnessRow
+	{
+		std::string name;
+		int queries;
+		int top1;
+		int top10;
+		float offset_error; // Median seconds, over the queries that ranked their track first
+	};
+
+	struct HarnessReport
+	{
+		std::vector<HarnessRow> rows; // One per distortion
+		HarnessRow overall;
+		double audio_seconds; // In the library
+		double fingerprint_seconds; // Wall time to fingerprint the library
+		uint64 library_hashes;
+		uint64 index_bytes;
+		double latency_p50;
+		double latency_p99;
+	};
+
+	extern ErrCode GetHarnessOptions(const std::vector<std::string>& args, HarnessOptions& out);
+	extern ErrCode EvaluateAccuracy(const HarnessOptions& options, HarnessReport& out);
+	extern void PrintHarnessReport(const HarnessReport& report);
+
+	/****************************************************************/
+	/* Command-line tools                                           */
+	/****************************************************************/
+	extern int RunCommand(int argc, char* argv[]);
+	extern int RunBenchmarks(const std::vector<std::string>& args);
+	extern int RunHarness(const std::vector<std::string>& args);
+	extern int RunTuning(const std::vector<std::string>& args);
+	extern void PrintUsage();
+	extern std::string GetOption(const std::vector<std::string>& args, const std::string& name, const std::string& fallback);
+	extern ErrCode GetIntOption(const std::vector<std::string>& args, const std::string& name, int fallback, int& out);
+	extern ErrCode GetFloatOption(const std::vector<std::string>& args, const std::string& name, float fallback, float& out);
+	extern ErrCode GetUInt64Option(const std::vector<std::string>& args, const std::string& name, uint64 fallback, uint64& out);
+	extern ErrCode OpenLibrary(AudioLibrary& library, const std::string& path);
+
 }
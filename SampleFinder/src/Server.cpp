@@ -0,0 +1,678 @@
+#include "SampleFinder.h"
+
+#include <string.h>
+#include <signal.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+namespace
+{
+	constexpr int RELOAD_POLL_MS = 2000;
+	constexpr int ACCEPT_POLL_MS = 250;
+	constexpr int CONNECT_RETRY_MS = 10;
+	constexpr int CLIENT_IDLE_MS = 30000; // Clients that go quiet for longer are dropped so they don't hold on to a worker
+	constexpr size_t MAX_REQUEST_LINE = 64 * 1024 * 1024; // Fingerprinted queries can get big
+	constexpr size_t MAX_PCM_BYTES = 512 * 1024 * 1024;
+
+	volatile sig_atomic_t stop_requested = 0;
+
+	void OnStopSignal(int)
+	{
+		stop_requested = 1;
+	}
+
+#ifndef _WIN32
+	/*
+	 * Waits for the socket to be ready for events, up until the deadline
+	 */
+	bool WaitFor(int fd, short events, std::chrono::steady_clock::time_point deadline)
+	{
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		pollfd pfd = { fd, events, 0 };
+		return poll(&pfd, 1, std::max(0, (int) left.count())) > 0;
+	}
+
+	/*
+	 * Tiny buffered reader so we can pull a JSON line off the socket and then whatever binary payload follows it. With a
+	 * deadline set, every read waits for the socket first and gives up once the deadline passes.
+	 */
+	class SocketReader
+	{
+	public:
+		SocketReader(int fd):
+			m_fd(fd)
+		{
+		}
+
+		void SetDeadline(std::chrono::steady_clock::time_point deadline)
+		{
+			m_deadline = deadline;
+			m_has_deadline = true;
+			m_timed_out = false;
+		}
+
+		bool TimedOut() const
+		{
+			return m_timed_out;
+		}
+
+		bool ReadLine(std::string& out)
+		{
+			out.clear();
+			for (size_t scanned = 0;;)
+			{
+				size_t newline = m_buffer.find('\n', scanned);
+				if (newline != std::string::npos)
+				{
+					out = m_buffer.substr(0, newline);
+					m_buffer.erase(0, newline + 1);
+					return true;
+				}
+				scanned = m_buffer.size();
+				if (m_buffer.size() > MAX_REQUEST_LINE || !Fill())
+					return false;
+			}
+		}
+
+		bool ReadExact(char* out, size_t size)
+		{
+			size_t from_buffer = std::min(size, m_buffer.size());
+			memcpy(out, m_buffer.data(), from_buffer);
+			m_buffer.erase(0, from_buffer);
+
+			for (size_t got = from_buffer; got < size; )
+			{
+				if (!WaitReadable())
+					return false;
+				ssize_t n = read(m_fd, out + got, size - got);
+				if (n <= 0)
+					return false;
+				got += n;
+			}
+
+			return true;
+		}
+
+	private:
+		bool WaitReadable()
+		{
+			if (!m_has_deadline)
+				return true;
+
+			if (!WaitFor(m_fd, POLLIN, m_deadline))
+			{
+				m_timed_out = true;
+				return false;
+			}
+			return true;
+		}
+
+		bool Fill()
+		{
+			if (!WaitReadable())
+				return false;
+
+			char chunk[64 * 1024];
+			ssize_t n = read(m_fd, chunk, sizeof(chunk));
+			if (n <= 0)
+				return false;
+			m_buffer.append(chunk, n);
+			return true;
+		}
+
+	private:
+		int m_fd;
+		std::string m_buffer;
+		std::chrono::steady_clock::time_point m_deadline;
+		bool m_has_deadline = false;
+		bool m_timed_out = false;
+
+	};
+
+	bool WriteAll(int fd, const std::string& data)
+	{
+		for (size_t sent = 0; sent < data.size(); )
+		{
+			ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+			if (n <= 0)
+				return false;
+			sent += n;
+		}
+		return true;
+	}
+
+	/*
+	 * Same, but never blocks past the deadline: each write only takes what fits in the socket buffer right now
+	 */
+	bool WriteAll(int fd, const std::string& data, std::chrono::steady_clock::time_point deadline)
+	{
+		for (size_t sent = 0; sent < data.size(); )
+		{
+			if (!WaitFor(fd, POLLOUT, deadline))
+				return false;
+			ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_DONTWAIT);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			if (n <= 0)
+				return false;
+			sent += n;
+		}
+		return true;
+	}
+
+	/*
+	 * connect() that gives up at the deadline. A Unix socket whose backlog is full turns us away with EAGAIN instead of
+	 * queueing us, so that gets retried until time runs out.
+	 */
+	bool ConnectBefore(int fd, const sockaddr_un& addr, std::chrono::steady_clock::time_point deadline)
+	{
+		int flags = fcntl(fd, F_GETFL, 0);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+		bool connected = false;
+		int error = 0;
+		for (;;)
+		{
+			if (connect(fd, (const sockaddr*) &addr, sizeof(addr)) == 0)
+			{
+				connected = true;
+				break;
+			}
+			error = errno;
+			if (error == EINPROGRESS)
+			{
+				socklen_t len = sizeof(error);
+				if (!WaitFor(fd, POLLOUT, deadline))
+					error = ETIMEDOUT;
+				else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+					error = errno;
+				connected = error == 0;
+				break;
+			}
+			if (error != EAGAIN)
+				break;
+			if (std::chrono::steady_clock::now() >= deadline)
+			{
+				error = ETIMEDOUT;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(CONNECT_RETRY_MS));
+		}
+
+		// Reads and writes do their own waiting from here on
+		fcntl(fd, F_SETFL, flags);
+		errno = error;
+		return connected;
+	}
+#endif
+
+	nlohmann::json MatchesToJson(const std::vector<finder::FoundSong>& matches, const std::string& library_path, int topn)
+	{
+		nlohmann::json out = nlohmann::json::array();
+		for (const finder::FoundSong& match: matches)
+		{
+			if (out.size() >= topn)
+				break;
+
+			nlohmann::json entry;
+			entry["path"] = std::filesystem::proximate(match.sid->path, library_path).string();
+			entry["confidence"] = match.overall_confidence;
+			entry["input_confidence"] = match.input_confidence;
+			entry["fingerprinted_confidence"] = match.fingerprinted_confidence;
+			entry["hashes_matched"] = match.hashes_matched;
+			entry["offset_secs"] = match.offset_secs;
+			out.push_back(entry);
+		}
+		return out;
+	}
+
+	nlohmann::json ErrorJson(const std::string& msg)
+	{
+		nlohmann::json out;
+		out["ok"] = false;
+		out["error"] = msg;
+		return out;
+	}
+}
+
+namespace finder
+{
+	QueryServer::QueryServer(const std::string& library_path, const std::string& socket_path, int num_workers):
+		m_library_path(library_path),
+		m_socket_path(socket_path),
+		m_running(false),
+		m_backend_timeout_ms(-1),
+		m_shard_index(0),
+		m_shard_count(1),
+		m_num_workers(num_workers > 0 ? num_workers : std::max(1u, std::thread::hardware_concurrency())),
+		m_listen_fd(-1)
+	{
+	}
+
+	QueryServer::~QueryServer()
+	{
+	}
+
+	/*
+	 * Only keep the tracks belonging to one shard of the library, for running as one of several worker processes.
+	 */
+	void QueryServer::SetShard(int index, int count)
+	{
+		m_shard_index = index;
+		m_shard_count = count;
+	}
+
+	/*
+	 * Turn this server into a coordinator: it holds no library itself and forwards fingerprinted queries to the workers.
+	 */
+	void QueryServer::SetBackends(const std::vector<std::string>& sockets, int timeout_ms)
+	{
+		m_backends = sockets;
+		m_backend_timeout_ms = timeout_ms;
+	}
+
+	ErrCode QueryServer::OpenShard(AudioLibrary& library)
+	{
+		library.shard_index = m_shard_index;
+		library.shard_count = m_shard_count;
+		return OpenLibrary(library, m_library_path);
+	}
+
+#ifdef _WIN32
+	int QueryServer::Run()
+	{
+		std::cerr << "The query server is only supported on Unix-like systems" << std::endl;
+		return EXIT_FAILURE;
+	}
+#else
+	int QueryServer::Run()
+	{
+		if (m_backends.empty())
+		{
+			auto library = std::make_shared<AudioLibrary>();
+			if (OpenShard(*library) == FAILURE)
+				return EXIT_FAILURE;
+			m_library = library;
+		}
+
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (m_socket_path.size() >= sizeof(addr.sun_path))
+		{
+			std::cerr << "Socket path is too long: " << m_socket_path << std::endl;
+			return EXIT_FAILURE;
+		}
+		strncpy(addr.sun_path, m_socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+		m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(m_socket_path.c_str());
+		if (m_listen_fd < 0 || bind(m_listen_fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(m_listen_fd, 64) != 0)
+		{
+			std::cerr << "Failed to listen on " << m_socket_path << ": " << strerror(errno) << std::endl;
+			if (m_listen_fd >= 0)
+				close(m_listen_fd);
+			return EXIT_FAILURE;
+		}
+
+		signal(SIGINT, OnStopSignal);
+		signal(SIGTERM, OnStopSignal);
+		signal(SIGPIPE, SIG_IGN);
+
+		m_running = true;
+		std::vector<std::thread> workers;
+		for (int i = 0; i < m_num_workers; i++)
+			workers.emplace_back(&QueryServer::WorkerLoop, this);
+		std::thread reloader(&QueryServer::ReloadLoop, this);
+
+		std::cerr << "Listening on " << m_socket_path << " with " << m_num_workers << " workers";
+		if (!m_backends.empty())
+			std::cerr << ", coordinating " << m_backends.size() << " shards";
+		else if (m_shard_count > 1)
+			std::cerr << ", serving shard " << m_shard_index << "/" << m_shard_count;
+		std::cerr << std::endl;
+
+		while (!stop_requested)
+		{
+			pollfd pfd = { m_listen_fd, POLLIN, 0 };
+			if (poll(&pfd, 1, ACCEPT_POLL_MS) <= 0)
+				continue;
+
+			int fd = accept(m_listen_fd, nullptr, nullptr);
+			if (fd < 0)
+				continue;
+
+			std::unique_lock<std::mutex> lck(m_queue_mutex);
+			m_queue.push_back(fd);
+			m_queue_cv.notify_one();
+		}
+
+		std::cerr << "Shutting down..." << std::endl;
+		m_running = false;
+		m_queue_cv.notify_all();
+		for (std::thread& worker: workers)
+			worker.join();
+		reloader.join();
+
+		close(m_listen_fd);
+		unlink(m_socket_path.c_str());
+
+		return EXIT_SUCCESS;
+	}
+
+	//
+
+	void QueryServer::WorkerLoop()
+	{
+		for (;;)
+		{
+			int fd;
+			{
+				std::unique_lock<std::mutex> lck(m_queue_mutex);
+				m_queue_cv.wait(lck, [this]() { return !m_queue.empty() || !m_running; });
+				if (m_queue.empty())
+					return;
+				fd = m_queue.front();
+				m_queue.pop_front();
+			}
+
+			HandleConnection(fd);
+			close(fd);
+		}
+	}
+
+	/*
+	 * Saving the library from the GUI (or anywhere else) rewrites library.kpsf. When that happens we load a fresh copy on
+	 * the side and swap it in, so queries in flight finish against the one they started with.
+	 */
+	void QueryServer::ReloadLoop()
+	{
+		if (!m_backends.empty())
+			return;
+
+		std::string cache_path = m_library_path + "/library.kpsf";
+		std::error_code ec;
+		auto last_write = std::filesystem::last_write_time(cache_path, ec);
+
+		while (m_running)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(RELOAD_POLL_MS));
+
+			auto write_time = std::filesystem::last_write_time(cache_path, ec);
+			if (ec || write_time == last_write)
+				continue;
+			last_write = write_time;
+
+			std::cerr << "Library changed, reloading..." << std::endl;
+			auto library = std::make_shared<AudioLibrary>();
+			if (OpenShard(*library) == FAILURE)
+				continue;
+
+			std::unique_lock<std::mutex> lck(m_library_mutex);
+			m_library = library;
+		}
+	}
+
+	void QueryServer::HandleConnection(int fd)
+	{
+		SocketReader reader(fd);
+
+		// Several requests can be pipelined on one connection. The wait for the next one is done in short slices, so a
+		// shutdown never has to wait on an idle client.
+		std::string line;
+		auto idle_since = std::chrono::steady_clock::now();
+		for (;;)
+		{
+			reader.SetDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(ACCEPT_POLL_MS));
+			if (!reader.ReadLine(line))
+			{
+				if (reader.TimedOut() && m_running && std::chrono::steady_clock::now() - idle_since < std::chrono::milliseconds(CLIENT_IDLE_MS))
+					continue;
+				return;
+			}
+			if (line.empty())
+				continue;
+
+			nlohmann::json response;
+			auto start = std::chrono::high_resolution_clock::now();
+			try
+			{
+				nlohmann::json request = nlohmann::json::parse(line);
+				int topn = request.value("top", 10);
+
+				AudioFile query;
+				if (request.contains("path"))
+				{
+					if (query.Load(request["path"].get<std::string>()) == FAILURE)
+						response = ErrorJson("Failed to load audio file");
+					else if (query.sample_data.size() < (size_t) settings.default_window_size)
+						response = ErrorJson("Clip too short");
+					else
+						query.Process();
+				}
+				else if (request.contains("pcm"))
+				{
+					// Raw 16-bit little-endian PCM follows the request line
+					size_t size = request["pcm"].get<size_t>();
+					int channels = request.value("channels", 1);
+					if (size > MAX_PCM_BYTES || channels <= 0)
+					{
+						WriteAll(fd, ErrorJson("Invalid PCM payload").dump() + "\n", std::chrono::steady_clock::now() + std::chrono::milliseconds(CLIENT_IDLE_MS));
+						return;
+					}
+					std::vector<int16> pcm(size / sizeof(int16));
+					reader.SetDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(CLIENT_IDLE_MS));
+					if (!reader.ReadExact((char*) pcm.data(), size))
+						return;
+
+					// Fingerprints are only comparable at the rate the library was hashed at. The payload's been read
+					// by now, so the connection can carry on with the next request.
+					int samplerate = request.value("samplerate", (int) settings.fs);
+					if (samplerate != (int) settings.fs)
+					{
+						response = ErrorJson("PCM must be at " + std::to_string((int) settings.fs) + " Hz, got " + std::to_string(samplerate));
+					}
+					else
+					{
+						query.sample_data.resize(pcm.size() / channels);
+						for (size_t i = 0; i < query.sample_data.size(); i++)
+							query.sample_data[i] = (float) pcm[i * channels]; // First channel, like AudioFile::Load
+						query.length = query.sample_data.size() / settings.fs;
+						query.loaded = true;
+						if (query.sample_data.size() < (size_t) settings.default_window_size)
+							response = ErrorJson("Clip too short");
+						else
+							query.Process();
+					}
+				}
+				else if (request.contains("hashes"))
+				{
+					// Already fingerprinted, which is how a coordinator talks to its workers. Hashes made with other settings
+					// would match nothing useful.
+					if (request.value("profile", SettingsProfile(settings)) != SettingsProfile(settings))
+					{
+						response = ErrorJson("Hashes were made with different fingerprint settings than this server's");
+					}
+					else
+					{
+						query.path = request.value("name", "");
+						query.fingerprint.source = &query;
+						for (const auto& pair: request["hashes"])
+							query.fingerprint.hashes.emplace(pair[0].get<std::string>(), pair[1].get<int>());
+					}
+				}
+				else
+				{
+					response = ErrorJson("Request needs either \"path\", \"pcm\" or \"hashes\"");
+				}
+
+				if (response.is_null() && !m_backends.empty())
+				{
+					nlohmann::json forward;
+					forward["top"] = topn;
+					forward["profile"] = SettingsProfile(settings);
+					forward["name"] = std::filesystem::path(query.path).filename().string();
+					forward["hashes"] = nlohmann::json::array();
+					for (const auto& [hash, offset]: query.fingerprint.hashes)
+						forward["hashes"].push_back({hash, offset});
+
+					std::vector<std::string> responses;
+					FanOut(forward.dump(), responses);
+
+					// Every shard ranks its own tracks, so the merged top N is just the best of all of them
+					nlohmann::json merged = nlohmann::json::array();
+					nlohmann::json missing = nlohmann::json::array();
+					for (size_t i = 0; i < responses.size(); i++)
+					{
+						nlohmann::json partial = nlohmann::json::parse(responses[i], nullptr, false);
+						if (partial.is_discarded() || !partial.value("ok", false))
+						{
+							missing.push_back(m_backends[i]);
+							continue;
+						}
+						for (const auto& entry: partial["matches"])
+							merged.push_back(entry);
+					}
+					// Same order as RanksHigher on a single server: confidence, then the later offset. offset_secs is just
+					// the frame offset scaled, so it sorts the same way.
+					std::stable_sort(merged.begin(), merged.end(), [](const nlohmann::json& a, const nlohmann::json& b)
+					{
+						float a_confidence = a["confidence"].get<float>();
+						float b_confidence = b["confidence"].get<float>();
+						if (a_confidence != b_confidence)
+							return a_confidence > b_confidence;
+						return a["offset_secs"].get<float>() > b["offset_secs"].get<float>();
+					});
+					if (merged.size() > topn)
+						merged.erase(merged.begin() + topn, merged.end());
+
+					response["ok"] = missing.size() < m_backends.size();
+					response["hashes"] = query.fingerprint.hashes.size();
+					response["matches"] = merged;
+					response["missing_shards"] = missing;
+				}
+				else if (response.is_null())
+				{
+					std::shared_ptr<AudioLibrary> library = GetLibrary();
+					std::vector<FoundSong> matches;
+					if (library->Query(query.fingerprint, topn, matches) == FAILURE)
+					{
+						response = ErrorJson("Fingerprint settings don't match the library's");
+					}
+					else
+					{
+						response["ok"] = true;
+						response["hashes"] = query.fingerprint.hashes.size();
+						response["matches"] = MatchesToJson(matches, m_library_path, topn);
+					}
+				}
+			}
+			catch (const std::exception& e)
+			{
+				response = ErrorJson(e.what());
+			}
+
+			auto end = std::chrono::high_resolution_clock::now();
+			response["elapsed_ms"] = std::chrono::duration<double, std::milli>(end - start).count();
+			if (!WriteAll(fd, response.dump() + "\n", std::chrono::steady_clock::now() + std::chrono::milliseconds(CLIENT_IDLE_MS)))
+				return;
+			idle_since = std::chrono::steady_clock::now();
+		}
+	}
+#endif
+
+	/*
+	 * Send the same request to every backend at once. Whatever hasn't answered by the timeout is left empty, so one slow
+	 * or dead worker costs us its shard rather than the whole query.
+	 */
+	void QueryServer::FanOut(const std::string& request, std::vector<std::string>& responses)
+	{
+		responses.assign(m_backends.size(), "");
+
+		std::vector<std::thread> requests;
+		for (size_t i = 0; i < m_backends.size(); i++)
+		{
+			requests.emplace_back([this, i, &request, &responses]()
+			{
+				SendQuery(m_backends[i], request, responses[i], m_backend_timeout_ms);
+			});
+		}
+		for (std::thread& t: requests)
+			t.join();
+	}
+
+	std::shared_ptr<AudioLibrary> QueryServer::GetLibrary()
+	{
+		std::unique_lock<std::mutex> lck(m_library_mutex);
+		return m_library;
+	}
+
+	/****************************************************************/
+
+	/*
+	 * Client side: send one request line and wait for the response line. The timeout covers connecting, sending and the
+	 * reply together, so a backend that's stuck anywhere along the way can't hold us up; a negative one waits forever.
+	 */
+	ErrCode SendQuery(const std::string& socket_path, const std::string& request, std::string& response, int timeout_ms)
+	{
+#ifdef _WIN32
+		std::cerr << "The query server is only supported on Unix-like systems" << std::endl;
+		return FAILURE;
+#else
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(0, timeout_ms));
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || !(timeout_ms < 0 ? connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0 : ConnectBefore(fd, addr, deadline)))
+		{
+			std::cerr << "Failed to connect to " << socket_path << ": " << strerror(errno) << std::endl;
+			if (fd >= 0)
+				close(fd);
+			return FAILURE;
+		}
+
+		ErrCode status = FAILURE;
+		if (!(timeout_ms < 0 ? WriteAll(fd, request + "\n") : WriteAll(fd, request + "\n", deadline)))
+		{
+			if (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline)
+				std::cerr << "Timed out sending to " << socket_path << std::endl;
+			else
+				std::cerr << "Failed to send to " << socket_path << std::endl;
+		}
+		else
+		{
+			// However many reads it takes to arrive, the response gets whatever's left of the deadline
+			SocketReader reader(fd);
+			if (timeout_ms >= 0)
+				reader.SetDeadline(deadline);
+
+			if (reader.ReadLine(response))
+				status = SUCCESS;
+			else if (reader.TimedOut())
+				std::cerr << "Timed out waiting for " << socket_path << std::endl;
+			else
+				std::cerr << "Connection to " << socket_path << " closed before a response" << std::endl;
+		}
+
+		close(fd);
+		return status;
+#endif
+	}
+}
@@ -0,0 +1,327 @@
+#include "SampleFinder.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+#include <imgui.h>
+
+#include <opencv2/opencv.hpp>
+
+namespace
+{
+	constexpr int SPECTROGRAM_TILE_SIZE = 256;
+	constexpr size_t SPECTROGRAM_MIN_TILES = 64; // 16 MB of textures
+	constexpr size_t SPECTROGRAM_MAX_VISIBLE_TILES = 256; // Past this many on screen, a coarser level is drawn instead
+	constexpr int SPECTROGRAM_UPLOADS_PER_FRAME = 8;
+	constexpr float SPECTROGRAM_MAX_DB = 80.0f;
+
+	std::atomic<finder::uint64> next_generation(1);
+
+	finder::uint64 TileKey(int level, int tx, int ty)
+	{
+		return (finder::uint64) level << 56 | (finder::uint64) tx << 28 | (finder::uint64) ty;
+	}
+
+	// Same colors the spectrogram has always had: red ramps up over the whole range, blue twice as fast
+	const finder::uint8* Palette()
+	{
+		static const std::vector<finder::uint8> palette = []()
+		{
+			std::vector<finder::uint8> out(256 * 4);
+			for (int q = 0; q < 256; q++)
+			{
+				out[q * 4 + 0] = q;
+				out[q * 4 + 1] = 0;
+				out[q * 4 + 2] = std::min(255, q * 2);
+				out[q * 4 + 3] = 0xFF;
+			}
+			return out;
+		}();
+		return palette.data();
+	}
+}
+
+namespace finder
+{
+	SpectrogramPyramid::SpectrogramPyramid():
+		m_generation(0)
+	{
+	}
+
+	void SpectrogramPyramid::Build(const cv::Mat& spectrogram)
+	{
+		Clear();
+		if (spectrogram.empty())
+			return;
+
+		Level& base = m_levels.emplace_back();
+		base.width = spectrogram.cols;
+		base.height = spectrogram.rows;
+		base.cells.resize((size_t) base.width * base.height);
+
+		std::vector<int> rows(base.height);
+		std::iota(rows.begin(), rows.end(), 0);
+		std::for_each(std::execution::par, rows.begin(), rows.end(), [&](int row)
+		{
+			const float* src = spectrogram.ptr<float>(base.height - 1 - row);
+			uint8* dst = &base.cells[(size_t) row * base.width];
+			for (int col = 0; col < base.width; col++)
+				dst[col] = std::clamp((int) (src[col] * (255.0f / SPECTROGRAM_MAX_DB)), 0, 255);
+		});
+
+		while (m_levels.back().width > 1 || m_levels.back().height > 1)
+		{
+			const Level& below = m_levels.back();
+			Level level;
+			level.width = (below.width + 1) / 2;
+			level.height = (below.height + 1) / 2;
+			level.cells.resize((size_t) level.width * level.height);
+
+			rows.resize(level.height);
+			std::for_each(std::execution::par, rows.begin(), rows.end(), [&](int row)
+			{
+				const uint8* top = &below.cells[(size_t) (row * 2) * below.width];
+				const uint8* bottom = row * 2 + 1 < below.height ? top + below.width : top;
+				uint8* dst = &level.cells[(size_t) row * level.width];
+				for (int col = 0; col < level.width; col++)
+				{
+					int right = std::min(col * 2 + 1, below.width - 1);
+					dst[col] = std::max({ top[col * 2], top[right], bottom[col * 2], bottom[right] });
+				}
+			});
+			m_levels.push_back(std::move(level));
+		}
+
+		m_generation = next_generation++;
+	}
+
+	void SpectrogramPyramid::Clear()
+	{
+		m_levels.clear();
+		m_generation = 0;
+	}
+
+	int SpectrogramPyramid::GetLevels() const
+	{
+		return m_levels.size();
+	}
+
+	int SpectrogramPyramid::GetWidth(int level) const
+	{
+		return m_levels[level].width;
+	}
+
+	int SpectrogramPyramid::GetHeight(int level) const
+	{
+		return m_levels[level].height;
+	}
+
+	const uint8* SpectrogramPyramid::GetRow(int level, int row) const
+	{
+		return &m_levels[level].cells[(size_t) row * m_levels[level].width];
+	}
+
+	uint64 SpectrogramPyramid::GetGeneration() const
+	{
+		return m_generation;
+	}
+
+	/****************************************************************/
+
+	SpectrogramView::SpectrogramView():
+		m_capacity(SPECTROGRAM_MIN_TILES),
+		m_pbo(0),
+		m_generation(0),
+		m_frame(0)
+	{
+		glGenBuffers(1, &m_pbo);
+	}
+
+	SpectrogramView::~SpectrogramView()
+	{
+		for (const Tile& tile: m_tiles)
+			glDeleteTextures(1, &tile.texture);
+		glDeleteBuffers(1, &m_pbo);
+	}
+
+	/*
+	 * Draws [from, to) of the spectrogram (as fractions of its length) into the given screen rectangle
+	 */
+	void SpectrogramView::Draw(const SpectrogramPyramid& pyramid, float x0, float y0, float x1, float y1, float from, float to)
+	{
+		m_frame++;
+		if (pyramid.GetGeneration() != m_generation)
+		{
+			// The textures can be reused, just not what's in them
+			m_resident.clear();
+			for (Tile& tile: m_tiles)
+				tile.key = ~0ull;
+			m_generation = pyramid.GetGeneration();
+		}
+		if (!pyramid.GetLevels() || x1 <= x0 || y1 <= y0 || to <= from)
+			return;
+
+		// The coarsest level that still has at least one cell per pixel both ways
+		float cells_per_pixel = std::min(
+			pyramid.GetWidth(0) * (to - from) / (x1 - x0),
+			pyramid.GetHeight(0) / (y1 - y0)
+		);
+		int level = std::clamp((int) floorf(log2f(std::max(cells_per_pixel, 1.0f))), 0, pyramid.GetLevels() - 1);
+
+		// Zoomed far in one way but not the other, that level can take more tiles than is sensible to keep around
+		int width, height, tiles_x, tiles_y, first_tx, last_tx;
+		float first_col, last_col;
+		for (;; level++)
+		{
+			width = pyramid.GetWidth(level);
+			height = pyramid.GetHeight(level);
+			first_col = from * width;
+			last_col = to * width;
+			tiles_x = (width + SPECTROGRAM_TILE_SIZE - 1) / SPECTROGRAM_TILE_SIZE;
+			tiles_y = (height + SPECTROGRAM_TILE_SIZE - 1) / SPECTROGRAM_TILE_SIZE;
+			first_tx = std::max(0, (int) (first_col / SPECTROGRAM_TILE_SIZE));
+			last_tx = std::min(tiles_x - 1, (int) (last_col / SPECTROGRAM_TILE_SIZE));
+			if ((size_t) (last_tx - first_tx + 1) * tiles_y <= SPECTROGRAM_MAX_VISIBLE_TILES || level == pyramid.GetLevels() - 1)
+				break;
+		}
+
+		// Enough for every visible tile, plus the coarser ones standing in for them (a third as many at most) and a little
+		// to scroll back into
+		size_t visible = (size_t) (last_tx - first_tx + 1) * tiles_y;
+		m_capacity = std::max(SPECTROGRAM_MIN_TILES, visible + visible / 2);
+
+		float px_per_col = (x1 - x0) / (last_col - first_col);
+		float px_per_row = (y1 - y0) / height;
+
+		ImDrawList* draw_list = ImGui::GetWindowDrawList();
+		draw_list->PushClipRect({ x0, y0 }, { x1, y1 }, true);
+
+		int uploads_left = SPECTROGRAM_UPLOADS_PER_FRAME;
+		for (int tx = first_tx; tx <= last_tx; tx++)
+		{
+			for (int ty = 0; ty < tiles_y; ty++)
+			{
+				// Screen rectangle for this tile's cells
+				int col = tx * SPECTROGRAM_TILE_SIZE;
+				int row = ty * SPECTROGRAM_TILE_SIZE;
+				int cols = std::min(SPECTROGRAM_TILE_SIZE, width - col);
+				int rows = std::min(SPECTROGRAM_TILE_SIZE, height - row);
+				ImVec2 p0(x0 + (col - first_col) * px_per_col, y0 + row * px_per_row);
+				ImVec2 p1(p0.x + cols * px_per_col, p0.y + rows * px_per_row);
+
+				// Fall back on coarser tiles covering the same area until this one is uploaded
+				for (int l = level; l < pyramid.GetLevels(); l++)
+				{
+					int shift = l - level;
+					int no_uploads = 0;
+					const Tile* tile = Acquire(pyramid, l, tx >> shift, ty >> shift, l == level ? uploads_left : no_uploads);
+					if (!tile)
+						continue;
+
+					// Where our cells sit inside the coarser tile, in texture coordinates
+					float scale = 1.0f / (1 << shift);
+					float u0 = (col * scale - (tx >> shift) * SPECTROGRAM_TILE_SIZE) / SPECTROGRAM_TILE_SIZE;
+					float v0 = (row * scale - (ty >> shift) * SPECTROGRAM_TILE_SIZE) / SPECTROGRAM_TILE_SIZE;
+					float u1 = u0 + cols * scale / SPECTROGRAM_TILE_SIZE;
+					float v1 = v0 + rows * scale / SPECTROGRAM_TILE_SIZE;
+					draw_list->AddImage(reinterpret_cast<void*>(tile->texture), p0, p1, { u0, v0 }, { u1, v1 });
+					break;
+				}
+			}
+		}
+
+		draw_list->PopClipRect();
+	}
+
+	/*
+	 * The tile's texture, uploading it first if it's not there yet and the frame's upload budget allows
+	 */
+	const SpectrogramView::Tile* SpectrogramView::Acquire(const SpectrogramPyramid& pyramid, int level, int tx, int ty, int& uploads_left)
+	{
+		uint64 key = TileKey(level, tx, ty);
+		auto resident = m_resident.find(key);
+		if (resident != m_resident.end())
+		{
+			Tile& tile = m_tiles[resident->second];
+			tile.last_used = m_frame;
+			return &tile;
+		}
+		if (uploads_left <= 0)
+			return nullptr;
+
+		size_t slot;
+		if (m_tiles.size() < m_capacity)
+		{
+			Tile tile = { ~0ull, 0, 0 };
+			glGenTextures(1, &tile.texture);
+			glBindTexture(GL_TEXTURE_2D, tile.texture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SPECTROGRAM_TILE_SIZE, SPECTROGRAM_TILE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			glBindTexture(GL_TEXTURE_2D, 0);
+
+			slot = m_tiles.size();
+			m_tiles.push_back(tile);
+		}
+		else
+		{
+			// Evict the least recently drawn tile, as long as it wasn't drawn this frame
+			slot = std::min_element(m_tiles.begin(), m_tiles.end(), [](const Tile& a, const Tile& b)
+			{
+				return a.last_used < b.last_used;
+			}) - m_tiles.begin();
+			if (m_tiles[slot].last_used == m_frame)
+				return nullptr;
+			m_resident.erase(m_tiles[slot].key);
+		}
+
+		Tile& tile = m_tiles[slot];
+		Upload(pyramid, level, tx, ty, tile.texture);
+		tile.key = key;
+		tile.last_used = m_frame;
+		m_resident[key] = slot;
+		uploads_left--;
+
+		return &tile;
+	}
+
+	void SpectrogramView::Upload(const SpectrogramPyramid& pyramid, int level, int tx, int ty, GLuint texture)
+	{
+		int col = tx * SPECTROGRAM_TILE_SIZE;
+		int row = ty * SPECTROGRAM_TILE_SIZE;
+		int cols = std::min(SPECTROGRAM_TILE_SIZE, pyramid.GetWidth(level) - col);
+		int rows = std::min(SPECTROGRAM_TILE_SIZE, pyramid.GetHeight(level) - row);
+		size_t size = (size_t) SPECTROGRAM_TILE_SIZE * SPECTROGRAM_TILE_SIZE * 4;
+
+		// Orphaning the buffer means we never wait for the GPU to finish with the previous tile
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		byte* pixels = static_cast<byte*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+		if (pixels)
+		{
+			const uint8* palette = Palette();
+			for (int r = 0; r < rows; r++)
+			{
+				const uint8* cells = pyramid.GetRow(level, row + r) + col;
+				byte* dst = pixels + (size_t) r * SPECTROGRAM_TILE_SIZE * 4;
+				for (int c = 0; c < cols; c++)
+					memcpy(dst + c * 4, palette + cells[c] * 4, 4);
+			}
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, SPECTROGRAM_TILE_SIZE);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cols, rows, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+}
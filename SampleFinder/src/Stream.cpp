@@ -0,0 +1,246 @@
+#include "SampleFinder.h"
+
+#include <algorithm>
+#include <filesystem>
+
+#include <opencv2/opencv.hpp>
+
+namespace
+{
+	int SpectrumBins()
+	{
+		// One-sided; same as AudioFile::Process
+		if (finder::settings.default_window_size % 2)
+			return (finder::settings.default_window_size + 1) / 2;
+		return finder::settings.default_window_size / 2 + 1;
+	}
+}
+
+namespace finder
+{
+	StreamRecognizer::StreamRecognizer(const AudioLibrary& library, const std::string& name):
+		m_library(library),
+		m_snapshot(library.GetSnapshot()),
+		m_name(std::filesystem::path(name).filename().string()),
+		m_samples_fed(0),
+		m_next_peak(0),
+		m_column_base(0),
+		m_peaks_done(0),
+		m_best_aligned(0),
+		m_runner_up_aligned(0),
+		m_best_sid(nullptr),
+		m_finished(false)
+	{
+		// Hashes made with other settings would never line up with the index, so there's nothing to match against
+		if (CheckProfile(*m_snapshot) == SUCCESS)
+			m_index = m_snapshot->index;
+
+		// Same skip-self rule as AudioLibrary::Query
+		if (m_index)
+		{
+			m_skip.resize(m_index->tracks.size(), false);
+			for (size_t i = 0; i < m_index->tracks.size(); i++)
+				m_skip[i] = !m_name.empty() && m_index->tracks[i] && std::filesystem::path(m_index->tracks[i]->path).filename().string() == m_name;
+		}
+	}
+
+	void StreamRecognizer::Feed(const float* samples, size_t count)
+	{
+		if (m_finished)
+			return;
+
+		m_pending.insert(m_pending.end(), samples, samples + count);
+		m_samples_fed += count;
+
+		// Frame whatever we can. The last (window - hop) samples stay pending since they overlap with the next frame.
+		size_t window = settings.default_window_size;
+		size_t overlap = settings.default_window_size * settings.default_overlap_ratio;
+		if (m_pending.size() < window)
+			return;
+
+		// Frames line up with a whole-file run, only the DC bin depends on the chunking (see HashPeaks)
+		cv::Mat spectrogram;
+		ComputeSpectrogram(m_pending, spectrogram);
+		size_t consumed = spectrogram.cols * (window - overlap);
+		m_pending.erase(m_pending.begin(), m_pending.begin() + consumed);
+
+		AppendColumns(spectrogram);
+		FinalizePeaks(false);
+		HashPeaks(false);
+	}
+
+	void StreamRecognizer::Finish()
+	{
+		if (m_finished)
+			return;
+
+		FinalizePeaks(true);
+		HashPeaks(true);
+		m_finished = true;
+	}
+
+	bool StreamRecognizer::Confident() const
+	{
+		if (m_best_aligned < settings.stream_min_aligned)
+			return false;
+
+		return m_best_aligned >= m_runner_up_aligned * settings.stream_confidence_margin;
+	}
+
+	void StreamRecognizer::Rank(int topn, std::vector<FoundSong>& songs_result) const
+	{
+		songs_result.clear();
+		if (m_hashes.empty())
+			return;
+
+		// Reuse the library's ranking so streamed results are comparable with AudioLibrary::TestSong
+		m_library.AlignMatches(*m_snapshot, m_results, m_hashes.size(), topn, songs_result);
+	}
+
+	float StreamRecognizer::GetSecondsFed() const
+	{
+		return m_samples_fed / settings.fs;
+	}
+
+	int StreamRecognizer::GetHashCount() const
+	{
+		return m_hashes.size();
+	}
+
+	//
+
+	void StreamRecognizer::AppendColumns(const cv::Mat& spectrogram)
+	{
+		for (int j = 0; j < spectrogram.cols; j++)
+		{
+			m_columns.emplace_back(spectrogram.rows);
+			std::vector<float>& column = m_columns.back();
+			for (int i = 0; i < spectrogram.rows; i++)
+				column[i] = spectrogram.at<float>(i, j);
+		}
+	}
+
+	/*
+	 * A peak only depends on the spectrogram within peak_neighborhood_size columns of it, so everything up to that distance
+	 * from the newest column can be settled now. The columns kept around are just enough context for the next slab.
+	 */
+	void StreamRecognizer::FinalizePeaks(bool flush)
+	{
+		int neighborhood = settings.peak_neighborhood_size;
+		int available = m_column_base + m_columns.size();
+		int final_upto = flush ? available : available - neighborhood;
+		if (final_upto <= m_peaks_done)
+			return;
+
+		int slab_start = std::max(m_column_base, m_peaks_done - neighborhood);
+		cv::Mat slab(SpectrumBins(), available - slab_start, CV_32F);
+		for (int j = 0; j < slab.cols; j++)
+		{
+			const std::vector<float>& column = m_columns[slab_start - m_column_base + j];
+			for (int i = 0; i < slab.rows; i++)
+				slab.at<float>(i, j) = column[i];
+		}
+
+		std::vector<std::pair<int, int>> found;
+		Get2DPeaks(slab, found);
+
+		// Keep the newly settled ones, same (time, frequency) order GenerateHashes sorts into
+		size_t first_new = m_peaks.size();
+		for (const auto& [freq, time]: found)
+		{
+			int t = time + slab_start;
+			if (t >= m_peaks_done && t < final_upto)
+				m_peaks.push_back({freq, t});
+		}
+		std::sort(m_peaks.begin() + first_new, m_peaks.end(), [](auto& left, auto& right)
+		{
+			if (left.second == right.second)
+				return left.first < right.first;
+			return left.second < right.second;
+		});
+		m_peaks_done = final_upto;
+
+		// Drop the columns no future slab can reach
+		int keep_from = std::max(m_column_base, m_peaks_done - neighborhood);
+		m_columns.erase(m_columns.begin(), m_columns.begin() + (keep_from - m_column_base));
+		m_column_base = keep_from;
+	}
+
+	/*
+	 * Peaks are paired with the next (fan value - 1) peaks, so a peak can only be hashed once that many settled peaks follow
+	 * it, the same pairs GenerateHashes would make. The hashes aren't guaranteed to match a whole-file run though: the
+	 * spectrogram is computed per chunk, and ComputeSpectrogram's detrend shifts the DC bin by the mean of whatever it's
+	 * given, so peaks in that bin can come and go depending on how the input was chunked.
+	 */
+	void StreamRecognizer::HashPeaks(bool flush)
+	{
+		int fan = settings.default_fan_value;
+		for (; m_next_peak < m_peaks.size(); m_next_peak++)
+		{
+			if (!flush && m_next_peak + fan - 1 >= m_peaks.size())
+				break;
+
+			for (int j = 1; j < fan; j++)
+			{
+				if (m_next_peak + j >= m_peaks.size())
+					continue;
+
+				int freq1 = m_peaks[m_next_peak].first;
+				int freq2 = m_peaks[m_next_peak + j].first;
+				int time1 = m_peaks[m_next_peak].second;
+				int time2 = m_peaks[m_next_peak + j].second;
+				int t_delta = time2 - time1;
+				if ((t_delta >= settings.min_hash_time_delta) && (t_delta <= settings.max_hash_time_delta))
+					AddHash(HashPeakPair(freq1, freq2, t_delta), time1);
+			}
+		}
+
+		// Hashed peaks are only needed as partners for the ones still waiting
+		if (m_next_peak >= fan && m_next_peak > 4096)
+		{
+			size_t drop = m_next_peak - fan;
+			m_peaks.erase(m_peaks.begin(), m_peaks.begin() + drop);
+			m_next_peak -= drop;
+		}
+	}
+
+	void StreamRecognizer::AddHash(const std::string& hash, int offset)
+	{
+		// Like a fingerprint's hash map, only the first occurrence of a hash counts
+		if (!m_hashes.emplace(hash, offset).second)
+			return;
+
+		if (!m_index)
+			return;
+
+		uint64 key = HashKey(hash);
+		for (const auto& shard: m_index->shards)
+		{
+			auto [first, last] = shard->Find(key);
+			for (const Posting* p = first; p != last; p++)
+			{
+				if (m_skip[p->track])
+					continue;
+
+				SID sid = m_index->tracks[p->track].get();
+				int offset_diff = p->offset - offset;
+				m_results.dedups[sid]++;
+				m_results.matches.push_back({sid, offset_diff});
+
+				// Track how many hashes line up at the same offset for this song, which is what tells a real match from noise
+				int aligned = ++m_histograms[sid][offset_diff];
+				if (aligned > m_best_aligned)
+				{
+					if (sid != m_best_sid)
+						m_runner_up_aligned = m_best_aligned;
+					m_best_aligned = aligned;
+					m_best_sid = sid;
+				}
+				else if (sid != m_best_sid && aligned > m_runner_up_aligned)
+				{
+					m_runner_up_aligned = aligned;
+				}
+			}
+		}
+	}
+}
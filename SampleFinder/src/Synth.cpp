@@ -0,0 +1,170 @@
+#include "SampleFinder.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+	constexpr double TWO_PI = 6.283185307179586;
+	constexpr float FULL_SCALE = 32767.0f; // Samples are kept at 16-bit scale, same as AudioFile::Load leaves them
+	constexpr float HEADROOM = 0.5f;
+	constexpr int CHORD_MIN_NOTES = 3;
+	constexpr int CHORD_MAX_NOTES = 5;
+	constexpr int CHORD_HARMONICS = 4;
+
+	const char* SIGNAL_NAMES[finder::SIGNAL_KIND_COUNT] = {
+		"sweep",
+		"noise",
+		"chords"
+	};
+
+	/*
+	 * splitmix64, so a seed gives the same signal whatever standard library we're built against
+	 */
+	class Random
+	{
+	public:
+		Random(finder::uint64 seed):
+			m_state(seed)
+		{
+		}
+
+		finder::uint64 Next()
+		{
+			finder::uint64 z = (m_state += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+		// [0, 1)
+		double Uniform()
+		{
+			return (Next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		double Uniform(double lo, double hi)
+		{
+			return lo + (hi - lo) * Uniform();
+		}
+
+	private:
+		finder::uint64 m_state;
+
+	};
+
+	/*
+	 * Exponential sweep between two frequencies picked by the seed, bouncing back down so long signals don't end up
+	 * parked at the top
+	 */
+	void Sweep(Random& random, float rate, std::vector<float>& out)
+	{
+		double lo = random.Uniform(60.0, 400.0);
+		double hi = std::min(random.Uniform(2000.0, 8000.0), rate * 0.45);
+		double period = random.Uniform(2.0, 6.0) * rate; // Samples per full up-and-down
+
+		double phase = 0.0;
+		for (size_t i = 0; i < out.size(); i++)
+		{
+			double t = fmod(i / period, 1.0);
+			double position = t < 0.5 ? t * 2.0 : 2.0 - t * 2.0;
+			double freq = lo * pow(hi / lo, position);
+			phase += TWO_PI * freq / rate;
+			out[i] = (float) sin(phase);
+		}
+	}
+
+	void Noise(Random& random, std::vector<float>& out)
+	{
+		for (float& v: out)
+			v = (float) random.Uniform(-1.0, 1.0);
+	}
+
+	/*
+	 * A run of chords of a few notes each, every note with a handful of decaying harmonics. This is the closest of the
+	 * three to what the library actually holds.
+	 */
+	void Chords(Random& random, float rate, std::vector<float>& out)
+	{
+		size_t i = 0;
+		while (i < out.size())
+		{
+			size_t length = std::min(out.size() - i, (size_t) (random.Uniform(0.25, 1.0) * rate));
+			int notes = CHORD_MIN_NOTES + (int) (random.Next() % (CHORD_MAX_NOTES - CHORD_MIN_NOTES + 1));
+
+			double freqs[CHORD_MAX_NOTES];
+			double phases[CHORD_MAX_NOTES];
+			for (int n = 0; n < notes; n++)
+			{
+				int midi = 36 + (int) (random.Next() % 48);
+				freqs[n] = 440.0 * pow(2.0, (midi - 69) / 12.0);
+				phases[n] = random.Uniform(0.0, TWO_PI);
+			}
+
+			double decay = random.Uniform(1.0, 4.0) / rate;
+			for (size_t s = 0; s < length; s++)
+			{
+				double t = (double) s / rate;
+				double value = 0.0;
+				for (int n = 0; n < notes; n++)
+				{
+					for (int h = 1; h <= CHORD_HARMONICS; h++)
+					{
+						double freq = freqs[n] * h;
+						if (freq < rate * 0.5)
+							value += sin(phases[n] * h + TWO_PI * freq * t) / h;
+					}
+				}
+				// Short attack so chord changes don't click across the whole spectrum
+				double envelope = std::min(1.0, s / (0.005 * rate)) * exp(-(double) s * decay);
+				out[i + s] = (float) (value * envelope / notes);
+			}
+			i += length;
+		}
+	}
+}
+
+namespace finder
+{
+	const char* SignalKindName(SignalKind kind)
+	{
+		return SIGNAL_NAMES[kind];
+	}
+
+	/*
+	 * Deterministic test audio, so benchmarks and accuracy runs see the same input on every run and every machine
+	 */
+	void SynthesizeSignal(SignalKind kind, uint64 seed, float seconds, float rate, std::vector<float>& out)
+	{
+		out.assign((size_t) std::max(0.0f, seconds * rate), 0.0f);
+
+		// Mixing the kind in means track 1 of one kind isn't track 1 of another in disguise
+		Random random(seed * SIGNAL_KIND_COUNT + kind);
+		switch (kind)
+		{
+		case SIGNAL_SWEEP:
+			Sweep(random, rate, out);
+			break;
+		case SIGNAL_NOISE:
+			Noise(random, out);
+			break;
+		case SIGNAL_CHORDS:
+			Chords(random, rate, out);
+			break;
+		default:
+			break;
+		}
+
+		float peak = 0.0f;
+		for (float v: out)
+			peak = std::max(peak, fabsf(v));
+		if (peak > 0.0f)
+		{
+			float scale = FULL_SCALE * HEADROOM / peak;
+			for (float& v: out)
+				v *= scale;
+		}
+	}
+}
@@ -0,0 +1,290 @@
+#include "SampleFinder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace
+{
+	constexpr int TUNE_FORMAT_VERSION = 1;
+
+	// The grid to search. fingerprint_reduction stays put: the cache format assumes 20 character hashes.
+	const int FAN_VALUES[] = { 5, 10, 15, 20, 30 };
+	const int NEIGHBORHOOD_SIZES[] = { 10, 15, 20, 30 };
+	const float AMP_MINS[] = { -60.0f, -48.0f, -36.0f };
+	const int WINDOW_SIZES[] = { 2048, 4096, 8192 };
+	const float OVERLAP_RATIOS[] = { 0.25f, 0.5f, 0.75f };
+
+	template <class T, size_t N>
+	constexpr size_t Count(const T (&)[N])
+	{
+		return N;
+	}
+
+	const size_t GRID_SIZE = Count(FAN_VALUES) * Count(NEIGHBORHOOD_SIZES) * Count(AMP_MINS) * Count(WINDOW_SIZES) * Count(OVERLAP_RATIOS);
+
+	enum Preference
+	{
+		PREFER_LATENCY,
+		PREFER_THROUGHPUT,
+		PREFER_SIZE
+	};
+
+	struct Trial
+	{
+		finder::Settings settings;
+		finder::HarnessReport report;
+		bool pareto = false;
+	};
+
+	/*
+	 * Everything but the searched values comes from base
+	 */
+	finder::Settings GridPoint(const finder::Settings& base, size_t index)
+	{
+		finder::Settings out = base;
+		out.default_fan_value = FAN_VALUES[index % Count(FAN_VALUES)];
+		index /= Count(FAN_VALUES);
+		out.peak_neighborhood_size = NEIGHBORHOOD_SIZES[index % Count(NEIGHBORHOOD_SIZES)];
+		index /= Count(NEIGHBORHOOD_SIZES);
+		out.default_amp_min = AMP_MINS[index % Count(AMP_MINS)];
+		index /= Count(AMP_MINS);
+		out.default_window_size = WINDOW_SIZES[index % Count(WINDOW_SIZES)];
+		index /= Count(WINDOW_SIZES);
+		out.default_overlap_ratio = OVERLAP_RATIOS[index % Count(OVERLAP_RATIOS)];
+		return out;
+	}
+
+	double Recall(const finder::HarnessReport& report)
+	{
+		return report.overall.queries ? (double) report.overall.top1 / report.overall.queries : 0.0;
+	}
+
+	double Throughput(const finder::HarnessReport& report)
+	{
+		return report.fingerprint_seconds > 0.0 ? report.audio_seconds / report.fingerprint_seconds : 0.0;
+	}
+
+	/*
+	 * At least as good on recall, fingerprinting throughput, query latency and index size, and better on one of them
+	 */
+	bool Dominates(const finder::HarnessReport& a, const finder::HarnessReport& b)
+	{
+		bool no_worse = Recall(a) >= Recall(b) && Throughput(a) >= Throughput(b) && a.latency_p50 <= b.latency_p50 && a.index_bytes <= b.index_bytes;
+		bool better = Recall(a) > Recall(b) || Throughput(a) > Throughput(b) || a.latency_p50 < b.latency_p50 || a.index_bytes < b.index_bytes;
+		return no_worse && better;
+	}
+
+	bool Prefer(Preference preference, const finder::HarnessReport& a, const finder::HarnessReport& b)
+	{
+		switch (preference)
+		{
+		case PREFER_THROUGHPUT:
+			return Throughput(a) > Throughput(b);
+		case PREFER_SIZE:
+			return a.index_bytes < b.index_bytes;
+		default:
+			return a.latency_p50 < b.latency_p50;
+		}
+	}
+
+	nlohmann::json TrialJson(const Trial& trial)
+	{
+		char profile[17];
+		snprintf(profile, sizeof(profile), "%016llx", (unsigned long long) finder::SettingsProfile(trial.settings));
+
+		nlohmann::json json;
+		json["settings_profile"] = profile;
+		json["default_fan_value"] = trial.settings.default_fan_value;
+		json["peak_neighborhood_size"] = trial.settings.peak_neighborhood_size;
+		json["default_amp_min"] = trial.settings.default_amp_min;
+		json["default_window_size"] = trial.settings.default_window_size;
+		json["default_overlap_ratio"] = trial.settings.default_overlap_ratio;
+		json["recall_at_1"] = Recall(trial.report);
+		json["recall_at_10"] = trial.report.overall.queries ? (double) trial.report.overall.top10 / trial.report.overall.queries : 0.0;
+		json["fingerprint_audio_seconds_per_s"] = Throughput(trial.report);
+		json["latency_p50_s"] = trial.report.latency_p50;
+		json["latency_p99_s"] = trial.report.latency_p99;
+		json["index_bytes"] = trial.report.index_bytes;
+		json["library_hashes"] = trial.report.library_hashes;
+		json["pareto"] = trial.pareto;
+		return json;
+	}
+
+	void PrintTrial(size_t i, const Trial& trial, bool chosen)
+	{
+		fprintf(stderr, "%c%c%3zu %4d %5d %6.0f %7d %8.2f %9.1f%% %9.1f%% %10.1f %8.2f %9.1f\n",
+			chosen ? '>' : ' ', trial.pareto ? '*' : ' ', i,
+			trial.settings.default_fan_value,
+			trial.settings.peak_neighborhood_size,
+			trial.settings.default_amp_min,
+			trial.settings.default_window_size,
+			trial.settings.default_overlap_ratio,
+			Recall(trial.report) * 100.0,
+			trial.report.overall.queries ? 100.0 * trial.report.overall.top10 / trial.report.overall.queries : 0.0,
+			Throughput(trial.report),
+			trial.report.latency_p50 * 1000.0,
+			trial.report.index_bytes / (1024.0 * 1024.0));
+	}
+}
+
+namespace finder
+{
+	/*
+	 * Runs the accuracy harness over a grid (or a random sample of it) of fingerprint settings, starting with the current
+	 * ones, on synthetic tracks or on real ones with --library. Of the Pareto-optimal trials that keep recall@1 at or above
+	 * --min-recall (by default, whatever the current settings get), picks the best by --prefer. Nothing is written unless
+	 * asked: --save writes the pick to ./settings.json, --save=<path> somewhere else. Ranking and streaming settings are
+	 * carried over as they are, they don't change what's being measured.
+	 */
+	int RunTuning(const std::vector<std::string>& args)
+	{
+		HarnessOptions options;
+		int num_trials = 0;
+		float min_recall_option = 0.0f;
+		if (GetHarnessOptions(args, options) == FAILURE ||
+			GetIntOption(args, "trials", 20, num_trials) == FAILURE ||
+			GetFloatOption(args, "min-recall", -1.0f, min_recall_option) == FAILURE)
+		{
+			PrintUsage();
+			return EXIT_FAILURE;
+		}
+		bool full_grid = std::find(args.begin(), args.end(), "--grid") != args.end();
+		bool save = std::find(args.begin(), args.end(), "--save") != args.end();
+		std::string save_path = GetOption(args, "save", save ? "./settings.json" : "");
+		std::string json_path = GetOption(args, "json", "");
+
+		std::string prefer_option = GetOption(args, "prefer", "latency");
+		Preference preference = PREFER_LATENCY;
+		if (prefer_option == "throughput")
+			preference = PREFER_THROUGHPUT;
+		else if (prefer_option == "size")
+			preference = PREFER_SIZE;
+		else if (prefer_option != "latency")
+		{
+			std::cerr << "Unknown preference: " << prefer_option << " (latency, throughput or size)" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		// The current settings always go first, as the baseline
+		const Settings base = settings;
+		std::vector<Trial> trials(1);
+		trials[0].settings = base;
+		std::unordered_set<uint64> seen = { SettingsProfile(base) };
+
+		std::vector<size_t> points(GRID_SIZE);
+		for (size_t i = 0; i < GRID_SIZE; i++)
+			points[i] = i;
+		if (!full_grid)
+		{
+			std::mt19937_64 random(options.seed);
+			for (size_t i = GRID_SIZE - 1; i > 0; i--)
+				std::swap(points[i], points[random() % (i + 1)]);
+		}
+		for (size_t point: points)
+		{
+			if (!full_grid && trials.size() >= (size_t) std::max(num_trials, 1))
+				break;
+
+			Trial trial;
+			trial.settings = GridPoint(base, point);
+			if (seen.insert(SettingsProfile(trial.settings)).second)
+				trials.push_back(trial);
+		}
+
+		for (size_t i = 0; i < trials.size(); i++)
+		{
+			Trial& trial = trials[i];
+			fprintf(stderr, "Trial %zu/%zu: fan %d, neighborhood %d, amp min %.0f, window %d, overlap %.2f\n", i + 1, trials.size(),
+				trial.settings.default_fan_value, trial.settings.peak_neighborhood_size, trial.settings.default_amp_min,
+				trial.settings.default_window_size, trial.settings.default_overlap_ratio);
+
+			settings = trial.settings;
+			ErrCode result = EvaluateAccuracy(options, trial.report);
+			settings = base;
+			if (result == FAILURE)
+				return EXIT_FAILURE;
+		}
+
+		for (Trial& trial: trials)
+		{
+			trial.pareto = std::none_of(trials.begin(), trials.end(), [&trial](const Trial& other)
+			{
+				return Dominates(other.report, trial.report);
+			});
+		}
+
+		double min_recall = min_recall_option < 0.0f ? Recall(trials[0].report) : min_recall_option;
+		size_t chosen = trials.size();
+		for (size_t i = 0; i < trials.size(); i++)
+		{
+			if (!trials[i].pareto || Recall(trials[i].report) < min_recall)
+				continue;
+			if (chosen == trials.size() || Prefer(preference, trials[i].report, trials[chosen].report))
+				chosen = i;
+		}
+		if (chosen == trials.size())
+		{
+			// Nothing clears the bar, so go for whatever recalls best. The most recalling trial is always on the front.
+			chosen = 0;
+			for (size_t i = 1; i < trials.size(); i++)
+			{
+				if (Recall(trials[i].report) > Recall(trials[chosen].report))
+					chosen = i;
+			}
+		}
+
+		fprintf(stderr, "\n    # %4s %5s %6s %7s %8s %10s %10s %10s %8s %9s\n",
+			"fan", "nbhd", "amp", "window", "overlap", "recall@1", "recall@10", "audio s/s", "p50 ms", "index MB");
+		for (size_t i = 0; i < trials.size(); i++)
+			PrintTrial(i, trials[i], i == chosen);
+		fprintf(stderr, "\n* Pareto front, > chosen (recall@1 >= %.1f%%, then best %s). Trial 0 is the current settings.\n",
+			min_recall * 100.0, prefer_option.c_str());
+
+		if (!json_path.empty())
+		{
+			nlohmann::json json;
+			json["version"] = TUNE_FORMAT_VERSION;
+			json["seed"] = options.seed;
+			if (!options.library_path.empty())
+				json["library"] = options.library_path;
+			json["tracks"] = options.tracks;
+			json["seconds"] = options.seconds;
+			json["queries_per_distortion"] = options.queries;
+			json["clip_seconds"] = options.clip_seconds;
+			json["min_recall"] = min_recall;
+			json["prefer"] = prefer_option;
+			json["chosen"] = chosen;
+			json["trials"] = nlohmann::json::array();
+			for (const Trial& trial: trials)
+				json["trials"].push_back(TrialJson(trial));
+
+			if (SaveTextFile(json_path, json.dump(2) + "\n") == FAILURE)
+				return EXIT_FAILURE;
+		}
+
+		if (chosen == 0)
+		{
+			std::cerr << "The current settings are already the best choice" << std::endl;
+			return EXIT_SUCCESS;
+		}
+		if (save_path.empty())
+		{
+			std::cerr << "Pass --save to write trial " << chosen << " to ./settings.json, or --save=<path> to write it elsewhere" << std::endl;
+			return EXIT_SUCCESS;
+		}
+		if (SaveSettings(save_path, trials[chosen].settings) == FAILURE)
+			return EXIT_FAILURE;
+		settings = trials[chosen].settings;
+		std::cerr << "Wrote trial " << chosen << " to " << save_path << ". Libraries will be fingerprinted again the next time they load." << std::endl;
+
+		return EXIT_SUCCESS;
+	}
+}
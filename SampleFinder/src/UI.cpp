@@ -1,6 +1,9 @@
 #include "SampleFinder.h"
 
+#include <math.h>
+
 #include <iostream>
+#include <algorithm>
 #include <filesystem>
 
 #ifdef _WIN32
@@ -26,6 +29,14 @@ namespace
 	constexpr const char* WIN_ID_MISSING_SAMPLE = "Missing Sample";
 	constexpr const char* WIN_ID_MATCHES = "Matches";
 
+	constexpr int MATCHES_QUERIED = 1000; // The list only draws what's on screen, so it can afford a long tail
+	constexpr size_t PREVIEWS_PREFETCHED = 10;
+	constexpr float PREVIEW_MIN_SECONDS = 2.0f;
+	constexpr float PREVIEW_MAX_SECONDS = 10.0f;
+
+	constexpr float VIEW_ZOOM_STEP = 1.25f; // Per mouse wheel notch
+	constexpr float VIEW_MIN_SECONDS = 0.05f;
+
 	void* TexID(const finder::Texture& texture)
 	{
 		return reinterpret_cast<void*>(texture.GetGLID());
@@ -63,23 +74,99 @@ namespace
 
 		return out;
 	}
+
+	// What a sample job produces on its worker thread, for the render thread to swap in
+	struct LoadedSample
+	{
+		std::shared_ptr<finder::AudioFile> file;
+		std::unique_ptr<finder::Bitmap> waveform;
+		finder::SpectrogramPyramid spectrogram;
+		bool failed = false;
+	};
+
+	const char* StageName(int stage)
+	{
+		switch (stage)
+		{
+		case finder::STAGE_LOADING:
+			return "Loading";
+		case finder::STAGE_FINGERPRINTING:
+			return "Fingerprinting";
+		case finder::STAGE_INDEXING:
+			return "Indexing";
+		case finder::STAGE_SAVING:
+			return "Saving";
+		default:
+			return nullptr;
+		}
+	}
+
+	/*
+	 * Milliseconds per stage, one row per thread or track
+	 */
+	void RenderProfileTable(const char* id, const std::vector<finder::ProfileRow>& rows, size_t max_rows)
+	{
+		ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollX | ImGuiTableFlags_SizingFixedFit;
+		if (!ImGui::BeginTable(id, 2 + finder::PROFILE_STAGE_COUNT, flags))
+			return;
+
+		ImGui::TableSetupColumn("");
+		ImGui::TableSetupColumn("Total ms");
+		for (int s = 0; s < finder::PROFILE_STAGE_COUNT; s++)
+			ImGui::TableSetupColumn(finder::ProfileStageName((finder::ProfileStage) s));
+		ImGui::TableHeadersRow();
+
+		for (size_t r = 0; r < std::min(rows.size(), max_rows); r++)
+		{
+			const finder::ProfileRow& row = rows[r];
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::Text("%s", std::filesystem::path(row.name).filename().string().c_str());
+			ImGui::TableNextColumn();
+			ImGui::Text("%.1f", row.total_ns / 1e6);
+			for (int s = 0; s < finder::PROFILE_STAGE_COUNT; s++)
+			{
+				ImGui::TableNextColumn();
+				if (row.calls[s])
+					ImGui::Text("%.1f", row.ns[s] / 1e6);
+			}
+		}
+
+		ImGui::EndTable();
+	}
+
+	float LibraryProgress(const finder::AudioLibrary& library)
+	{
+		// The two counters aren't read together, so keep a torn read from leaving the bar
+		return std::clamp((float) library.load_min / (float) std::max<int>(1, library.load_max), 0.0f, 1.0f);
+	}
+
+	// Long enough to hear the whole sample in context, but not the whole track
+	float PreviewSeconds(const finder::AudioFile& sample)
+	{
+		return std::clamp(sample.length, PREVIEW_MIN_SECONDS, PREVIEW_MAX_SECONDS);
+	}
 }
 
 namespace finder
 {
 	UI::UI():
+		m_missing(std::make_shared<AudioFile>()),
 		m_di_init(false),
 		m_show_about_window(false),
 		m_show_settings_window(true),
 		m_show_waveform(true),
-		m_show_spectrogram(false)
+		m_show_spectrogram(false),
+		m_view_from(0.0f),
+		m_view_to(1.0f),
+		m_loop_stats(),
+		m_profile_time(-1.0)
 	{
-		// Placeholder image for the waveform/spectrogram preview
+		// Placeholder image for the waveform preview
 		Bitmap bmp(255, 255);
 		for (int i = 0; i < bmp.width * bmp.height; i++)
 			bmp.px[i] = (bmp.height - i / bmp.height) << 24;
 		m_missing_waveform.Load(bmp);
-		m_missing_spectral.Load(bmp);
 
 		// Misc. assets
 		m_peak.Load("assets/peak.png");
@@ -92,6 +179,20 @@ namespace finder
 
 	void UI::Update()
 	{
+		m_jobs.Update();
+	}
+
+	/*
+	 * Nothing on screen moves by itself. Background jobs don't count, they wake the main loop when they make progress.
+	 */
+	bool UI::IsIdle() const
+	{
+		return !m_library.loading && !m_missing->IsPlaying() && !m_previews.IsPlaying();
+	}
+
+	void UI::SetLoopStats(const LoopStats& stats)
+	{
+		m_loop_stats = stats;
 	}
 
 	/*
@@ -157,6 +258,8 @@ namespace finder
 					OpenLibraryDialog();
 				if (ImGui::MenuItem("Save Library", "Ctrl+S"))
 					m_library.Save();
+				if (ImGui::MenuItem("Watch Library", nullptr, m_library.IsWatching(), !m_library.library_path.empty()))
+					m_library.Watch(!m_library.IsWatching());
 				ImGui::Separator();
 				if (ImGui::MenuItem("Exit", "Alt+F4"))
 					exit(EXIT_SUCCESS);
@@ -180,8 +283,9 @@ namespace finder
 			ImGui::EndMainMenuBar();
 		}
 
-		// Windows
-		if (!m_library.loading)
+		// Windows. Only loading takes the library away, processing and saving leave the last published state to work with.
+		bool replacing = m_library.loading && m_library.load_stage == STAGE_LOADING;
+		if (!replacing)
 		{
 			RenderLibrary();
 			RenderMissingSample();
@@ -192,10 +296,11 @@ namespace finder
 				RenderLibraryStats();
 			if (m_show_settings_window)
 				RenderSettings();
+			RenderJobs();
 		}
 
 		// Loading screen
-		if (m_library.loading)
+		if (replacing)
 		{
 			if (!ImGui::IsPopupOpen("Loading"))
 				ImGui::OpenPopup("Loading");
@@ -230,6 +335,23 @@ namespace finder
 		}
 	}
 
+	void UI::ExportTraceDialog()
+	{
+		nfdchar_t* out_path = nullptr;
+		nfdresult_t result = NFD_SaveDialog("json", nullptr, &out_path);
+		if (result == NFD_OKAY)
+		{
+			if (ExportChromeTrace(out_path) != SUCCESS)
+				ErrMsg("Failed to export the trace");
+
+			delete out_path;
+		}
+		else if (result == NFD_ERROR)
+		{
+			ErrMsg(NFD_GetError());
+		}
+	}
+
 	void UI::OpenLibraryDialog()
 	{
 		nfdchar_t* out_path = nullptr;
@@ -237,7 +359,18 @@ namespace finder
 		if (result == NFD_OKAY)
 		{
 			m_library_path = out_path;
-			m_library.Load(m_library_path);
+			if (m_library.Load(m_library_path) == SUCCESS)
+			{
+				// Results from the last library don't mean anything in this one
+				if (m_scan_job)
+					m_scan_job->cancelled = true;
+				m_matches.Clear();
+				m_matches_snapshot.reset();
+			}
+			else
+			{
+				ErrMsg("The library is busy, try again once it's done");
+			}
 
 			delete out_path;
 		}
@@ -251,17 +384,88 @@ namespace finder
 		}
 	}
 
+	/*
+	 * Decoding and analysis happen on a worker; the current sample stays up (and playable) until the new one is ready
+	 */
 	void UI::ReplaceSample(const std::string& path)
 	{
-		if (m_missing.Load(path, true) != finder::SUCCESS)
-			ErrMsg("Failed to load audio file");
+		// Whatever was loading before is out of date now
+		if (m_sample_job)
+			m_sample_job->cancelled = true;
+
+		std::shared_ptr<LoadedSample> loaded = std::make_shared<LoadedSample>();
+		std::string name = "Loading " + std::filesystem::path(path).filename().string();
+		m_sample_job = m_jobs.Submit(name, [loaded, path](Job& job)
+		{
+			loaded->file = std::make_shared<AudioFile>();
+			if (loaded->file->Load(path, true) != SUCCESS)
+			{
+				loaded->failed = true;
+				return;
+			}
+			job.SetProgress(0.4f);
+			if (job.cancelled)
+				return;
+
+			loaded->waveform = loaded->file->RenderWaveform();
+			job.SetProgress(0.5f);
+			if (job.cancelled)
+				return;
+
+			loaded->file->Process(&loaded->spectrogram);
+		},
+		[this, loaded]()
+		{
+			if (loaded->failed)
+			{
+				ErrMsg("Failed to load audio file");
+				return;
+			}
+
+			// A scan might still hold on to the old one, so make sure it's not left playing
+			m_missing->Stop();
+			m_missing = loaded->file;
+			m_missing_spectrogram = std::move(loaded->spectrogram);
+			m_missing_waveform.Load(*loaded->waveform);
+			m_view_from = 0.0f;
+			m_view_to = 1.0f;
+		});
+	}
+
+	void UI::ScanSample()
+	{
+		if (m_scan_job)
+			m_scan_job->cancelled = true;
+
+		// The matches point into this snapshot's tracks, so it's kept for as long as they're shown
+		std::shared_ptr<AudioFile> sample = m_missing;
+		std::shared_ptr<const LibrarySnapshot> snapshot = m_library.GetSnapshot();
+		std::shared_ptr<std::vector<FoundSong>> found = std::make_shared<std::vector<FoundSong>>();
+		std::shared_ptr<ErrCode> status = std::make_shared<ErrCode>(SUCCESS);
+		m_scan_job = m_jobs.Submit("Scanning library", [this, sample, snapshot, found, status](Job&)
+		{
+			*status = m_library.Query(*snapshot, sample->fingerprint, MATCHES_QUERIED, *found);
+		},
+		[this, sample, snapshot, found, status]()
+		{
+			if (*status == FAILURE)
+			{
+				ErrMsg("Fingerprint settings changed since the library was loaded. Reopen it to scan with them.");
+				return;
+			}
 
-		std::unique_ptr<Bitmap> waveform_bmp = m_missing.RenderWaveform();
-		m_missing_waveform.Load(*waveform_bmp);
+			m_matches.Assign(std::move(*found));
+			m_matches_snapshot = snapshot;
 
-		Bitmap bmp(1024, 512);
-		m_missing.Process(&bmp);
-		m_missing_spectral.Load(bmp);
+			// Decode what's likely to be auditioned while the results are being read
+			std::vector<std::pair<std::string, double>> starts;
+			for (size_t row = 0; row < std::min(m_matches.GetCount(), PREVIEWS_PREFETCHED); row++)
+			{
+				const FoundSong& match = m_matches.Get(row);
+				starts.emplace_back(match.sid->path, std::max(0.0f, match.offset_secs));
+			}
+			m_previews.Prefetch(starts, PreviewSeconds(*sample));
+		});
 	}
 
 	void UI::RenderLibrary()
@@ -277,19 +481,18 @@ namespace finder
 			ImGui::SameLine();
 			if (ImGui::Button("Process##library"))
 				m_library.Process();
-			if (m_missing.loaded)
+			if (m_missing->loaded)
 			{
 				ImGui::SameLine();
 				if (ImGui::Button("Scan##library"))
-					m_library.TestSong(m_missing);
+					ScanSample();
 			}
 			if (ImGui::BeginChild("##library_children"))
 			{
-				for (AudioFile& file: m_library.files)
+				std::shared_ptr<const LibrarySnapshot> snapshot = m_library.GetSnapshot();
+				for (const auto& [filename, processed]: snapshot->tracks)
 				{
-					std::string filename = std::filesystem::proximate(file.path, m_library_path).string();
-
-					int c = file.processed;
+					int c = processed;
 					if (c)
 						ImGui::PushStyleColor(ImGuiCol_Text, IM_COL32(0, 255, 0, 255));
 					ImGui::Text(filename.c_str());
@@ -305,7 +508,7 @@ namespace finder
 
 	void UI::RenderMissingSample()
 	{
-		if (ImGui::Begin(WIN_ID_MISSING_SAMPLE))
+		if (ImGui::Begin(WIN_ID_MISSING_SAMPLE, nullptr, ImGuiWindowFlags_NoScrollWithMouse))
 		{
 			float titlebarsize = ImGui::GetFontSize() + ImGui::GetStyle().FramePadding.y * 2.0f;
 
@@ -318,26 +521,24 @@ namespace finder
 			ImVec2 sp = win_pos;
 			sp.x += size.x - 10;
 			sp.y += size.y - 10;
+			float view_width = sp.x - win_pos.x;
+			float view_span = m_view_to - m_view_from;
 
 			if (m_show_spectrogram)
 			{
 				// Draw spectrogram
-				ImGui::GetWindowDrawList()->AddImage(
-					TexID(m_missing_spectral),
-					win_pos,
-					sp,
-					ImVec2(0, 0),
-					ImVec2(1, 1)
-				);
+				m_spectrogram_view.Draw(m_missing_spectrogram, win_pos.x, win_pos.y, sp.x, sp.y, m_view_from, m_view_to);
 
 				// Draw the peak plots
-				for (const std::pair<int, int>& p: m_missing.peaks)
+				for (const std::pair<int, int>& p: m_missing->peaks)
 				{
 					int i = p.second;
 					int j = p.first;
 
-					float vi = (((float)i / (float)m_missing.dims[0]) * (sp.x - win_pos.x));
-					float vj = (((float)j / (float)m_missing.dims[1]) * (sp.y - win_pos.y));
+					float vi = (((float)i / (float)m_missing->dims[0]) - m_view_from) / view_span * view_width;
+					float vj = (((float)j / (float)m_missing->dims[1]) * (sp.y - win_pos.y));
+					if (vi < 0.0f || vi > view_width)
+						continue;
 
 					vj = (sp.y - win_pos.y) - vj;
 
@@ -364,57 +565,84 @@ namespace finder
 			}
 			ImGui::PopStyleVar();
 
-			if (m_missing.loaded)
+			if (m_missing->loaded)
 			{
 				// Playhead
 				float playback_line_pos = 0.0f;
-				double mus_pos = Mix_GetMusicPosition(m_missing.sdl_object);
-				double mus_len = Mix_MusicDuration(m_missing.sdl_object);
-				playback_line_pos = (float)(mus_pos / mus_len) * size.x;
-				ImGui::GetWindowDrawList()->AddLine(
-					{
-						win_pos.x + playback_line_pos,
-						win_pos.y
-					},
-					{
-						win_pos.x + playback_line_pos,
-						sp.y
-					},
-					0xFF333333,
-					2.0f
-				);
+				if (m_missing->length > 0.0f)
+					playback_line_pos = ((float)(m_missing->GetPosition() / m_missing->length) - m_view_from) / view_span * view_width;
+				if (playback_line_pos >= 0.0f && playback_line_pos <= view_width)
+				{
+					ImGui::GetWindowDrawList()->AddLine(
+						{
+							win_pos.x + playback_line_pos,
+							win_pos.y
+						},
+						{
+							win_pos.x + playback_line_pos,
+							sp.y
+						},
+						0xFF333333,
+						2.0f
+					);
+				}
 
 				// UI elements
-				bool playing = Mix_PlayingMusic() && !Mix_PausedMusic();
+				bool playing = m_missing->IsPlaying();
 				const char* text = playing ? "Pause" : "Play";
 				if (ImGui::Button(text))
 				{
 					if (playing)
-						m_missing.Pause();
+						m_missing->Pause();
 					else
-						m_missing.Play();
+						m_missing->Play();
 				}
 
 				ImGui::SameLine();
 				if (ImGui::Button("Stop"))
-					m_missing.Stop();
+					m_missing->Stop();
 				ImGui::SameLine();
 				if (ImGui::Button("Reload"))
-					m_missing.Reload();
-				ImGui::SameLine();
-				if (ImGui::Button("Reprocess"))
-				{
-					Bitmap bmp(1024, 512);
-					m_missing.Process(&bmp);
-					m_missing_spectral.Load(bmp);
-				}
+					ReplaceSample(m_missing->path);
 
-				if (m_missing.processed)
+				if (m_missing->processed)
 				{
 					ImGui::SameLine();
 					ImGui::Checkbox("Spectrogram", &m_show_spectrogram);
 					ImGui::SameLine();
-					ImGui::Text("| Peaks: %i | %s", m_missing.peaks.size(), m_missing.path.c_str());
+					ImGui::Text("| Peaks: %i | %s", m_missing->peaks.size(), m_missing->path.c_str());
+				}
+
+				// Click anywhere else in the window to move the playhead there
+				if (ImGui::IsWindowHovered() && !ImGui::IsAnyItemHovered() && ImGui::IsMouseClicked(0))
+				{
+					float t = (ImGui::GetMousePos().x - win_pos.x) / view_width;
+					m_missing->Seek((m_view_from + std::clamp(t, 0.0f, 1.0f) * view_span) * m_missing->length);
+				}
+
+				// The mouse wheel zooms in and out around the cursor, dragging with the right button scrolls
+				if (ImGui::IsWindowHovered() && m_missing->length > 0.0f)
+				{
+					ImGuiIO& io = ImGui::GetIO();
+					float from = m_view_from;
+					float span = view_span;
+					if (io.MouseWheel != 0.0f)
+					{
+						float anchor = m_view_from + std::clamp((io.MousePos.x - win_pos.x) / view_width, 0.0f, 1.0f) * view_span;
+						span = std::clamp(view_span * powf(VIEW_ZOOM_STEP, -io.MouseWheel), std::min(1.0f, VIEW_MIN_SECONDS / m_missing->length), 1.0f);
+						from = anchor - (anchor - m_view_from) * span / view_span;
+					}
+					if (ImGui::IsMouseDragging(1))
+						from -= io.MouseDelta.x / view_width * span;
+					from = std::clamp(from, 0.0f, 1.0f - span);
+
+					if (from != m_view_from || from + span != m_view_to)
+					{
+						m_view_from = from;
+						m_view_to = from + span;
+						std::unique_ptr<Bitmap> waveform_bmp = m_missing->RenderWaveform(m_view_from, m_view_to);
+						m_missing_waveform.Load(*waveform_bmp);
+					}
 				}
 			}
 			else
@@ -426,41 +654,86 @@ namespace finder
 		}
 	}
 
+	/*
+	 * Only the rows in view get widgets, so a thousand matches cost the same as ten
+	 */
 	void UI::RenderMatches()
 	{	
 		if (ImGui::Begin(WIN_ID_MATCHES))
 		{
-			if (!m_library.matches.empty())
+			if (m_matches.GetTotal() > 0)
 			{
 				ImGui::Text("Here are songs that sound similar to this one:");
+				float min_confidence = m_matches.GetMinConfidence() * 100.0f;
+				ImGui::PushItemWidth(200.0f);
+				if (ImGui::SliderFloat("Min. confidence", &min_confidence, 0.0f, 100.0f, "%.0f%%"))
+					m_matches.SetMinConfidence(min_confidence / 100.0f);
+				ImGui::PopItemWidth();
+				ImGui::SameLine();
+				ImGui::Text("%d of %d shown", (int) m_matches.GetCount(), (int) m_matches.GetTotal());
 				ImGui::Separator();
 			}
 
-			int i = 1;
-			for (const FoundSong& match: m_library.matches)
+			ImGuiTableFlags table_flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_Sortable | ImGuiTableFlags_ScrollY | ImGuiTableFlags_Resizable;
+			if (m_matches.GetTotal() > 0 && ImGui::BeginTable("##matches", 7, table_flags))
 			{
-				if (i > 10) // Only want the top 10
-					continue;
-				std::string filename = std::filesystem::proximate(match.sid->path, m_library_path).string();
-				if (!match.sid)
-					continue;
-				ImGui::Text(
-					"#%d: "
-					"%s, "
-					"c: %.2f, ic: %.2f, fc: %.2f, "
-					"offsec: %f"
-					,
-					i,
-					filename.c_str(),
-					match.overall_confidence * 100.0f,
-					match.input_confidence * 100.0f,
-					match.fingerprinted_confidence * 100.0f,
-					match.offset_secs
-				);
-				// TODO: In the future, implement a little "compare" button for the #1 match that plays the audio at offset_secs
-				if (i == 1)
-					ImGui::Separator();
-				i++;
+				ImGui::TableSetupScrollFreeze(0, 1);
+				ImGui::TableSetupColumn("#", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_DefaultSort, 0.0f, SORT_RANK);
+				ImGui::TableSetupColumn("", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_NoSort);
+				ImGui::TableSetupColumn("File", ImGuiTableColumnFlags_WidthStretch | ImGuiTableColumnFlags_NoSort);
+				ImGui::TableSetupColumn("Confidence", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_PreferSortDescending, 0.0f, SORT_CONFIDENCE);
+				ImGui::TableSetupColumn("Input / library", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_NoSort);
+				ImGui::TableSetupColumn("Hashes", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_PreferSortDescending, 0.0f, SORT_HASHES);
+				ImGui::TableSetupColumn("Offset", ImGuiTableColumnFlags_WidthFixed, 0.0f, SORT_OFFSET);
+				ImGui::TableHeadersRow();
+
+				if (ImGuiTableSortSpecs* specs = ImGui::TableGetSortSpecs(); specs && specs->SpecsDirty)
+				{
+					if (specs->SpecsCount > 0)
+						m_matches.SetOrder((MatchSort) specs->Specs[0].ColumnUserID, specs->Specs[0].SortDirection == ImGuiSortDirection_Descending);
+					specs->SpecsDirty = false;
+				}
+
+				float duration = PreviewSeconds(*m_missing);
+				ImGuiListClipper clipper;
+				clipper.Begin((int) m_matches.GetCount());
+				while (clipper.Step())
+				{
+					for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++)
+					{
+						const FoundSong& match = m_matches.Get(row);
+						std::string filename = std::filesystem::proximate(match.sid->path, m_library_path).string();
+						float start = std::max(0.0f, match.offset_secs);
+						bool previewing = m_previews.IsPlaying(match.sid->path, start, duration);
+
+						ImGui::TableNextRow();
+						ImGui::TableNextColumn();
+						ImGui::Text("%d", m_matches.GetRank(row));
+						ImGui::TableNextColumn();
+						ImGui::PushID(row);
+						if (ImGui::SmallButton(previewing ? "Stop" : "Preview"))
+						{
+							if (previewing)
+								m_previews.Stop();
+							else
+								m_previews.Play(match.sid->path, start, duration);
+						}
+						ImGui::PopID();
+						ImGui::TableNextColumn();
+						ImGui::Text("%s", filename.c_str());
+						ImGui::TableNextColumn();
+						ImGui::Text("%.2f", match.overall_confidence * 100.0f);
+						ImGui::TableNextColumn();
+						ImGui::Text("%.2f / %.2f", match.input_confidence * 100.0f, match.fingerprinted_confidence * 100.0f);
+						ImGui::TableNextColumn();
+						ImGui::Text("%d", match.hashes_matched);
+						ImGui::TableNextColumn();
+						ImGui::Text("%.2fs", match.offset_secs);
+					}
+				}
+				clipper.End();
+
+				ImGui::EndTable();
 			}
 
 			ImGui::End();
@@ -490,26 +763,102 @@ namespace finder
 
 	void UI::RenderLibraryStats()
 	{
-		ImGui::SetNextWindowSize({ 320, 160 });
+		ImGui::SetNextWindowSize({ 480, 520 }, ImGuiCond_FirstUseEver);
 		if (ImGui::Begin(WIN_ID_LIBRARY_INFO, &m_show_library_stats))
 		{
+			std::shared_ptr<const LibrarySnapshot> snapshot = m_library.GetSnapshot();
 			ImGui::Text(
 				"%d files found\n"
 				"%d from cache\n"
 				"%d new entries"
 				,
-				m_library.files.size(),
-				m_library.exclude.size(),
-				m_library.files.size() - m_library.exclude.size()
+				(int) snapshot->tracks.size(),
+				snapshot->num_cached,
+				(int) snapshot->tracks.size() - snapshot->num_cached
 			);
 			ImGui::Separator();
 			ImGui::Text(
 				"%s total\n"
 				"%s avg."
 				,
-				FormatTime(m_library.avg_length * m_library.files.size()).c_str(),
-				FormatTime(m_library.avg_length).c_str()
+				FormatTime(snapshot->avg_length * snapshot->tracks.size()).c_str(),
+				FormatTime(snapshot->avg_length).c_str()
 			);
+			ImGui::Separator();
+			ImGui::Text(
+				"Settings profile %016llx\n"
+				"%d other profiles cached"
+				,
+				snapshot->profile,
+				snapshot->other_profiles
+			);
+			if (m_library.watcher)
+				ImGui::Text("Watching for changes, %d pending", m_library.watcher->GetPending());
+			ImGui::Separator();
+			ImGui::Text(
+				"%d frames in the last second\n"
+				"%.0f%% idle, %.1f%% rendering\n"
+				"%s idle, %s rendering in total"
+				,
+				m_loop_stats.frames,
+				m_loop_stats.idle * 100.0,
+				m_loop_stats.render * 100.0,
+				FormatTime(m_loop_stats.idle_total).c_str(),
+				FormatTime(m_loop_stats.render_total).c_str()
+			);
+
+			if (ImGui::CollapsingHeader("Profile"))
+			{
+#ifndef FINDER_DISABLE_PROFILING
+				// Summarizing goes over every thread and track, no need for that every frame
+				if (m_profile_time < 0.0 || ImGui::GetTime() - m_profile_time >= 1.0)
+				{
+					SummarizeProfile(m_profile);
+					m_profile_time = ImGui::GetTime();
+				}
+
+				if (ImGui::Button("Reset##profile"))
+				{
+					ResetProfile();
+					m_profile_time = -1.0;
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("Export Chrome trace...##profile"))
+					ExportTraceDialog();
+
+				ImGui::Text("By stage");
+				if (ImGui::BeginTable("##profile_stages", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+				{
+					ImGui::TableSetupColumn("Stage");
+					ImGui::TableSetupColumn("Calls");
+					ImGui::TableSetupColumn("Total ms");
+					ImGui::TableSetupColumn("Avg. ms");
+					ImGui::TableHeadersRow();
+					for (int s = 0; s < PROFILE_STAGE_COUNT; s++)
+					{
+						uint64 calls = m_profile.total.calls[s];
+						ImGui::TableNextRow();
+						ImGui::TableNextColumn();
+						ImGui::Text("%s", ProfileStageName((ProfileStage) s));
+						ImGui::TableNextColumn();
+						ImGui::Text("%llu", (unsigned long long) calls);
+						ImGui::TableNextColumn();
+						ImGui::Text("%.1f", m_profile.total.ns[s] / 1e6);
+						ImGui::TableNextColumn();
+						if (calls)
+							ImGui::Text("%.3f", m_profile.total.ns[s] / 1e6 / calls);
+					}
+					ImGui::EndTable();
+				}
+
+				ImGui::Text("By thread");
+				RenderProfileTable("##profile_threads", m_profile.threads, m_profile.threads.size());
+				ImGui::Text("Slowest tracks");
+				RenderProfileTable("##profile_tracks", m_profile.tracks, 20);
+#else
+				ImGui::TextDisabled("Profiling was compiled out of this build");
+#endif
+			}
 			ImGui::End();
 		}
 	}
@@ -555,14 +904,50 @@ namespace finder
 		if (ImGui::BeginPopupModal("Loading", nullptr, ImGuiWindowFlags_NoResize))
 		{
 			ImGui::Text("Please wait, be patient, stop whining, etc.");
-
-			{
-				std::unique_lock<std::mutex> lck(m_library.mutex);
-				ImGui::ProgressBar((float) m_library.load_min / (float) m_library.load_max, { -1, 0 });
-			}
+			ImGui::ProgressBar(LibraryProgress(m_library), { -1, 0 }, StageName(m_library.load_stage));
 
 			ImGui::EndPopup();
 		}
 		
 	}
+
+	/*
+	 * Whatever's running in the background, in the bottom right corner
+	 */
+	void UI::RenderJobs()
+	{
+		std::vector<std::shared_ptr<Job>> jobs = m_jobs.GetJobs();
+		bool library_busy = m_library.loading;
+		if (jobs.empty() && !library_busy)
+			return;
+
+		ImGuiViewport* viewport = ImGui::GetMainViewport();
+		ImVec2 corner(viewport->Pos.x + viewport->Size.x - 10.0f, viewport->Pos.y + viewport->Size.y - 10.0f);
+		ImGui::SetNextWindowPos(corner, ImGuiCond_Always, ImVec2(1.0f, 1.0f));
+		ImGui::SetNextWindowViewport(viewport->ID);
+		ImGui::SetNextWindowBgAlpha(0.8f);
+		ImGuiWindowFlags flags = ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoDocking |
+			ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoFocusOnAppearing | ImGuiWindowFlags_NoNav;
+		if (ImGui::Begin("##jobs", nullptr, flags))
+		{
+			if (library_busy)
+			{
+				ImGui::Text("Library");
+				ImGui::ProgressBar(LibraryProgress(m_library), { 200, 0 }, StageName(m_library.load_stage));
+			}
+			for (const std::shared_ptr<Job>& job: jobs)
+			{
+				ImGui::PushID(job.get());
+				ImGui::Text("%s", job->name.c_str());
+				ImGui::ProgressBar(job->progress, { 200, 0 });
+				ImGui::SameLine();
+				if (job->cancelled)
+					ImGui::TextDisabled("Cancelling");
+				else if (ImGui::SmallButton("Cancel"))
+					job->cancelled = true;
+				ImGui::PopID();
+			}
+		}
+		ImGui::End();
+	}
 }
@@ -0,0 +1,404 @@
+#include "SampleFinder.h"
+
+#include <string.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#endif
+
+namespace
+{
+	constexpr int EVENT_POLL_MS = 250;
+	constexpr int SETTLE_MS = 1000; // How long a file has to be left alone before we fingerprint it
+	constexpr size_t EVENT_BUFFER_SIZE = 64 * 1024;
+}
+
+namespace finder
+{
+	LibraryWatcher::LibraryWatcher(AudioLibrary& library):
+		m_library(library),
+		m_running(false),
+		m_inotify_fd(-1),
+		m_started(0)
+	{
+	}
+
+	LibraryWatcher::~LibraryWatcher()
+	{
+		Stop();
+	}
+
+#ifdef __linux__
+	ErrCode LibraryWatcher::Start()
+	{
+		m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_inotify_fd < 0)
+		{
+			std::cerr << "Failed to start watching " << m_library.library_path << ": " << strerror(errno) << std::endl;
+			return FAILURE;
+		}
+
+		// Whatever is there already was just loaded, so only the watches are needed
+		m_started = std::filesystem::file_time_type::clock::now().time_since_epoch().count();
+		AddWatches(m_library.library_path, nullptr);
+
+		m_running = true;
+		m_event_thread = std::thread(&LibraryWatcher::EventLoop, this);
+		m_worker_thread = std::thread(&LibraryWatcher::WorkerLoop, this);
+
+		std::cout << "Watching " << m_library.library_path << " (" << m_watches.size() << " directories)" << std::endl;
+
+		return SUCCESS;
+	}
+
+	void LibraryWatcher::Stop()
+	{
+		m_running = false;
+		m_pending_cv.notify_all();
+		if (m_event_thread.joinable())
+			m_event_thread.join();
+		if (m_worker_thread.joinable())
+			m_worker_thread.join();
+		if (m_inotify_fd >= 0)
+			close(m_inotify_fd);
+		m_inotify_fd = -1;
+	}
+
+	/*
+	 * Adds a watch for the directory and everything under it. Audio files found along the way are handed back, for
+	 * directories that showed up after we started.
+	 */
+	void LibraryWatcher::AddWatches(const std::string& directory, std::vector<std::string>* found)
+	{
+		const uint32 mask = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+		int wd = inotify_add_watch(m_inotify_fd, directory.c_str(), mask);
+		if (wd >= 0)
+			m_watches[wd] = directory;
+
+		std::error_code ec;
+		for (auto it = std::filesystem::recursive_directory_iterator(directory, std::filesystem::directory_options::skip_permission_denied, ec);
+			it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+		{
+			if (ec)
+				break;
+
+			std::string path = it->path().string();
+			if (it->is_directory(ec))
+			{
+				wd = inotify_add_watch(m_inotify_fd, path.c_str(), mask);
+				if (wd >= 0)
+					m_watches[wd] = path;
+			}
+			else if (found && IsAudioPath(path))
+			{
+				found->push_back(path);
+			}
+		}
+	}
+
+	void LibraryWatcher::EventLoop()
+	{
+		alignas(inotify_event) char buffer[EVENT_BUFFER_SIZE];
+
+		while (m_running)
+		{
+			pollfd pfd = { m_inotify_fd, POLLIN, 0 };
+			if (poll(&pfd, 1, EVENT_POLL_MS) <= 0)
+				continue;
+
+			ssize_t len = read(m_inotify_fd, buffer, sizeof(buffer));
+			if (len <= 0)
+				continue;
+
+			bool overflowed = false;
+			for (char* ptr = buffer; ptr < buffer + len; )
+			{
+				const inotify_event* event = reinterpret_cast<const inotify_event*>(ptr);
+				ptr += sizeof(inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					overflowed = true;
+					continue;
+				}
+
+				auto watch = m_watches.find(event->wd);
+				if (watch == m_watches.end())
+					continue;
+				if (event->mask & IN_IGNORED)
+				{
+					m_watches.erase(watch);
+					continue;
+				}
+				if (event->len == 0)
+					continue;
+
+				std::string path = watch->second + "/" + event->name;
+				if (event->mask & IN_ISDIR)
+				{
+					// A directory moving in brings all its files with it. One moving out or being deleted takes its tracks
+					// along, which the worker sorts out by path prefix.
+					if (event->mask & (IN_CREATE | IN_MOVED_TO))
+					{
+						std::vector<std::string> found;
+						AddWatches(path, &found);
+						for (const std::string& file: found)
+							Enqueue(file);
+					}
+					else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+					{
+						Enqueue(path);
+					}
+					continue;
+				}
+
+				if (IsAudioPath(path))
+					Enqueue(path);
+			}
+
+			if (overflowed)
+				Rescan();
+		}
+	}
+
+	/*
+	 * The kernel dropped events, so there's no telling what changed. Walk the library again and queue up whatever might
+	 * have: files that aren't tracks yet, tracks that aren't on disk anymore, and anything written since we started
+	 * watching. Everything else can't have changed under us, and queueing the rest would mean reading every file again.
+	 */
+	void LibraryWatcher::Rescan()
+	{
+		std::cerr << "Missed some changes to " << m_library.library_path << ", rescanning" << std::endl;
+
+		// Directories created in the meantime need watching too
+		AddWatches(m_library.library_path, nullptr);
+
+		std::vector<ManifestEntry> manifest;
+		if (CrawlLibrary(m_library.library_path, manifest) == FAILURE)
+			return;
+
+		std::unordered_set<std::string> tracks;
+		{
+			std::unique_lock<std::mutex> lck(m_library.mutex);
+			for (const Fingerprint* fp: m_library.fingerprints)
+				tracks.insert(fp->source->path);
+		}
+
+		for (const ManifestEntry& entry: manifest)
+		{
+			bool known = tracks.erase(entry.path) > 0;
+			if (!known || entry.mtime >= m_started)
+				Enqueue(entry.path);
+		}
+		for (const std::string& gone: tracks)
+			Enqueue(gone);
+	}
+
+	void LibraryWatcher::WorkerLoop()
+	{
+		// Indexing in the background shouldn't get in the way of anything else, the UI least of all
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+		while (m_running)
+		{
+			std::vector<std::string> ready;
+			{
+				std::unique_lock<std::mutex> lck(m_pending_mutex);
+				m_pending_cv.wait_for(lck, std::chrono::milliseconds(EVENT_POLL_MS));
+
+				auto now = std::chrono::steady_clock::now();
+				for (auto it = m_pending.begin(); it != m_pending.end(); )
+				{
+					if (now - it->second >= std::chrono::milliseconds(SETTLE_MS))
+					{
+						ready.push_back(it->first);
+						it = m_pending.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+			}
+			if (ready.empty())
+				continue;
+
+			// Stay out of the way while the library is loading, processing or saving
+			while (m_running)
+			{
+				std::unique_lock<std::mutex> applying(m_apply_mutex);
+				if (!m_library.loading)
+				{
+					ApplyChanges(ready);
+					break;
+				}
+				applying.unlock();
+				std::this_thread::sleep_for(std::chrono::milliseconds(EVENT_POLL_MS));
+			}
+		}
+	}
+#else
+	ErrCode LibraryWatcher::Start()
+	{
+		std::cerr << "Watching the library for changes is only supported on Linux" << std::endl;
+		return FAILURE;
+	}
+
+	void LibraryWatcher::Stop()
+	{
+	}
+
+	void LibraryWatcher::AddWatches(const std::string& directory, std::vector<std::string>* found)
+	{
+	}
+
+	void LibraryWatcher::Rescan()
+	{
+	}
+
+	void LibraryWatcher::EventLoop()
+	{
+	}
+
+	void LibraryWatcher::WorkerLoop()
+	{
+	}
+#endif
+
+	/*
+	 * Held while the library starts something that walks files, so we're never halfway through adding one at the time
+	 */
+	std::unique_lock<std::mutex> LibraryWatcher::Pause()
+	{
+		return std::unique_lock<std::mutex>(m_apply_mutex);
+	}
+
+	int LibraryWatcher::GetPending() const
+	{
+		std::unique_lock<std::mutex> lck(m_pending_mutex);
+		return m_pending.size();
+	}
+
+	void LibraryWatcher::Enqueue(const std::string& path)
+	{
+		// Events for the same file keep pushing its deadline back until it settles
+		std::unique_lock<std::mutex> lck(m_pending_mutex);
+		m_pending[path] = std::chrono::steady_clock::now();
+		m_pending_cv.notify_one();
+	}
+
+	/*
+	 * Work out what each settled path means for the library: a file that's there is new or changed, anything else was
+	 * deleted or moved away (possibly a whole directory of tracks). Fingerprints are reused by content digest just like
+	 * AudioLibrary::Load does, so moves and touched-but-unchanged files cost a read and nothing more.
+	 */
+	void LibraryWatcher::ApplyChanges(const std::vector<std::string>& paths)
+	{
+		std::unordered_map<std::string, SID> live;
+		std::unordered_map<uint64, SID> by_digest;
+		{
+			std::unique_lock<std::mutex> lck(m_library.mutex);
+			for (const Fingerprint* fp: m_library.fingerprints)
+			{
+				live[fp->source->path] = fp->source;
+				if (fp->source->digest)
+					by_digest[fp->source->digest] = fp->source;
+			}
+		}
+
+		std::vector<SID> added;
+		std::vector<SID> removed;
+		std::unordered_set<SID> removed_set;
+		auto remove = [&](SID sid)
+		{
+			if (removed_set.insert(sid).second)
+				removed.push_back(sid);
+		};
+
+		for (const std::string& path: paths)
+		{
+			std::error_code ec;
+			auto existing = live.find(path);
+			if (!std::filesystem::is_regular_file(path, ec))
+			{
+				if (existing != live.end())
+				{
+					remove(existing->second);
+					live.erase(existing);
+					continue;
+				}
+
+				std::string prefix = path + "/";
+				for (auto it = live.begin(); it != live.end(); )
+				{
+					if (it->first.compare(0, prefix.size(), prefix) == 0)
+					{
+						remove(it->second);
+						it = live.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+				continue;
+			}
+
+			uint64 digest = 0;
+			DigestFile(path, digest);
+			if (existing != live.end() && digest && existing->second->digest == digest)
+				continue;
+
+			std::shared_ptr<AudioFile> owned = std::make_shared<AudioFile>();
+			AudioFile* file = owned.get();
+
+			auto same = digest ? by_digest.find(digest) : by_digest.end();
+			if (same != by_digest.end())
+			{
+				file->path = path;
+				file->length = same->second->length;
+				file->fingerprint.hashes = same->second->fingerprint.hashes;
+				file->fingerprint.source = file;
+				file->processed = true;
+			}
+			else
+			{
+				if (file->Load(path) == FAILURE)
+					continue;
+				file->Process();
+			}
+			file->digest = digest;
+			{
+				std::unique_lock<std::mutex> lck(m_library.mutex);
+				m_library.files.push_back(std::move(owned));
+			}
+
+			if (existing != live.end())
+				remove(existing->second);
+			added.push_back(file);
+			live[path] = file;
+			if (digest)
+				by_digest[digest] = file;
+		}
+
+		if (added.empty() && removed.empty())
+			return;
+
+		m_library.UpdateTracks(added, removed);
+		std::cout << "Library updated: " << added.size() << " tracks added, " << removed.size() << " removed" << std::endl;
+	}
+}
@@ -0,0 +1,184 @@
+#include "SampleFinder.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+namespace
+{
+	constexpr size_t WAVEFORM_BASE_BIN = 256; // Samples per bin on the finest level
+	constexpr size_t WAVEFORM_LANES = 8; // Independent accumulators, so the compiler can keep them in one vector register
+	constexpr size_t BINS_PER_TASK = 256;
+
+	/*
+	 * Min, max and sum of squares of a run of samples. Keeping one accumulator per lane means no lane depends on another
+	 * until the end, which is what lets this vectorize without fast-math.
+	 */
+	void ScanSamples(const float* samples, size_t count, float& min, float& max, float& sum_sq)
+	{
+		float lo[WAVEFORM_LANES];
+		float hi[WAVEFORM_LANES];
+		float sq[WAVEFORM_LANES];
+		for (size_t l = 0; l < WAVEFORM_LANES; l++)
+		{
+			lo[l] = INFINITY;
+			hi[l] = -INFINITY;
+			sq[l] = 0.0f;
+		}
+
+		size_t i = 0;
+		for (; i + WAVEFORM_LANES <= count; i += WAVEFORM_LANES)
+		{
+			for (size_t l = 0; l < WAVEFORM_LANES; l++)
+			{
+				float v = samples[i + l];
+				lo[l] = v < lo[l] ? v : lo[l];
+				hi[l] = v > hi[l] ? v : hi[l];
+				sq[l] += v * v;
+			}
+		}
+		for (; i < count; i++)
+		{
+			float v = samples[i];
+			lo[0] = std::min(lo[0], v);
+			hi[0] = std::max(hi[0], v);
+			sq[0] += v * v;
+		}
+
+		min = lo[0];
+		max = hi[0];
+		sum_sq = sq[0];
+		for (size_t l = 1; l < WAVEFORM_LANES; l++)
+		{
+			min = std::min(min, lo[l]);
+			max = std::max(max, hi[l]);
+			sum_sq += sq[l];
+		}
+	}
+}
+
+namespace finder
+{
+	WaveformPyramid::WaveformPyramid():
+		m_samples(0),
+		m_peak(0.0f)
+	{
+	}
+
+	void WaveformPyramid::Build(const std::vector<float>& samples)
+	{
+		Clear();
+		m_samples = samples.size();
+		if (samples.empty())
+			return;
+
+		std::vector<Bin>& base = m_levels.emplace_back((m_samples + WAVEFORM_BASE_BIN - 1) / WAVEFORM_BASE_BIN);
+
+		std::vector<size_t> tasks((base.size() + BINS_PER_TASK - 1) / BINS_PER_TASK);
+		std::iota(tasks.begin(), tasks.end(), 0);
+		std::for_each(std::execution::par, tasks.begin(), tasks.end(), [&](size_t t)
+		{
+			size_t last = std::min(base.size(), (t + 1) * BINS_PER_TASK);
+			for (size_t b = t * BINS_PER_TASK; b < last; b++)
+			{
+				size_t first = b * WAVEFORM_BASE_BIN;
+				size_t count = std::min(WAVEFORM_BASE_BIN, m_samples - first);
+				ScanSamples(samples.data() + first, count, base[b].min, base[b].max, base[b].sum_sq);
+			}
+		});
+
+		// All the levels above the base add up to less than 1/256 of the signal, not worth spreading over threads
+		while (m_levels.back().size() > 1)
+		{
+			const std::vector<Bin>& below = m_levels.back();
+			std::vector<Bin> level((below.size() + 1) / 2);
+			for (size_t b = 0; b < level.size(); b++)
+			{
+				level[b] = below[b * 2];
+				if (b * 2 + 1 < below.size())
+				{
+					const Bin& other = below[b * 2 + 1];
+					level[b].min = std::min(level[b].min, other.min);
+					level[b].max = std::max(level[b].max, other.max);
+					level[b].sum_sq += other.sum_sq;
+				}
+			}
+			m_levels.push_back(std::move(level));
+		}
+
+		m_peak = std::max(fabsf(m_levels.back()[0].min), fabsf(m_levels.back()[0].max));
+	}
+
+	void WaveformPyramid::Clear()
+	{
+		m_levels.clear();
+		m_samples = 0;
+		m_peak = 0.0f;
+	}
+
+	/*
+	 * One bin per column for samples [first, last). Each column reads the coarsest level whose bins still fit inside it,
+	 * which is a handful of bins whatever the zoom. Zoomed in past the finest level, the samples are read directly.
+	 */
+	void WaveformPyramid::Summarize(const std::vector<float>& samples, size_t first, size_t last, int columns, std::vector<WaveformBin>& out) const
+	{
+		out.assign(std::max(columns, 0), { 0.0f, 0.0f, 0.0f });
+		last = std::min(last, m_samples);
+		if (m_levels.empty() || first >= last || columns <= 0)
+			return;
+
+		size_t span = last - first;
+		for (int c = 0; c < columns; c++)
+		{
+			size_t a = first + span * c / columns;
+			size_t b = std::max(a + 1, first + span * (c + 1) / columns);
+			if (a >= m_samples)
+				break;
+			b = std::min(b, m_samples);
+
+			float min, max, sum_sq;
+			size_t count;
+			if (b - a < WAVEFORM_BASE_BIN)
+			{
+				ScanSamples(samples.data() + a, b - a, min, max, sum_sq);
+				count = b - a;
+			}
+			else
+			{
+				size_t level = 0;
+				while (level + 1 < m_levels.size() && (WAVEFORM_BASE_BIN << (level + 1)) <= b - a)
+					level++;
+
+				size_t bin_size = WAVEFORM_BASE_BIN << level;
+				size_t first_bin = a / bin_size;
+				size_t last_bin = std::min(m_levels[level].size(), (b + bin_size - 1) / bin_size);
+				min = INFINITY;
+				max = -INFINITY;
+				sum_sq = 0.0f;
+				for (size_t i = first_bin; i < last_bin; i++)
+				{
+					const Bin& bin = m_levels[level][i];
+					min = std::min(min, bin.min);
+					max = std::max(max, bin.max);
+					sum_sq += bin.sum_sq;
+				}
+				count = std::min(last_bin * bin_size, m_samples) - first_bin * bin_size;
+			}
+
+			out[c] = { min, max, sqrtf(sum_sq / count) };
+		}
+	}
+
+	float WaveformPyramid::GetPeak() const
+	{
+		return m_peak;
+	}
+
+	bool WaveformPyramid::IsEmpty() const
+	{
+		return m_levels.empty();
+	}
+}